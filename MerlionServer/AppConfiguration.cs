@@ -296,6 +296,44 @@ namespace Merlion.Server
 			get { return Convert.ToBoolean(AppConfiguration.AppSettings["ForwardLogToMaster"]); }
 		}
 
+		public static bool ShardIoServices
+		{
+			get { return Convert.ToBoolean(AppConfiguration.AppSettings["ShardIoServices"]); }
+		}
+		public static int NumIoThreads
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["NumIoThreads"]); }
+		}
+		public static string IoCpus
+		{
+			get { return AppConfiguration.AppSettings["IoCpus"]; }
+		}
+		public static int NumDeployThreads
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["NumDeployThreads"]); }
+		}
+		public static int NumCallbackThreads
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["NumCallbackThreads"]); }
+		}
+		public static string BlockingCpus
+		{
+			get { return AppConfiguration.AppSettings["BlockingCpus"]; }
+		}
+		public static int IoThreadNiceness
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["IoThreadNiceness"]); }
+		}
+		public static int BlockingThreadNiceness
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["BlockingThreadNiceness"]); }
+		}
+
+		public static int NumDataChannels
+		{
+			get { return Convert.ToInt32(AppConfiguration.AppSettings["NumDataChannels"]); }
+		}
+
 		public static int UpstreamBufferSize
 		{
 			get { return Convert.ToInt32(AppConfiguration.AppSettings["UpstreamBufferSize"]); }
@@ -50,6 +50,7 @@ namespace Merlion.Server
 			param = new NativeServerInterop.NodeParameters ();
 			param.NodeName = name;
 			param.MasterEndpoint = ep.ToString ();
+			param.NumDataChannels = AppConfiguration.NumDataChannels;
 			param.PackagePathProvider = versionManager.GetPackagePathForVersion;
 			param.PackageDownloadPathProvider = versionManager.GetDownloadPathForVersion;
 			param.DeployPackageMethod = (ver) => {
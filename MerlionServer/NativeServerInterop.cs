@@ -78,7 +78,12 @@ namespace Merlion.Server
 		enum MSCMasterFlags : uint
 		{
 			MSCMF_None = 0,
-			MSCMF_DisallowVersionSpecification = 1 << 0
+			MSCMF_DisallowVersionSpecification = 1 << 0,
+			MSCMF_TerminateWebSocket = 1 << 1,
+			MSCMF_DisableSslSessionResumption = 1 << 2,
+			MSCMF_EnableKernelTls = 1 << 3,
+			MSCMF_EnableWebSocketCompression = 1 << 4,
+			MSCMF_WebSocketCompressionNoContextTakeover = 1 << 5
 		}
 
 		struct MSCMasterParameters
@@ -103,6 +108,20 @@ namespace Merlion.Server
 			public IntPtr packagePathCallbackUserData;
 
 			public MSCMasterFlags flags;
+
+			public uint sslSessionCacheSize;
+			public uint sslSessionTimeout;
+			public uint sslTicketKeyRotationInterval;
+
+			public uint maxConcurrentHandshakes;
+			public uint maxQueuedHandshakes;
+
+			public uint webSocketCompressionWindowBits;
+			public uint webSocketCompressionMemoryLevel;
+			public uint webSocketCompressionLevel;
+			public uint webSocketMaxInflatedMessageSize;
+
+			public uint numClientAcceptors;
 		}
 
 		delegate uint MSCGetVersionPackagePathCallback 
@@ -111,12 +130,69 @@ namespace Merlion.Server
 		delegate uint MSCDeployPackageCallback
 		(string versionName, IntPtr userdata);
 
+		[Flags]
+		enum MSCLibraryFlags : uint
+		{
+			MSCLF_None = 0,
+			MSCLF_ShardIoServices = 1 << 0
+		}
+
+		struct MSCLibraryParameters
+		{
+			public MSCLibraryFlags flags;
+
+			public uint numIoThreads;
+			[MarshalAs(UnmanagedType.LPStr)]
+			public string ioCpus;
+
+			public uint numDeployThreads;
+			public uint numCallbackThreads;
+			[MarshalAs(UnmanagedType.LPStr)]
+			public string blockingCpus;
+
+			public int ioThreadNiceness;
+			public int blockingThreadNiceness;
+		}
+
+		struct MSCLibraryStatistics
+		{
+			public uint numIoServices;
+			public uint numIoThreads;
+			public uint numDeployThreads;
+			public uint numCallbackThreads;
+
+			public ulong maxIoQueueDelay;
+			public ulong averageIoQueueDelay;
+
+			public ulong numPendingDeployTasks;
+			public ulong numCompletedDeployTasks;
+			public ulong numPendingCallbackTasks;
+			public ulong numCompletedCallbackTasks;
+		}
+
 		[DllImport("MerlionServerCore")]
 		static extern MSCResult MSCLibraryCreate(out MSCLibrarySafeHandle libOut);
 
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCLibraryCreateEx(ref MSCLibraryParameters param, out MSCLibrarySafeHandle libOut);
+
 		[DllImport("MerlionServerCore")]
 		static extern MSCResult MSCLibraryDestroy(IntPtr library);
 
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCLibraryGetStatistics(MSCLibrarySafeHandle library, out MSCLibraryStatistics outStats);
+
+		struct MSCRelayStatistics
+		{
+			public ulong numPipes;
+			public ulong numReads;
+			public ulong numBytes;
+			public ulong numBufferBytes;
+		}
+
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCGetRelayStatistics(out MSCRelayStatistics stats);
+
 		[DllImport("MerlionServerCore")]
 		static extern MSCResult MSCMasterCreate(
 			MSCLibrarySafeHandle library,
@@ -256,6 +332,7 @@ namespace Merlion.Server
 
 			public IntPtr failureCallbackUserData;
 
+			public uint numDataChannels;
 
 		}
 
@@ -299,9 +376,44 @@ namespace Merlion.Server
 		static extern MSCResult MSCClientSocketReceive(MSCClientSocketSafeHandle socket,
 			IntPtr callback, IntPtr userdata);
 		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketStartReceiving(MSCClientSocketSafeHandle socket,
+			uint credit, IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketGrantReceiveCredit(MSCClientSocketSafeHandle socket,
+			uint credit);
+		[DllImport("MerlionServerCore")]
 		static extern MSCResult MSCClientSocketSend(MSCClientSocketSafeHandle socket,
 			IntPtr data, int dataLength,
 			IntPtr callback, IntPtr userdata);
+		struct MSCClientSocketBuffer
+		{
+			public IntPtr data;
+			public int dataLength;
+		}
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketSendv(MSCClientSocketSafeHandle socket,
+			[In] MSCClientSocketBuffer[] messages, int numMessages,
+			IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketBroadcast(IntPtr[] sockets, int numSockets,
+			IntPtr data, int dataLength,
+			IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketBeginReceiveMessage(MSCClientSocketSafeHandle socket,
+			IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketReadMessage(MSCClientSocketSafeHandle socket,
+			uint maxLength, IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketBeginSendMessage(MSCClientSocketSafeHandle socket,
+			IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketWriteMessage(MSCClientSocketSafeHandle socket,
+			IntPtr data, int dataLength,
+			IntPtr callback, IntPtr userdata);
+		[DllImport("MerlionServerCore")]
+		static extern MSCResult MSCClientSocketEndSendMessage(MSCClientSocketSafeHandle socket,
+			IntPtr callback, IntPtr userdata);
 
 		static unsafe string GetLastError()
 		{
@@ -480,23 +592,95 @@ namespace Merlion.Server
 			public delegate void DeployPackageDelegate (string versionName);
 
 			public bool DisallowVersionSpecification;
+			public bool TerminateWebSocket;
+			public bool DisableSslSessionResumption;
+			public bool EnableKernelTls;
+			public bool EnableWebSocketCompression;
+			public bool WebSocketCompressionNoContextTakeover;
 			public string NodeEndpoint;
 			public string ClientEndpoint;
 			public string SslCertificateFile;
 			public string SslPrivateKeyFile;
 			public string SslPassword;
+			// Zero selects the default of the native library.
+			public int SslSessionCacheSize;
+			public int SslSessionTimeout;
+			public int SslTicketKeyRotationInterval;
+			public int MaxConcurrentHandshakes;
+			public int MaxQueuedHandshakes;
+			public int WebSocketCompressionWindowBits;
+			public int WebSocketCompressionMemoryLevel;
+			public int WebSocketCompressionLevel;
+			public int WebSocketMaxInflatedMessageSize;
+			public int NumClientAcceptors;
 			public PackagePathDelegate PackagePathProvider;
 		}
 
+		public sealed class RelayStatistics
+		{
+			public long NumPipes;
+			public long NumReads;
+			public long NumBytes;
+			public long NumBufferBytes;
+		}
+
+		public sealed class LibraryParameters
+		{
+			public bool ShardIoServices;
+			public int NumIoThreads;
+			public string IoCpus;
+			public int NumDeployThreads;
+			public int NumCallbackThreads;
+			public string BlockingCpus;
+			public int IoThreadNiceness;
+			public int BlockingThreadNiceness;
+		}
+
+		public sealed class LibraryStatistics
+		{
+			public int NumIoServices;
+			public int NumIoThreads;
+			public int NumDeployThreads;
+			public int NumCallbackThreads;
+			public TimeSpan MaxIoQueueDelay;
+			public TimeSpan AverageIoQueueDelay;
+			public long NumPendingDeployTasks;
+			public long NumCompletedDeployTasks;
+			public long NumPendingCallbackTasks;
+			public long NumCompletedCallbackTasks;
+		}
+
 		public sealed class Library: IDisposable
 		{
 			readonly MSCLibrarySafeHandle handle;
 
-			public static Library Instance = new Library();
-
-			Library()
+			public static Library Instance = new Library(new LibraryParameters() {
+				ShardIoServices = AppConfiguration.ShardIoServices,
+				NumIoThreads = AppConfiguration.NumIoThreads,
+				IoCpus = AppConfiguration.IoCpus,
+				NumDeployThreads = AppConfiguration.NumDeployThreads,
+				NumCallbackThreads = AppConfiguration.NumCallbackThreads,
+				BlockingCpus = AppConfiguration.BlockingCpus,
+				IoThreadNiceness = AppConfiguration.IoThreadNiceness,
+				BlockingThreadNiceness = AppConfiguration.BlockingThreadNiceness
+			});
+
+			Library(LibraryParameters param)
 			{
-				CheckResult(MSCLibraryCreate(out handle));
+				var paramMarshaled = new MSCLibraryParameters() {
+					flags = MSCLibraryFlags.MSCLF_None,
+					numIoThreads = checked((uint)param.NumIoThreads),
+					ioCpus = param.IoCpus,
+					numDeployThreads = checked((uint)param.NumDeployThreads),
+					numCallbackThreads = checked((uint)param.NumCallbackThreads),
+					blockingCpus = param.BlockingCpus,
+					ioThreadNiceness = param.IoThreadNiceness,
+					blockingThreadNiceness = param.BlockingThreadNiceness
+				};
+				if (param.ShardIoServices) {
+					paramMarshaled.flags |= MSCLibraryFlags.MSCLF_ShardIoServices;
+				}
+				CheckResult(MSCLibraryCreateEx(ref paramMarshaled, out handle));
 			}
 
 			public void Dispose()
@@ -508,6 +692,36 @@ namespace Merlion.Server
 			{
 				get { return handle; }
 			}
+
+			public LibraryStatistics GetStatistics()
+			{
+				MSCLibraryStatistics stats;
+				CheckResult(MSCLibraryGetStatistics(handle, out stats));
+				return new LibraryStatistics() {
+					NumIoServices = (int)stats.numIoServices,
+					NumIoThreads = (int)stats.numIoThreads,
+					NumDeployThreads = (int)stats.numDeployThreads,
+					NumCallbackThreads = (int)stats.numCallbackThreads,
+					MaxIoQueueDelay = TimeSpan.FromTicks((long)stats.maxIoQueueDelay * 10),
+					AverageIoQueueDelay = TimeSpan.FromTicks((long)stats.averageIoQueueDelay * 10),
+					NumPendingDeployTasks = (long)stats.numPendingDeployTasks,
+					NumCompletedDeployTasks = (long)stats.numCompletedDeployTasks,
+					NumPendingCallbackTasks = (long)stats.numPendingCallbackTasks,
+					NumCompletedCallbackTasks = (long)stats.numCompletedCallbackTasks
+				};
+			}
+
+			public static RelayStatistics GetRelayStatistics()
+			{
+				MSCRelayStatistics stats;
+				CheckResult(MSCGetRelayStatistics(out stats));
+				return new RelayStatistics() {
+					NumPipes = (long)stats.numPipes,
+					NumReads = (long)stats.numReads,
+					NumBytes = (long)stats.numBytes,
+					NumBufferBytes = (long)stats.numBufferBytes
+				};
+			}
 		}
 
 		public sealed class Master: IDisposable
@@ -526,11 +740,36 @@ namespace Merlion.Server
 					sslPrivateKeyFile = param.SslPrivateKeyFile,
 					sslPassword = param.SslPassword,
 					packagePathCallback = HandleMSCGetVersionPackagePathCallback,
-					flags = MSCMasterFlags.MSCMF_None
+					flags = MSCMasterFlags.MSCMF_None,
+					sslSessionCacheSize = checked((uint)param.SslSessionCacheSize),
+					sslSessionTimeout = checked((uint)param.SslSessionTimeout),
+					sslTicketKeyRotationInterval = checked((uint)param.SslTicketKeyRotationInterval),
+					maxConcurrentHandshakes = checked((uint)param.MaxConcurrentHandshakes),
+					maxQueuedHandshakes = checked((uint)param.MaxQueuedHandshakes),
+					webSocketCompressionWindowBits = checked((uint)param.WebSocketCompressionWindowBits),
+					webSocketCompressionMemoryLevel = checked((uint)param.WebSocketCompressionMemoryLevel),
+					webSocketCompressionLevel = checked((uint)param.WebSocketCompressionLevel),
+					webSocketMaxInflatedMessageSize = checked((uint)param.WebSocketMaxInflatedMessageSize),
+					numClientAcceptors = checked((uint)param.NumClientAcceptors)
 				};
 				if (param.DisallowVersionSpecification) {
 					paramMarshaled.flags |= MSCMasterFlags.MSCMF_DisallowVersionSpecification;
 				}
+				if (param.TerminateWebSocket) {
+					paramMarshaled.flags |= MSCMasterFlags.MSCMF_TerminateWebSocket;
+				}
+				if (param.DisableSslSessionResumption) {
+					paramMarshaled.flags |= MSCMasterFlags.MSCMF_DisableSslSessionResumption;
+				}
+				if (param.EnableKernelTls) {
+					paramMarshaled.flags |= MSCMasterFlags.MSCMF_EnableKernelTls;
+				}
+				if (param.EnableWebSocketCompression) {
+					paramMarshaled.flags |= MSCMasterFlags.MSCMF_EnableWebSocketCompression;
+				}
+				if (param.WebSocketCompressionNoContextTakeover) {
+					paramMarshaled.flags |= MSCMasterFlags.MSCMF_WebSocketCompressionNoContextTakeover;
+				}
 				CheckResult(MSCMasterCreate(library.SafeHandle, paramMarshaled, out handle));
 			}
 
@@ -679,6 +918,7 @@ namespace Merlion.Server
 			public SetupClientDelegate SetupClientMethod;
 			public DiscardClientDelegate DiscardClientMethod;
 			public FailureDelegate FailureHandler;
+			public int NumDataChannels;
 		}
 		public sealed class Node: IDisposable
 		{
@@ -700,7 +940,8 @@ namespace Merlion.Server
 					acceptClientCallback = HandleMSCAcceptClientCallback,
 					discardClientCallback = HandleMSCDiscardClientCallback,
 					setupClientCallback = HandleMSCSetupClientCallback,
-					failureCallback = HandleMSCNodeFailureCallback
+					failureCallback = HandleMSCNodeFailureCallback,
+					numDataChannels = checked((uint)param.NumDataChannels)
 				};
 				CheckResult(MSCNodeCreate(library.SafeHandle, paramMarshaled, out handle));
 			}
@@ -892,9 +1133,11 @@ namespace Merlion.Server
 			public delegate void SendCallbackDelegate(Exception error);
 
 			MSCClientSocketReceiveCallback receiveCallback;
+			MSCClientSocketReceiveCallback streamingReceiveCallback;
 			MSCClientSocketSendCallback sendCallback;
 
 			IntPtr receiveCallbackPtr;
+			IntPtr streamingReceiveCallbackPtr;
 			IntPtr sendCallbackPtr;
 
 			public ClientSocket(IntPtr handle)
@@ -929,6 +1172,33 @@ namespace Merlion.Server
 				};
 				receiveCallbackPtr = Marshal.GetFunctionPointerForDelegate(receiveCallback);
 
+				// Called for every message; the last call reports the error.
+				streamingReceiveCallback = (unmanagedData, dataLength, error, userdata) => {
+					var gcHandle = GCHandle.FromIntPtr(userdata);
+					var callback = ((Tuple<ReceiveCallbackDelegate, object>)gcHandle.Target).Item1;
+					Exception exc = null;
+					if (!string.IsNullOrEmpty(error)) {
+						exc = new Exception(error);
+					}
+					try {
+						byte[] data = null;
+						if (unmanagedData != new IntPtr(0)) {
+							data = new byte[dataLength];
+							Marshal.Copy(unmanagedData, data, 0, dataLength);
+						}
+
+						callback(data, exc);
+						return 0;
+					} catch (Exception e) {
+						return 1;
+					} finally {
+						if (exc != null) {
+							gcHandle.Free();
+						}
+					}
+				};
+				streamingReceiveCallbackPtr = Marshal.GetFunctionPointerForDelegate(streamingReceiveCallback);
+
 				sendCallback = (error, userdata) => {
 					var gcHandle = GCHandle.FromIntPtr(userdata);
 					var callback = ((Tuple<SendCallbackDelegate, object>)gcHandle.Target).Item1;
@@ -968,6 +1238,34 @@ namespace Merlion.Server
 				}
 			}
 
+			/// <summary>
+			/// Calls <paramref name="callback"/> for every received message until the socket is
+			/// disconnected. At most <paramref name="credit"/> messages are delivered until
+			/// more credit is granted by <see cref="GrantReceiveCredit"/>.
+			/// </summary>
+			public void StartReceiving(ReceiveCallbackDelegate callback, uint credit)
+			{
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+
+				var wrappedCallback = new Tuple<ReceiveCallbackDelegate, object> (callback, streamingReceiveCallback);
+				var wrappedCallbackHandle = GCHandle.Alloc (wrappedCallback);
+
+				try {
+					var result = MSCClientSocketStartReceiving (handle, credit,
+						streamingReceiveCallbackPtr, GCHandle.ToIntPtr(wrappedCallbackHandle));
+					CheckResult (result);
+				} catch {
+					wrappedCallbackHandle.Free ();
+					throw;
+				}
+			}
+
+			public void GrantReceiveCredit(uint credit)
+			{
+				CheckResult (MSCClientSocketGrantReceiveCredit (handle, credit));
+			}
+
 			public void Send(byte[] data, int offset, int length, SendCallbackDelegate callback)
 			{
 				if (callback == null)
@@ -994,6 +1292,215 @@ namespace Merlion.Server
 				}
 			}
 
+			/// <summary>
+			/// Sends multiple messages with a single write.
+			/// <paramref name="callback"/> is called once all of them have been sent.
+			/// </summary>
+			public void Sendv(IList<ArraySegment<byte>> messages, SendCallbackDelegate callback)
+			{
+				if (messages == null)
+					throw new ArgumentNullException ("messages");
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+
+				var buffers = new MSCClientSocketBuffer[messages.Count];
+				var pins = new GCHandle[messages.Count];
+				var wrappedCallback = new Tuple<SendCallbackDelegate, object> (callback, sendCallback);
+				var wrappedCallbackHandle = GCHandle.Alloc (wrappedCallback);
+
+				try {
+					for (int i = 0; i < buffers.Length; ++i) {
+						var message = messages[i];
+						if (message.Array == null)
+							throw new ArgumentNullException ("messages");
+						pins[i] = GCHandle.Alloc (message.Array, GCHandleType.Pinned);
+						buffers[i].data = new IntPtr((byte *)pins[i].AddrOfPinnedObject() + message.Offset);
+						buffers[i].dataLength = message.Count;
+					}
+
+					// Messages are copied before MSCClientSocketSendv returns.
+					var result = MSCClientSocketSendv (handle, buffers, buffers.Length,
+						sendCallbackPtr, GCHandle.ToIntPtr(wrappedCallbackHandle));
+					CheckResult (result);
+				} catch {
+					wrappedCallbackHandle.Free ();
+					throw;
+				} finally {
+					foreach (var pin in pins) {
+						if (pin.IsAllocated) {
+							pin.Free ();
+						}
+					}
+				}
+			}
+
+			delegate MSCResult StreamOperation(IntPtr callback, IntPtr userdata);
+
+			void StartStreamOperation(SendCallbackDelegate callback, StreamOperation operation)
+			{
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+
+				var wrappedCallback = new Tuple<SendCallbackDelegate, object> (callback, sendCallback);
+				var wrappedCallbackHandle = GCHandle.Alloc (wrappedCallback);
+
+				try {
+					CheckResult (operation (sendCallbackPtr, GCHandle.ToIntPtr(wrappedCallbackHandle)));
+				} catch {
+					wrappedCallbackHandle.Free ();
+					throw;
+				}
+			}
+
+			/// <summary>
+			/// Waits for a message of any length, whose payload is then read by
+			/// <see cref="ReadMessage"/>.
+			/// </summary>
+			public void BeginReceiveMessage(SendCallbackDelegate callback)
+			{
+				StartStreamOperation (callback, (cb, userdata) =>
+					MSCClientSocketBeginReceiveMessage (handle, cb, userdata));
+			}
+
+			/// <summary>
+			/// Reads up to <paramref name="maxLength"/> bytes of the message being received.
+			/// An empty array indicates the end of the message.
+			/// </summary>
+			public void ReadMessage(int maxLength, ReceiveCallbackDelegate callback)
+			{
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+				if (maxLength <= 0)
+					throw new ArgumentOutOfRangeException ("maxLength");
+
+				var wrappedCallback = new Tuple<ReceiveCallbackDelegate, object> (callback, receiveCallback);
+				var wrappedCallbackHandle = GCHandle.Alloc (wrappedCallback);
+
+				try {
+					var result = MSCClientSocketReadMessage (handle, (uint)maxLength,
+						receiveCallbackPtr, GCHandle.ToIntPtr(wrappedCallbackHandle));
+					CheckResult (result);
+				} catch {
+					wrappedCallbackHandle.Free ();
+					throw;
+				}
+			}
+
+			/// <summary>
+			/// Starts a message whose payload is written by <see cref="WriteMessage"/>
+			/// and finished by <see cref="EndSendMessage"/>.
+			/// </summary>
+			public void BeginSendMessage(SendCallbackDelegate callback)
+			{
+				StartStreamOperation (callback, (cb, userdata) =>
+					MSCClientSocketBeginSendMessage (handle, cb, userdata));
+			}
+
+			public void WriteMessage(byte[] data, int offset, int length, SendCallbackDelegate callback)
+			{
+				if (data == null)
+					throw new ArgumentNullException ("data");
+				if (offset < 0)
+					throw new ArgumentOutOfRangeException ("offset");
+				if (length < 0 || checked(length + offset) > data.Length)
+					throw new ArgumentOutOfRangeException ("length");
+
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+
+				var wrappedCallback = new Tuple<SendCallbackDelegate, object> (callback, sendCallback);
+				var wrappedCallbackHandle = GCHandle.Alloc (wrappedCallback);
+
+				try {
+					// The data is copied before MSCClientSocketWriteMessage returns.
+					fixed (byte *ptr = data) {
+						var result = MSCClientSocketWriteMessage (handle, new IntPtr(ptr + offset), length,
+							sendCallbackPtr, GCHandle.ToIntPtr(wrappedCallbackHandle));
+						CheckResult (result);
+					}
+				} catch {
+					wrappedCallbackHandle.Free ();
+					throw;
+				}
+			}
+
+			public void EndSendMessage(SendCallbackDelegate callback)
+			{
+				StartStreamOperation (callback, (cb, userdata) =>
+					MSCClientSocketEndSendMessage (handle, cb, userdata));
+			}
+
+			static readonly MSCClientSocketSendCallback broadcastCallback = (error, userdata) => {
+				var gcHandle = GCHandle.FromIntPtr(userdata);
+				var callback = (SendCallbackDelegate)gcHandle.Target;
+				try {
+					try {
+						Exception exc = null;
+						if (!string.IsNullOrEmpty(error)) {
+							exc = new Exception(error);
+						}
+
+						callback(exc);
+						return 0;
+					} catch {
+						return 1;
+					}
+				} finally {
+					gcHandle.Free();
+				}
+			};
+			static readonly IntPtr broadcastCallbackPtr = Marshal.GetFunctionPointerForDelegate(broadcastCallback);
+
+			/// <summary>
+			/// Sends the same message to all of the given sockets. The message is encoded only once.
+			/// <paramref name="callback"/> is called once all sends have completed.
+			/// </summary>
+			public static void Broadcast(IList<ClientSocket> sockets, byte[] data, int offset, int length, SendCallbackDelegate callback)
+			{
+				if (sockets == null)
+					throw new ArgumentNullException ("sockets");
+				if (callback == null)
+					throw new ArgumentNullException ("callback");
+				if (data == null)
+					throw new ArgumentNullException ("data");
+				if (offset < 0)
+					throw new ArgumentOutOfRangeException ("offset");
+				if (length < 0 || checked(length + offset) > data.Length)
+					throw new ArgumentOutOfRangeException ("length");
+
+				if (sockets.Count == 0) {
+					callback (null);
+					return;
+				}
+
+				var handles = new IntPtr[sockets.Count];
+				var addedRefs = new bool[sockets.Count];
+				var callbackHandle = GCHandle.Alloc (callback);
+
+				try {
+					for (int i = 0; i < handles.Length; ++i) {
+						sockets[i].handle.DangerousAddRef (ref addedRefs[i]);
+						handles[i] = sockets[i].handle.DangerousGetHandle ();
+					}
+
+					fixed (byte *ptr = data) {
+						var result = MSCClientSocketBroadcast (handles, handles.Length,
+							new IntPtr(ptr + offset), length,
+							broadcastCallbackPtr, GCHandle.ToIntPtr(callbackHandle));
+						CheckResult (result);
+					}
+				} catch {
+					callbackHandle.Free ();
+					throw;
+				} finally {
+					for (int i = 0; i < handles.Length; ++i) {
+						if (addedRefs[i]) {
+							sockets[i].handle.DangerousRelease ();
+						}
+					}
+				}
+			}
+
 			~ClientSocket()
 			{
 				Dispose();
@@ -0,0 +1,97 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "AdmissionControl.hpp"
+
+namespace mcore
+{
+	AdmissionControl::AdmissionControl(std::size_t maxActive, std::size_t maxQueued):
+	maxActive(maxActive),
+	maxQueued(maxQueued)
+	{ }
+	
+	AdmissionControl::Ticket AdmissionControl::enter(StartFunction start)
+	{
+		Ticket ticket;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ticket = nextTicket++;
+			if (active >= maxActive) {
+				if (queue.size() >= maxQueued) {
+					return Rejected;
+				}
+				queue.emplace(ticket, std::move(start));
+				return ticket;
+			}
+			++active;
+		}
+		
+		if (!start()) {
+			leave();
+		}
+		return ticket;
+	}
+	
+	bool AdmissionControl::cancel(Ticket ticket)
+	{
+		StartFunction removed;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = queue.find(ticket);
+			if (it == queue.end()) {
+				return false;
+			}
+			removed = std::move(it->second);
+			queue.erase(it);
+		}
+		// `removed` may own objects whose destructors use this.
+		return true;
+	}
+	
+	void AdmissionControl::leave()
+	{
+		while (true) {
+			StartFunction next;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (queue.empty()) {
+					--active;
+					return;
+				}
+				// The slot is handed over to the next task.
+				next = std::move(queue.begin()->second);
+				queue.erase(queue.begin());
+			}
+			
+			if (next()) {
+				return;
+			}
+		}
+	}
+	
+	std::size_t AdmissionControl::numActive()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return active;
+	}
+	
+	std::size_t AdmissionControl::numQueued()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <cstdint>
+#include <mutex>
+#include <functional>
+#include <boost/noncopyable.hpp>
+
+namespace mcore
+{
+	/** Limits the number of tasks running at once. Tasks beyond the
+	 * limit wait in a bounded queue, and ones that don't fit in it are
+	 * turned away. */
+	class AdmissionControl :
+	boost::noncopyable
+	{
+	public:
+		/** Starts a task. Returns `false` if the task turned out to be
+		 * unnecessary (e.g. its client has gone), which frees the slot. */
+		using StartFunction = std::function<bool()>;
+		
+		/** Identifies a call to <enter>. */
+		using Ticket = std::uint64_t;
+		static constexpr Ticket Rejected = 0;
+		
+		AdmissionControl(std::size_t maxActive, std::size_t maxQueued);
+		
+		/** Calls `start` now or once a slot is available. Returns
+		 * `Rejected` without calling it if the queue is full. */
+		Ticket enter(StartFunction start);
+		
+		/** Removes a task from the queue so that it no longer holds a
+		 * place there. Returns `false` if it isn't queued (e.g. it has
+		 * already been started). */
+		bool cancel(Ticket);
+		
+		/** Must be called once for every task that has been started. */
+		void leave();
+		
+		std::size_t numActive();
+		std::size_t numQueued();
+		
+	private:
+		std::size_t const maxActive;
+		std::size_t const maxQueued;
+		std::mutex mutex;
+		std::size_t active = 0;
+		Ticket nextTicket = 1;
+		std::map<Ticket, StartFunction> queue; // Tickets increase, so FIFO
+	};
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "AsyncPipe.hpp"
+#include "Exceptions.hpp"
+#include "Public.h"
+
+namespace mcore
+{
+	namespace detail
+	{
+		AsyncPipeStatistics& asyncPipeStatistics()
+		{
+			static AsyncPipeStatistics stats;
+			return stats;
+		}
+		
+		BufferPool& asyncPipeBufferPool()
+		{
+			static BufferPool pool;
+			return pool;
+		}
+	}
+}
+
+extern "C" MSCResult MSCGetRelayStatistics(MSCRelayStatistics *outStats)
+{
+	return mcore::convertExceptionsToResultCode([&] {
+		if (outStats == nullptr) {
+			MSCThrow(mcore::InvalidArgumentException("outStats"));
+		}
+		
+		const auto& stats = mcore::detail::asyncPipeStatistics();
+		outStats->numPipes = stats.numPipes;
+		outStats->numReads = stats.numReads;
+		outStats->numBytes = stats.numBytes;
+		outStats->numBufferBytes = stats.numBufferBytes;
+	});
+}
@@ -19,6 +19,11 @@
 #include <boost/asio.hpp>
 #include <vector>
 #include <functional>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include "BufferPool.hpp"
+#include "HandlerAllocator.hpp"
 
 namespace mcore
 {
@@ -26,31 +31,122 @@ namespace mcore
 	
 	namespace detail
 	{
+		/** Buffers of copying pipes start at the size given to
+		 * <startAsyncPipe> and grow up to this size while reads keep
+		 * filling them. */
+		static constexpr std::size_t AsyncPipeMaxBufferSize = 65536;
+		
+		/** A read that took longer than this shrinks the buffer back to
+		 * the initial size. */
+		static constexpr std::chrono::milliseconds AsyncPipeIdleInterval {1000};
+		
+		/** Counters shared by all pipes. */
+		struct AsyncPipeStatistics
+		{
+			std::atomic<std::uint64_t> numPipes {0};
+			std::atomic<std::uint64_t> numReads {0};
+			std::atomic<std::uint64_t> numBytes {0};
+			std::atomic<std::uint64_t> numBufferBytes {0};
+		};
+		
+		AsyncPipeStatistics& asyncPipeStatistics();
+		BufferPool& asyncPipeBufferPool();
+		
+		// Streams supporting `async_read_some(null_buffers(), ...)`, which
+		// lets pipes wait for data without holding a buffer.
+		template <class Stream>
+		struct IsReadinessWaitableStream : std::false_type { };
+		template <class Protocol, class Service>
+		struct IsReadinessWaitableStream<asio::basic_stream_socket<Protocol, Service>> : std::true_type { };
+		
 		template <class InStream, class OutStream, class Callback>
 		struct AsyncPipeState: public std::enable_shared_from_this<AsyncPipeState<InStream, OutStream, Callback>>
 		{
 			using State = AsyncPipeState;
-			std::vector<char> buffer;
+			using Clock = std::chrono::steady_clock;
+			using WaitForReadiness = IsReadinessWaitableStream<InStream>;
+			
 			InStream& inStream;
 			OutStream& outStream;
 			Callback callback;
 			std::uint64_t count = 0;
 			
+			BufferPool::Buffer buffer;
+			std::size_t const minBufferSize;
+			std::size_t bufferSize;
+			Clock::time_point readStartTime;
+			HandlerMemory handlerMemory;
+			
 			AsyncPipeState(InStream& inStream, OutStream& outStream, std::size_t bufferSize, const Callback& callback):
 			inStream(inStream),
 			outStream(outStream),
-			callback(callback)
+			callback(callback),
+			minBufferSize(std::min(bufferSize, AsyncPipeMaxBufferSize)),
+			bufferSize(minBufferSize)
+			{
+				++asyncPipeStatistics().numPipes;
+			}
+			~AsyncPipeState()
 			{
-				buffer.resize(bufferSize);
+				releaseBuffer();
+				--asyncPipeStatistics().numPipes;
+			}
+			
+			void acquireBuffer()
+			{
+				if (buffer.data() && buffer.size() == bufferSize) {
+					return;
+				}
+				releaseBuffer();
+				buffer = asyncPipeBufferPool().allocate(bufferSize);
+				asyncPipeStatistics().numBufferBytes += buffer.capacity();
+			}
+			
+			void releaseBuffer()
+			{
+				if (buffer.data()) {
+					asyncPipeStatistics().numBufferBytes -= buffer.capacity();
+					buffer.reset();
+				}
 			}
-			~AsyncPipeState() = default;
 			
 			void run()
 			{
+				readStartTime = Clock::now();
+				wait(WaitForReadiness());
+			}
+			
+			void wait(std::true_type)
+			{
+				// Idle pipes don't hold a buffer.
+				releaseBuffer();
+				inStream.async_read_some(asio::null_buffers(), ReadyOperation(this->shared_from_this()));
+			}
+			
+			void wait(std::false_type)
+			{
+				read();
+			}
+			
+			void read()
+			{
+				acquireBuffer();
 				inStream.async_read_some(asio::buffer(buffer.data(), buffer.size()),
 										 ReadOperation(this->shared_from_this()));
 			}
 			
+			void adapt(std::size_t count)
+			{
+				if (count == buffer.size()) {
+					// There might be more data waiting.
+					bufferSize = std::min(bufferSize * 2, AsyncPipeMaxBufferSize);
+				} else if (Clock::now() - readStartTime >= AsyncPipeIdleInterval) {
+					bufferSize = minBufferSize;
+				} else if (count * 4 < buffer.size()) {
+					bufferSize = std::max(bufferSize / 2, minBufferSize);
+				}
+			}
+			
 			struct Operation
 			{
 				static constexpr bool IsAsyncPipeStateOperation = true;
@@ -59,6 +155,25 @@ namespace mcore
 				state(state) {}
 			};
 			
+			struct ReadyOperation: public Operation
+			{
+				ReadyOperation(const std::shared_ptr<State>& state):
+				Operation(state) {}
+				
+				void operator ()
+				(const boost::system::error_code& error, std::size_t) const
+				{
+					auto& s = *this->state;
+					
+					if (error) {
+						s.callback(error, s.count);
+						return;
+					}
+					
+					s.read();
+				}
+			};
+			
 			struct ReadOperation: public Operation
 			{
 				ReadOperation(const std::shared_ptr<State>& state):
@@ -78,6 +193,14 @@ namespace mcore
 					}
 					s.count += count;
 					
+					auto& stats = asyncPipeStatistics();
+					++stats.numReads;
+					stats.numBytes += count;
+					
+					// `adapt` might change `bufferSize`, but the buffer is
+					// only replaced by the next read.
+					s.adapt(count);
+					
 					async_write(s.outStream, asio::buffer(s.buffer.data(), count), WriteOperation(this->state));
 				}
 			};
@@ -124,14 +247,40 @@ namespace mcore
 			(function, thisHandler->state->callback);
 		}
 		
+		// Reads and writes of a pipe never overlap, so their handlers
+		// (including those of composed and strand-wrapped operations)
+		// share the memory owned by the pipe state.
+		template <typename Operation>
+		inline typename
+		std::enable_if<Operation::IsAsyncPipeStateOperation, void *>::type
+		asio_handler_allocate
+		(std::size_t size, Operation *thisHandler)
+		{
+			return thisHandler->state->handlerMemory.allocate(size);
+		}
+		
+		template <typename Operation>
+		inline typename
+		std::enable_if<Operation::IsAsyncPipeStateOperation>::type
+		asio_handler_deallocate
+		(void *pointer, std::size_t, Operation *thisHandler)
+		{
+			thisHandler->state->handlerMemory.deallocate(pointer);
+		}
+		
 	}
 	
+	/** Relays data from `inStream` to `outStream` until EOF or an error.
+	 * The data is copied through a pooled buffer that starts at `bufferSize`
+	 * bytes, grows while reads fill it and shrinks when the stream goes
+	 * quiet. */
     template <class InStream, class OutStream, class Callback>
     void startAsyncPipe(InStream& inStream, OutStream& outStream, std::size_t bufferSize, const Callback& callback)
     {
 		using State = detail::AsyncPipeState<InStream, OutStream, Callback>;
 		
-        auto state = std::make_shared<State>(inStream, outStream, bufferSize, callback);
-        state->run();
+		auto state = std::allocate_shared<State>(FreeListAllocator<State>(),
+												 inStream, outStream, bufferSize, callback);
+		state->run();
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,124 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "BufferPool.hpp"
+
+namespace mcore
+{
+	constexpr std::size_t BufferPool::MinBufferSize;
+	constexpr std::size_t BufferPool::NumSizeClasses;
+	constexpr std::size_t BufferPool::MaxCachedBuffers;
+	
+	BufferPool::BufferPool()
+	{ }
+	
+	BufferPool::~BufferPool()
+	{
+		for (auto& sizeClass: classes) {
+			for (char *data: sizeClass.freeBuffers) {
+				delete[] data;
+			}
+		}
+	}
+	
+	std::size_t BufferPool::sizeClassOf(std::size_t size)
+	{
+		std::size_t index = 0;
+		std::size_t classSize = MinBufferSize;
+		while (classSize < size) {
+			classSize <<= 1;
+			++index;
+		}
+		return index;
+	}
+	
+	BufferPool::Buffer BufferPool::allocate(std::size_t size)
+	{
+		auto index = sizeClassOf(size);
+		if (index >= NumSizeClasses) {
+			// Too large to be pooled.
+			return Buffer(this, new char[size], size, size);
+		}
+		
+		std::size_t capacity = MinBufferSize << index;
+		auto& sizeClass = classes[index];
+		{
+			std::lock_guard<std::mutex> lock(sizeClass.mutex);
+			if (!sizeClass.freeBuffers.empty()) {
+				char *data = sizeClass.freeBuffers.back();
+				sizeClass.freeBuffers.pop_back();
+				return Buffer(this, data, capacity, size);
+			}
+		}
+		return Buffer(this, new char[capacity], capacity, size);
+	}
+	
+	void BufferPool::release(char *data, std::size_t capacity)
+	{
+		auto index = sizeClassOf(capacity);
+		if (index < NumSizeClasses && capacity == (MinBufferSize << index)) {
+			auto& sizeClass = classes[index];
+			std::lock_guard<std::mutex> lock(sizeClass.mutex);
+			if (sizeClass.freeBuffers.size() < MaxCachedBuffers) {
+				sizeClass.freeBuffers.push_back(data);
+				return;
+			}
+		}
+		delete[] data;
+	}
+	
+	BufferPool::Buffer::Buffer(Buffer &&o):
+	pool(o.pool), data_(o.data_), capacity_(o.capacity_), size_(o.size_)
+	{
+		o.data_ = nullptr;
+		o.capacity_ = o.size_ = 0;
+	}
+	
+	auto BufferPool::Buffer::operator = (Buffer &&o) -> Buffer&
+	{
+		if (this != &o) {
+			reset();
+			std::swap(pool, o.pool);
+			std::swap(data_, o.data_);
+			std::swap(capacity_, o.capacity_);
+			std::swap(size_, o.size_);
+		}
+		return *this;
+	}
+	
+	void BufferPool::Buffer::resize(std::size_t newSize)
+	{
+		if (newSize > capacity_) {
+			assert(pool);
+			auto newBuffer = pool->allocate(newSize);
+			if (size_) {
+				std::memcpy(newBuffer.data(), data_, size_);
+			}
+			*this = std::move(newBuffer);
+		}
+		size_ = newSize;
+	}
+	
+	void BufferPool::Buffer::reset()
+	{
+		if (data_) {
+			pool->release(data_, capacity_);
+			data_ = nullptr;
+		}
+		capacity_ = size_ = 0;
+	}
+}
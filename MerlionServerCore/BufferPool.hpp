@@ -0,0 +1,86 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <mutex>
+#include <boost/noncopyable.hpp>
+
+namespace mcore
+{
+	/** Thread-safe pool of byte buffers. Buffers are grouped into
+	 * power-of-two size classes so idle connections don't have to keep
+	 * their own worst-case sized buffer. */
+	class BufferPool :
+	boost::noncopyable
+	{
+	public:
+		static constexpr std::size_t MinBufferSize = 4096;
+		static constexpr std::size_t NumSizeClasses = 6; // 4 KiB to 128 KiB
+		static constexpr std::size_t MaxCachedBuffers = 256; // per size class
+		
+		/** Buffer borrowed from <BufferPool>. Returned to the pool when
+		 * destroyed or <reset>. */
+		class Buffer
+		{
+			friend class BufferPool;
+			BufferPool *pool = nullptr;
+			char *data_ = nullptr;
+			std::size_t capacity_ = 0;
+			std::size_t size_ = 0;
+			
+			Buffer(BufferPool *pool, char *data, std::size_t capacity, std::size_t size):
+			pool(pool), data_(data), capacity_(capacity), size_(size) { }
+		public:
+			Buffer() = default;
+			Buffer(const Buffer&) = delete;
+			Buffer(Buffer&&);
+			~Buffer() { reset(); }
+			
+			Buffer& operator = (const Buffer&) = delete;
+			Buffer& operator = (Buffer&&);
+			
+			char *data() { return data_; }
+			const char *data() const { return data_; }
+			std::size_t size() const { return size_; }
+			std::size_t capacity() const { return capacity_; }
+			
+			/** Changes the size. When it exceeds the capacity, the contents are
+			 * moved to a buffer of a larger size class. */
+			void resize(std::size_t);
+			
+			void reset();
+		};
+		
+		BufferPool();
+		~BufferPool();
+		
+		Buffer allocate(std::size_t size);
+		
+	private:
+		struct SizeClass
+		{
+			std::mutex mutex;
+			std::vector<char *> freeBuffers;
+		};
+		std::array<SizeClass, NumSizeClasses> classes;
+		
+		static std::size_t sizeClassOf(std::size_t size);
+		void release(char *data, std::size_t capacity);
+	};
+}
@@ -0,0 +1,596 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "DataChannel.hpp"
+#include "Exceptions.hpp"
+#include <cassert>
+
+namespace asio = boost::asio;
+using boost::format;
+
+namespace mcore
+{
+	// Credit is returned to the sender after this amount of data was consumed.
+	static constexpr std::size_t DataChannelCreditThreshold = DataChannelInitialWindow / 4;
+
+	// Stream data is not queued beyond this until the pending write completes.
+	// Windows limit each stream, but not the sum over all of them.
+	static constexpr std::size_t DataChannelMaxSendBuffer = 256 * 1024;
+
+	DataChannelStream::DataChannelStream(const std::shared_ptr<DataChannel>& channel,
+										 std::uint64_t id):
+	channel(channel),
+	_id(id)
+	{
+	}
+
+	DataChannelStream::~DataChannelStream()
+	{
+	}
+	
+	asio::io_service& DataChannelStream::ioService() const
+	{
+		return channel->ioService();
+	}
+
+	void DataChannelStream::startRead(const asio::mutable_buffer &buffer, Handler &&handler)
+	{
+		auto self = shared_from_this();
+		auto h = std::make_shared<Handler>(std::move(handler));
+		channel->_strand.dispatch([self, buffer, h] {
+			self->doRead(buffer, std::move(*h));
+		});
+	}
+
+	void DataChannelStream::startWait(Handler &&handler)
+	{
+		auto self = shared_from_this();
+		auto h = std::make_shared<Handler>(std::move(handler));
+		channel->_strand.dispatch([self, h] {
+			self->doWait(std::move(*h));
+		});
+	}
+
+	void DataChannelStream::startWrite(const asio::const_buffer &buffer, Handler &&handler)
+	{
+		auto self = shared_from_this();
+		auto h = std::make_shared<Handler>(std::move(handler));
+		channel->_strand.dispatch([self, buffer, h] {
+			self->doWrite(buffer, std::move(*h));
+		});
+	}
+
+	void DataChannelStream::doRead(const asio::mutable_buffer &buffer, Handler &&handler)
+	{
+		auto& service = channel->service;
+
+		if (closed) {
+			service.post(std::bind(std::move(handler), asio::error::operation_aborted, 0));
+			return;
+		}
+		if (pendingReadHandler) {
+			service.post(std::bind(std::move(handler), asio::error::already_started, 0));
+			return;
+		}
+
+		std::size_t capacity = asio::buffer_size(buffer);
+		if (capacity == 0) {
+			service.post(std::bind(std::move(handler), boost::system::error_code(), 0));
+			return;
+		}
+
+		if (receiveQueueSize == 0) {
+			if (remoteClosed) {
+				service.post(std::bind(std::move(handler), asio::error::eof, 0));
+				return;
+			}
+
+			// Wait for the data to arrive.
+			pendingReadBuffer = buffer;
+			pendingReadHandler = std::move(handler);
+			return;
+		}
+
+		char *outData = asio::buffer_cast<char *>(buffer);
+		std::size_t copied = 0;
+		while (copied < capacity && !receiveQueue.empty()) {
+			auto& chunk = receiveQueue.front();
+			std::size_t amount = std::min(capacity - copied, chunk.size() - receiveQueueOffset);
+			std::memcpy(outData + copied, chunk.data() + receiveQueueOffset, amount);
+			copied += amount;
+			receiveQueueOffset += amount;
+			if (receiveQueueOffset == chunk.size()) {
+				receiveQueue.pop_front();
+				receiveQueueOffset = 0;
+			}
+		}
+		receiveQueueSize -= copied;
+
+		consumedBytes += copied;
+		if (consumedBytes >= DataChannelCreditThreshold && !remoteClosed) {
+			auto credit = static_cast<std::uint32_t>(consumedBytes);
+			channel->sendFrame(DataChannelCommand::Credit, _id, &credit, sizeof(credit));
+			consumedBytes = 0;
+		}
+
+		service.post(std::bind(std::move(handler), boost::system::error_code(), copied));
+	}
+
+	void DataChannelStream::doWait(Handler &&handler)
+	{
+		auto& service = channel->service;
+
+		if (closed) {
+			service.post(std::bind(std::move(handler), asio::error::operation_aborted, 0));
+			return;
+		}
+		if (pendingReadHandler) {
+			service.post(std::bind(std::move(handler), asio::error::already_started, 0));
+			return;
+		}
+
+		if (receiveQueueSize == 0 && !remoteClosed) {
+			pendingReadIsWait = true;
+			pendingReadHandler = std::move(handler);
+			return;
+		}
+
+		service.post(std::bind(std::move(handler), boost::system::error_code(), 0));
+	}
+
+	void DataChannelStream::resumeRead()
+	{
+		if (!pendingReadHandler) {
+			return;
+		}
+
+		auto handler = std::move(pendingReadHandler);
+		pendingReadHandler = nullptr;
+		if (pendingReadIsWait) {
+			pendingReadIsWait = false;
+			channel->service.post(std::bind(std::move(handler), boost::system::error_code(), 0));
+		} else {
+			doRead(pendingReadBuffer, std::move(handler));
+		}
+	}
+
+	void DataChannelStream::doWrite(const asio::const_buffer &buffer, Handler &&handler)
+	{
+		auto& service = channel->service;
+
+		if (closed || remoteClosed) {
+			service.post(std::bind(std::move(handler), asio::error::broken_pipe, 0));
+			return;
+		}
+		if (pendingWriteHandler) {
+			service.post(std::bind(std::move(handler), asio::error::already_started, 0));
+			return;
+		}
+
+		std::size_t size = asio::buffer_size(buffer);
+		if (size == 0) {
+			service.post(std::bind(std::move(handler), boost::system::error_code(), 0));
+			return;
+		}
+
+		if (sendWindow == 0) {
+			// Wait for the receiver to consume the data.
+			pendingWriteBuffer = buffer;
+			pendingWriteHandler = std::move(handler);
+			return;
+		}
+		if (channel->isSendBufferFull()) {
+			// Wait for the channel to write what it has.
+			pendingWriteBuffer = buffer;
+			pendingWriteHandler = std::move(handler);
+			waitingForChannel = true;
+			channel->sendBlockedStreams.push_back(shared_from_this());
+			return;
+		}
+
+		std::size_t amount = std::min(std::min(size, sendWindow), DataChannelMaxFramePayload);
+		channel->sendFrame(DataChannelCommand::Data, _id,
+						   asio::buffer_cast<const char *>(buffer), amount);
+		sendWindow -= amount;
+
+		service.post(std::bind(std::move(handler), boost::system::error_code(), amount));
+	}
+
+	void DataChannelStream::received(std::vector<char> &&data)
+	{
+		if (closed) {
+			// Data which was sent before the peer knows the stream is closed.
+			return;
+		}
+
+		if (receiveQueueSize + data.size() > DataChannelInitialWindow) {
+			// Only this stream is at fault; the others on the channel go on.
+			BOOST_LOG_SEV(channel->log, LogLevel::Warn) <<
+			format("Peer sent data beyond the window of stream %d. Closing the stream.") % _id;
+			channel->sendFrame(DataChannelCommand::Close, _id, nullptr, 0);
+			channel->removeStream(*this);
+			abort(asio::error::message_size);
+			return;
+		}
+
+		receiveQueueSize += data.size();
+		receiveQueue.emplace_back(std::move(data));
+
+		resumeRead();
+	}
+
+	void DataChannelStream::creditReceived(std::size_t amount)
+	{
+		sendWindow += amount;
+
+		if (pendingWriteHandler && !waitingForChannel) {
+			auto handler = std::move(pendingWriteHandler);
+			pendingWriteHandler = nullptr;
+			doWrite(pendingWriteBuffer, std::move(handler));
+		}
+	}
+
+	void DataChannelStream::remoteClose()
+	{
+		remoteClosed = true;
+
+		auto& service = channel->service;
+
+		resumeRead();
+		if (pendingWriteHandler) {
+			service.post(std::bind(std::move(pendingWriteHandler), asio::error::broken_pipe, 0));
+			pendingWriteHandler = nullptr;
+		}
+
+		notifyClosed();
+	}
+
+	void DataChannelStream::notifyClosed()
+	{
+		// Listeners usually hold the owner of this stream.
+		auto listeners = std::move(closeListeners);
+		closeListeners.clear();
+		for (const auto& f: listeners) {
+			f();
+		}
+	}
+
+	void DataChannelStream::waitClosed(std::function<void()> callback)
+	{
+		auto self = shared_from_this();
+		channel->_strand.dispatch([this, self, callback] {
+			if (closed || remoteClosed) {
+				callback();
+			} else {
+				closeListeners.emplace_back(callback);
+			}
+		});
+	}
+
+	void DataChannelStream::abort(const boost::system::error_code &error)
+	{
+		closed = true;
+		remoteClosed = true;
+		waitingForChannel = false;
+		receiveQueue.clear();
+		receiveQueueSize = 0;
+
+		auto& service = channel->service;
+
+		if (pendingReadHandler) {
+			service.post(std::bind(std::move(pendingReadHandler), error, 0));
+			pendingReadHandler = nullptr;
+			pendingReadIsWait = false;
+		}
+		if (pendingWriteHandler) {
+			service.post(std::bind(std::move(pendingWriteHandler), error, 0));
+			pendingWriteHandler = nullptr;
+		}
+
+		notifyClosed();
+	}
+
+	void DataChannelStream::shutdown()
+	{
+		auto self = shared_from_this();
+		channel->_strand.dispatch([this, self] {
+			if (closed)
+				return;
+
+			if (!remoteClosed && channel->isOpen()) {
+				channel->sendFrame(DataChannelCommand::Close, _id, nullptr, 0);
+			}
+			channel->removeStream(*this);
+
+			abort(asio::error::operation_aborted);
+		});
+	}
+
+	DataChannel::DataChannel(asio::io_service &service,
+							 const std::shared_ptr<socketType> &socket):
+	service(service),
+	socket(socket),
+	_strand(service),
+	closed(false),
+	_numStreams(0)
+	{
+	}
+
+	DataChannel::~DataChannel()
+	{
+	}
+
+	void DataChannel::setChannelName(const std::string &name)
+	{
+		log.setChannel(name);
+	}
+
+	void DataChannel::start()
+	{
+		auto self = shared_from_this();
+		_strand.dispatch([this, self] {
+			receiveFrameHeader();
+		});
+	}
+
+	DataChannelStream::ptr DataChannel::openStream(std::uint64_t streamId)
+	{
+		auto self = shared_from_this();
+		auto stream = std::make_shared<DataChannelStream>(self, streamId);
+
+		_strand.dispatch([this, self, stream] {
+			if (closed) {
+				stream->abort(asio::error::connection_aborted);
+				return;
+			}
+			if (!streams.emplace(stream->id(), stream).second) {
+				BOOST_LOG_SEV(log, LogLevel::Warn) <<
+				format("Stream %d is already open.") % stream->id();
+				stream->abort(asio::error::already_open);
+				return;
+			}
+			++_numStreams;
+			sendFrame(DataChannelCommand::Open, stream->id(), nullptr, 0);
+		});
+
+		return stream;
+	}
+
+	void DataChannel::removeStream(const DataChannelStream &stream)
+	{
+		auto it = streams.find(stream.id());
+		if (it != streams.end() && it->second.get() == &stream) {
+			streams.erase(it);
+			--_numStreams;
+		}
+	}
+
+	void DataChannel::receiveFrameHeader()
+	{
+		auto self = shared_from_this();
+		asio::async_read(*socket, asio::buffer(headerBuffer), _strand.wrap(makeHandlerWithMemory(receiveHandlerMemory,
+		[this, self] (const boost::system::error_code& error, std::size_t) {
+			if (closed)
+				return;
+
+			try {
+				if (error) {
+					MSCThrow(boost::system::system_error(error));
+				}
+
+				PacketReader reader(headerBuffer.data(), headerBuffer.size());
+				auto command = reader.read<DataChannelCommand>();
+				auto streamId = reader.read<std::uint64_t>();
+				auto length = static_cast<std::size_t>(reader.read<std::uint32_t>());
+
+				if (length > DataChannelMaxFramePayload) {
+					MSCThrow(InvalidDataException("Frame is too big."));
+				}
+
+				if (length == 0) {
+					handleFrame(command, streamId, std::vector<char>());
+					receiveFrameHeader();
+				} else {
+					receiveFramePayload(command, streamId, length);
+				}
+			} catch (...) {
+				fail(boost::current_exception_diagnostic_information());
+			}
+		})));
+	}
+
+	void DataChannel::receiveFramePayload(DataChannelCommand command,
+										  std::uint64_t streamId,
+										  std::size_t length)
+	{
+		auto self = shared_from_this();
+		payloadBuffer.resize(length);
+		asio::async_read(*socket, asio::buffer(payloadBuffer), _strand.wrap(makeHandlerWithMemory(receiveHandlerMemory,
+		[this, self, command, streamId] (const boost::system::error_code& error, std::size_t) {
+			if (closed)
+				return;
+
+			try {
+				if (error) {
+					MSCThrow(boost::system::system_error(error));
+				}
+
+				// The payload is handed over to the stream.
+				handleFrame(command, streamId, std::move(payloadBuffer));
+				payloadBuffer = std::vector<char>();
+				receiveFrameHeader();
+			} catch (...) {
+				fail(boost::current_exception_diagnostic_information());
+			}
+		})));
+	}
+
+	void DataChannel::handleFrame(DataChannelCommand command,
+								  std::uint64_t streamId,
+								  std::vector<char> &&payload)
+	{
+		if (command == DataChannelCommand::Open) {
+			auto stream = std::make_shared<DataChannelStream>(shared_from_this(), streamId);
+			if (!streams.emplace(streamId, stream).second) {
+				MSCThrow(InvalidDataException(str(format("Stream %d is already open.") % streamId)));
+			}
+			++_numStreams;
+			onStreamOpened(stream);
+			return;
+		}
+
+		auto it = streams.find(streamId);
+		if (it == streams.end()) {
+			// Stream was closed locally; the peer does not know that yet.
+			return;
+		}
+		auto stream = it->second;
+
+		switch (command) {
+			case DataChannelCommand::Data:
+				stream->received(std::move(payload));
+				break;
+			case DataChannelCommand::Credit:
+			{
+				PacketReader reader(payload.data(), payload.size());
+				stream->creditReceived(reader.read<std::uint32_t>());
+			}
+				break;
+			case DataChannelCommand::Close:
+				streams.erase(it);
+				--_numStreams;
+				stream->remoteClose();
+				break;
+			default:
+				MSCThrow(InvalidDataException(str(format("Invalid frame type %d.") %
+												  static_cast<int>(command))));
+		}
+	}
+
+	void DataChannel::writeFrameHeader(DataChannelCommand command,
+									   std::uint64_t streamId,
+									   std::size_t length)
+	{
+		sendBuffer.write(command);
+		sendBuffer.write(streamId);
+		sendBuffer.write(static_cast<std::uint32_t>(length));
+	}
+
+	void DataChannel::sendFrame(DataChannelCommand command,
+								std::uint64_t streamId,
+								const void *data,
+								std::size_t length)
+	{
+		assert(length <= DataChannelMaxFramePayload);
+
+		writeFrameHeader(command, streamId, length);
+		if (length > 0) {
+			sendBuffer.writeElements(reinterpret_cast<const char *>(data), length);
+		}
+
+		flushSendBuffer();
+	}
+
+	void DataChannel::flushSendBuffer()
+	{
+		if (sending || closed || sendBuffer.size() == 0)
+			return;
+
+		// Frames queued while this write is in progress are
+		// coalesced into the next one.
+		sendingBuffer.swap(sendBuffer.vector());
+		sending = true;
+
+		auto self = shared_from_this();
+		asio::async_write(*socket, asio::buffer(sendingBuffer), _strand.wrap(makeHandlerWithMemory(sendHandlerMemory,
+		[this, self] (const boost::system::error_code& error, std::size_t) {
+			sending = false;
+			sendingBuffer.clear();
+
+			if (closed)
+				return;
+
+			if (error) {
+				fail(boost::system::system_error(error).what());
+				return;
+			}
+
+			flushSendBuffer();
+			resumeBlockedStreams();
+		})));
+	}
+
+	bool DataChannel::isSendBufferFull()
+	{
+		return sendBuffer.size() >= DataChannelMaxSendBuffer;
+	}
+
+	void DataChannel::resumeBlockedStreams()
+	{
+		// Streams that find the buffer full again are queued anew.
+		auto blocked = std::move(sendBlockedStreams);
+		sendBlockedStreams.clear();
+		for (const auto& stream: blocked) {
+			if (!stream->waitingForChannel)
+				continue;
+			stream->waitingForChannel = false;
+			if (stream->pendingWriteHandler) {
+				auto handler = std::move(stream->pendingWriteHandler);
+				stream->pendingWriteHandler = nullptr;
+				stream->doWrite(stream->pendingWriteBuffer, std::move(handler));
+			}
+		}
+	}
+
+	void DataChannel::shutdown()
+	{
+		auto self = shared_from_this();
+		_strand.dispatch([this, self] {
+			if (closed)
+				return;
+			BOOST_LOG_SEV(log, LogLevel::Info) << "Shutting down.";
+			fail(std::string());
+		});
+	}
+
+	void DataChannel::fail(const std::string &reason)
+	{
+		if (closed.exchange(true))
+			return;
+
+		if (!reason.empty()) {
+			BOOST_LOG_SEV(log, LogLevel::Warn) << "Shutting down because of an error: " << reason;
+		}
+
+		try { socket->shutdown(socketType::shutdown_both); } catch (...) { }
+		try { socket->close(); } catch (...) { }
+
+		auto oldStreams = std::move(streams);
+		streams.clear();
+		sendBlockedStreams.clear();
+		_numStreams = 0;
+		for (const auto& e: oldStreams) {
+			e.second->abort(asio::error::connection_reset);
+		}
+
+		onClosed();
+
+		// Break reference cycles made by the handlers.
+		onStreamOpened.disconnect_all_slots();
+		onClosed.disconnect_all_slots();
+	}
+}
@@ -0,0 +1,223 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <functional>
+#include "Logging.hpp"
+#include "Packet.hpp"
+#include "Protocol.hpp"
+#include "HandlerAllocator.hpp"
+#include "AsyncPipe.hpp"
+
+namespace mcore
+{
+	class DataChannel;
+
+	/** Byte stream multiplexed over a `DataChannel`.
+	 * Provides `async_read_some` and `async_write_some` so it can be
+	 * used with `startAsyncPipe` and Boost.Asio's composed operations. */
+	class DataChannelStream :
+	public std::enable_shared_from_this<DataChannelStream>,
+	boost::noncopyable
+	{
+		friend class DataChannel;
+		using Handler = std::function<void(const boost::system::error_code&, std::size_t)>;
+
+		std::shared_ptr<DataChannel> const channel;
+		std::uint64_t const _id;
+
+		// Following members are only accessed in the channel's strand.
+		std::deque<std::vector<char>> receiveQueue;
+		std::size_t receiveQueueOffset = 0;
+		std::size_t receiveQueueSize = 0;
+		std::size_t consumedBytes = 0;
+		std::size_t sendWindow = DataChannelInitialWindow;
+		bool waitingForChannel = false; // Pending write waits for the channel's send buffer
+		bool closed = false;
+		bool remoteClosed = false;
+
+		boost::asio::mutable_buffer pendingReadBuffer;
+		Handler pendingReadHandler;
+		bool pendingReadIsWait = false;
+		boost::asio::const_buffer pendingWriteBuffer;
+		Handler pendingWriteHandler;
+
+		std::vector<std::function<void()>> closeListeners;
+
+		// Handlers are type-erased, but we still have to respect
+		// their invocation hooks (e.g. strand-wrapped handlers).
+		template <class H>
+		static Handler wrapHandler(H&& handler)
+		{
+			auto box = std::make_shared<typename std::decay<H>::type>(std::forward<H>(handler));
+			return [box] (const boost::system::error_code& error, std::size_t count) {
+				boost_asio_handler_invoke_helpers::invoke([box, error, count] {
+					(*box)(error, count);
+				}, *box);
+			};
+		}
+
+		void startRead(const boost::asio::mutable_buffer&, Handler&&);
+		void startWait(Handler&&);
+		void startWrite(const boost::asio::const_buffer&, Handler&&);
+
+		void doRead(const boost::asio::mutable_buffer&, Handler&&);
+		void doWait(Handler&&);
+		void resumeRead();
+		void doWrite(const boost::asio::const_buffer&, Handler&&);
+
+		void received(std::vector<char>&&);
+		void creditReceived(std::size_t);
+		void remoteClose();
+		void abort(const boost::system::error_code&);
+		void notifyClosed();
+
+	public:
+		using ptr = std::shared_ptr<DataChannelStream>;
+		using lowest_layer_type = DataChannelStream;
+
+		DataChannelStream(const std::shared_ptr<DataChannel>&, std::uint64_t id);
+		~DataChannelStream();
+
+		std::uint64_t id() const { return _id; }
+		boost::asio::io_service& ioService() const;
+
+		lowest_layer_type& lowest_layer() { return *this; }
+
+		template <class MutableBufferSequence, class ReadHandler>
+		void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+		{
+			boost::asio::mutable_buffer buffer;
+			for (const auto& b: buffers) {
+				if (boost::asio::buffer_size(b) > 0) {
+					buffer = b;
+					break;
+				}
+			}
+			startRead(buffer, wrapHandler(std::forward<ReadHandler>(handler)));
+		}
+		
+		/** Completes when data is available or the stream reached EOF. */
+		template <class ReadHandler>
+		void async_read_some(const boost::asio::null_buffers&, ReadHandler&& handler)
+		{
+			startWait(wrapHandler(std::forward<ReadHandler>(handler)));
+		}
+
+		template <class ConstBufferSequence, class WriteHandler>
+		void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+		{
+			boost::asio::const_buffer buffer;
+			for (const auto& b: buffers) {
+				if (boost::asio::buffer_size(b) > 0) {
+					buffer = b;
+					break;
+				}
+			}
+			startWrite(buffer, wrapHandler(std::forward<WriteHandler>(handler)));
+		}
+
+		void shutdown();
+
+		/** Calls `callback` in the channel's strand once the stream was
+		 * closed by either end or the channel went down (immediately if
+		 * that already happened). Data received before the remote end
+		 * closed the stream can still be read. */
+		void waitClosed(std::function<void()> callback);
+	};
+
+	/** Carries any number of `DataChannelStream`s over one
+	 * TCP connection between a node and the master. */
+	class DataChannel :
+	public std::enable_shared_from_this<DataChannel>,
+	boost::noncopyable
+	{
+		friend class DataChannelStream;
+	public:
+		using socketType = boost::asio::ip::tcp::socket;
+		using ptr = std::shared_ptr<DataChannel>;
+	private:
+		TypedLogger<DataChannel> log;
+
+		boost::asio::io_service& service;
+		std::shared_ptr<socketType> const socket;
+		boost::asio::strand _strand;
+
+		std::atomic<bool> closed;
+		std::atomic<std::size_t> _numStreams;
+		std::unordered_map<std::uint64_t, DataChannelStream::ptr> streams;
+
+		std::array<char, DataChannelFrameHeaderSize> headerBuffer;
+		std::vector<char> payloadBuffer;
+		
+		// Only one read and one write are outstanding at a time.
+		HandlerMemory receiveHandlerMemory;
+		HandlerMemory sendHandlerMemory;
+
+		PacketGenerator sendBuffer;
+		std::vector<char> sendingBuffer;
+		bool sending = false;
+
+		// Streams whose writes wait until `sendBuffer` has room.
+		std::deque<DataChannelStream::ptr> sendBlockedStreams;
+
+		void receiveFrameHeader();
+		void receiveFramePayload(DataChannelCommand, std::uint64_t, std::size_t);
+		void handleFrame(DataChannelCommand, std::uint64_t, std::vector<char>&&);
+
+		void writeFrameHeader(DataChannelCommand, std::uint64_t, std::size_t);
+		void sendFrame(DataChannelCommand, std::uint64_t, const void *, std::size_t);
+		void flushSendBuffer();
+		bool isSendBufferFull();
+		void resumeBlockedStreams();
+
+		void removeStream(const DataChannelStream&);
+		void fail(const std::string&);
+
+	public:
+		DataChannel(boost::asio::io_service&, const std::shared_ptr<socketType>&);
+		~DataChannel();
+
+		boost::asio::io_service& ioService() const { return service; }
+
+		void setChannelName(const std::string&); // For logging
+
+		void start();
+		void shutdown();
+		bool isOpen() const { return !closed; }
+
+		std::size_t numStreams() const { return _numStreams; }
+
+		/** Creates a stream and notifies the other end. */
+		DataChannelStream::ptr openStream(std::uint64_t streamId);
+
+		/** Called in the channel's strand when the other end opened a stream. */
+		boost::signals2::signal<void(const DataChannelStream::ptr&)> onStreamOpened;
+		boost::signals2::signal<void()> onClosed;
+	};
+	
+	namespace detail
+	{
+		template <>
+		struct IsReadinessWaitableStream<DataChannelStream> : std::true_type { };
+	}
+}
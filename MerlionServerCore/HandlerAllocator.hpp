@@ -0,0 +1,245 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/asio/detail/handler_invoke_helpers.hpp>
+
+namespace mcore
+{
+	namespace detail
+	{
+		/** Blocks of one size shared by all threads. Threads only come here
+		 * in batches, when their own <LocalFreeList> runs empty or full. */
+		class FreeList :
+		boost::noncopyable
+		{
+			std::mutex mutex;
+			std::vector<void *> blocks;
+		public:
+			static constexpr std::size_t MaxCachedBlocks = 256;
+			
+			~FreeList()
+			{
+				for (void *block: blocks) {
+					::operator delete(block);
+				}
+			}
+			
+			/** Moves up to `count` blocks to `out`. */
+			void take(std::vector<void *>& out, std::size_t count)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				while (count-- > 0 && !blocks.empty()) {
+					out.push_back(blocks.back());
+					blocks.pop_back();
+				}
+			}
+			
+			/** Moves `count` blocks from the end of `in`. Blocks that don't
+			 * fit are freed. */
+			void give(std::vector<void *>& in, std::size_t count)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					while (count > 0 && blocks.size() < MaxCachedBlocks) {
+						blocks.push_back(in.back());
+						in.pop_back();
+						--count;
+					}
+				}
+				for (; count > 0; --count) {
+					::operator delete(in.back());
+					in.pop_back();
+				}
+			}
+		};
+		
+		/** Blocks of one size cached by one thread. */
+		class LocalFreeList :
+		boost::noncopyable
+		{
+			std::vector<void *> blocks;
+		public:
+			static constexpr std::size_t MaxCachedBlocks = 64;
+			static constexpr std::size_t BatchSize = MaxCachedBlocks / 2;
+			
+			LocalFreeList() { blocks.reserve(MaxCachedBlocks); }
+			~LocalFreeList()
+			{
+				for (void *block: blocks) {
+					::operator delete(block);
+				}
+			}
+			
+			void *pop(FreeList& shared)
+			{
+				if (blocks.empty()) {
+					shared.take(blocks, BatchSize);
+					if (blocks.empty()) {
+						return nullptr;
+					}
+				}
+				void *block = blocks.back();
+				blocks.pop_back();
+				return block;
+			}
+			
+			void push(void *block, FreeList& shared)
+			{
+				if (blocks.size() >= MaxCachedBlocks) {
+					shared.give(blocks, BatchSize);
+				}
+				blocks.push_back(block);
+			}
+		};
+	}
+	
+	/** Allocator which keeps freed objects of `T` in a small per-thread
+	 * cache backed by a bounded process-wide free list, and reuses them.
+	 * Meant for `std::allocate_shared` of objects which are created for
+	 * every connection. */
+	template <class T>
+	class FreeListAllocator
+	{
+		static detail::FreeList& sharedList()
+		{
+			static detail::FreeList list;
+			return list;
+		}
+		static detail::LocalFreeList& localList()
+		{
+			// Leaked like the one in Exceptions.cpp. A thread's cache is
+			// freed when the thread exits.
+			static auto *lists = new boost::thread_specific_ptr<detail::LocalFreeList>();
+			auto *list = lists->get();
+			if (list == nullptr) {
+				list = new detail::LocalFreeList();
+				lists->reset(list);
+			}
+			return *list;
+		}
+	public:
+		using value_type = T;
+		
+		FreeListAllocator() = default;
+		template <class U>
+		FreeListAllocator(const FreeListAllocator<U>&) { }
+		
+		T *allocate(std::size_t n)
+		{
+			if (n == 1) {
+				if (void *block = localList().pop(sharedList())) {
+					return static_cast<T *>(block);
+				}
+			}
+			return static_cast<T *>(::operator new(n * sizeof(T)));
+		}
+		
+		void deallocate(T *p, std::size_t n)
+		{
+			if (n == 1) {
+				localList().push(p, sharedList());
+				return;
+			}
+			::operator delete(p);
+		}
+		
+		template <class U>
+		bool operator == (const FreeListAllocator<U>&) const { return true; }
+		template <class U>
+		bool operator != (const FreeListAllocator<U>&) const { return false; }
+	};
+	
+	/** Memory for the handlers of a chain of asynchronous operations, of
+	 * which at most one is outstanding at a time. Handlers are allocated
+	 * from the heap only when it is already in use or too small. */
+	class HandlerMemory :
+	boost::noncopyable
+	{
+		typename std::aligned_storage<256>::type storage;
+		bool inUse = false;
+	public:
+		void *allocate(std::size_t size)
+		{
+			if (!inUse && size <= sizeof(storage)) {
+				inUse = true;
+				return &storage;
+			}
+			return ::operator new(size);
+		}
+		
+		void deallocate(void *pointer)
+		{
+			if (pointer == &storage) {
+				inUse = false;
+			} else {
+				::operator delete(pointer);
+			}
+		}
+	};
+	
+	/** Completion handler whose operations allocate from `HandlerMemory`.
+	 * Other hooks are forwarded to the wrapped handler.
+	 * When used with a strand, wrap this with the strand and not the other
+	 * way around; strand-wrapped handlers free some of their memory through
+	 * the inner handler. */
+	template <class Handler>
+	class HandlerWithMemory
+	{
+		HandlerMemory& memory;
+		Handler handler;
+	public:
+		HandlerWithMemory(HandlerMemory& memory, Handler&& handler):
+		memory(memory), handler(std::move(handler)) { }
+		
+		template <class ...Args>
+		void operator () (Args&&... args)
+		{
+			handler(std::forward<Args>(args)...);
+		}
+		
+		friend void *asio_handler_allocate(std::size_t size, HandlerWithMemory *self)
+		{
+			return self->memory.allocate(size);
+		}
+		
+		friend void asio_handler_deallocate(void *pointer, std::size_t, HandlerWithMemory *self)
+		{
+			self->memory.deallocate(pointer);
+		}
+		
+		template <class Function>
+		friend void asio_handler_invoke(Function&& function, HandlerWithMemory *self)
+		{
+			boost_asio_handler_invoke_helpers::invoke(function, self->handler);
+		}
+	};
+	
+	template <class Handler>
+	HandlerWithMemory<typename std::decay<Handler>::type>
+	makeHandlerWithMemory(HandlerMemory& memory, Handler&& handler)
+	{
+		return HandlerWithMemory<typename std::decay<Handler>::type>
+		(memory, typename std::decay<Handler>::type(std::forward<Handler>(handler)));
+	}
+}
@@ -0,0 +1,312 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "KernelTls.hpp"
+#include <cstring>
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/tls1.h>
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
+
+#if defined(__linux__)
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
+namespace mcore
+{
+	namespace
+	{
+		bool hkdfExpandLabel(const EVP_MD *md, const std::vector<unsigned char>& secret,
+							 const std::string& label, std::size_t length,
+							 unsigned char *out)
+		{
+			// HkdfLabel of RFC 8446 Section 7.1 with an empty context.
+			std::string fullLabel = "tls13 " + label;
+			std::vector<unsigned char> info;
+			info.push_back(static_cast<unsigned char>(length >> 8));
+			info.push_back(static_cast<unsigned char>(length));
+			info.push_back(static_cast<unsigned char>(fullLabel.size()));
+			info.insert(info.end(), fullLabel.begin(), fullLabel.end());
+			info.push_back(0);
+			
+			auto *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+			if (ctx == nullptr) {
+				return false;
+			}
+			std::size_t outLength = length;
+			bool ok =
+			EVP_PKEY_derive_init(ctx) > 0 &&
+			EVP_PKEY_CTX_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+			EVP_PKEY_CTX_set_hkdf_md(ctx, md) > 0 &&
+			EVP_PKEY_CTX_set1_hkdf_key(ctx, secret.data(), static_cast<int>(secret.size())) > 0 &&
+			EVP_PKEY_CTX_add1_hkdf_info(ctx, info.data(), static_cast<int>(info.size())) > 0 &&
+			EVP_PKEY_derive(ctx, out, &outLength) > 0 &&
+			outLength == length;
+			EVP_PKEY_CTX_free(ctx);
+			return ok;
+		}
+		
+		bool tls12KeyBlock(const EVP_MD *md, const unsigned char *masterSecret, std::size_t masterSecretLength,
+						   const unsigned char *seed, std::size_t seedLength,
+						   std::size_t length, unsigned char *out)
+		{
+			static const unsigned char label[] = "key expansion";
+			auto *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+			if (ctx == nullptr) {
+				return false;
+			}
+			std::size_t outLength = length;
+			bool ok =
+			EVP_PKEY_derive_init(ctx) > 0 &&
+			EVP_PKEY_CTX_set_tls1_prf_md(ctx, md) > 0 &&
+			EVP_PKEY_CTX_set1_tls1_prf_secret(ctx, masterSecret, static_cast<int>(masterSecretLength)) > 0 &&
+			EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, label, static_cast<int>(sizeof(label) - 1)) > 0 &&
+			EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, seed, static_cast<int>(seedLength)) > 0 &&
+			EVP_PKEY_derive(ctx, out, &outLength) > 0 &&
+			outLength == length;
+			EVP_PKEY_CTX_free(ctx);
+			return ok;
+		}
+		
+		int hexDigit(char c)
+		{
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+	}
+	
+	int KernelTls::dataIndex()
+	{
+		static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+	
+	void KernelTls::setupContext(boost::asio::ssl::context &context)
+	{
+		// TLS 1.3 traffic secrets are only available through the key log.
+		SSL_CTX_set_keylog_callback(context.native_handle(), &KernelTls::handleKeyLog);
+	}
+	
+	KernelTls::KernelTls(SSL *ssl):
+	ssl(ssl)
+	{
+		SSL_set_ex_data(ssl, dataIndex(), this);
+		SSL_set_msg_callback(ssl, &KernelTls::handleMessage);
+		SSL_set_msg_callback_arg(ssl, this);
+#if defined(SSL_OP_NO_RENEGOTIATION)
+		// OpenSSL must not write records after the kernel took over.
+		SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
+	}
+	
+	KernelTls::~KernelTls()
+	{
+		SSL_set_msg_callback(ssl, nullptr);
+		SSL_set_ex_data(ssl, dataIndex(), nullptr);
+		OPENSSL_cleanse(serverTrafficSecret.data(), serverTrafficSecret.size());
+	}
+	
+	void KernelTls::handleKeyLog(const SSL *ssl, const char *line)
+	{
+		auto *self = static_cast<KernelTls *>(SSL_get_ex_data(ssl, dataIndex()));
+		if (self == nullptr) {
+			return;
+		}
+		
+		static const char prefix[] = "SERVER_TRAFFIC_SECRET_0 ";
+		if (std::strncmp(line, prefix, sizeof(prefix) - 1) != 0) {
+			return;
+		}
+		
+		// Skip the client random.
+		const char *p = std::strchr(line + sizeof(prefix) - 1, ' ');
+		if (p == nullptr) {
+			return;
+		}
+		++p;
+		
+		std::vector<unsigned char> secret;
+		while (p[0] && p[1]) {
+			int hi = hexDigit(p[0]), lo = hexDigit(p[1]);
+			if (hi < 0 || lo < 0) {
+				break;
+			}
+			secret.push_back(static_cast<unsigned char>((hi << 4) | lo));
+			p += 2;
+		}
+		self->serverTrafficSecret = std::move(secret);
+	}
+	
+	void KernelTls::handleMessage(int writing, int, int contentType, const void *buf,
+								  std::size_t len, SSL *ssl, void *arg)
+	{
+		auto& self = *static_cast<KernelTls *>(arg);
+		if (!writing) {
+			return;
+		}
+		
+		// Count the records written with the application traffic keys.
+		// The callback for a message comes after that for its record header.
+		if (contentType == SSL3_RT_HEADER) {
+			if (self.countingRecords) {
+				++self.writeSequence;
+			}
+		} else if (SSL_version(ssl) == TLS1_3_VERSION) {
+			if (contentType == SSL3_RT_HANDSHAKE && len > 0 &&
+				static_cast<const unsigned char *>(buf)[0] == SSL3_MT_FINISHED) {
+				self.countingRecords = true;
+				self.writeSequence = 0;
+			}
+		} else if (contentType == SSL3_RT_CHANGE_CIPHER_SPEC) {
+			self.countingRecords = true;
+			self.writeSequence = 0;
+		}
+	}
+	
+	bool KernelTls::getTransmitInfo(CryptoInfo &info) const
+	{
+		if (!countingRecords || !SSL_is_init_finished(ssl)) {
+			return false;
+		}
+		
+		const auto *cipher = SSL_get_current_cipher(ssl);
+		if (cipher == nullptr) {
+			return false;
+		}
+		int nid = SSL_CIPHER_get_cipher_nid(cipher);
+		if (nid != NID_aes_128_gcm && nid != NID_aes_256_gcm) {
+			return false;
+		}
+		info.aes256 = nid == NID_aes_256_gcm;
+		std::size_t keyLength = info.aes256 ? 32 : 16;
+		const auto *md = SSL_CIPHER_get_handshake_digest(cipher);
+		if (md == nullptr) {
+			return false;
+		}
+		info.key.resize(keyLength);
+		
+		for (std::size_t i = 0; i < 8; ++i) {
+			info.recordSequence[i] = static_cast<unsigned char>(writeSequence >> (56 - i * 8));
+		}
+		
+		int version = SSL_version(ssl);
+		if (version == TLS1_3_VERSION) {
+			info.version = 0x0304;
+			std::array<unsigned char, 12> iv;
+			if (serverTrafficSecret.empty() ||
+				!hkdfExpandLabel(md, serverTrafficSecret, "key", keyLength, info.key.data()) ||
+				!hkdfExpandLabel(md, serverTrafficSecret, "iv", iv.size(), iv.data())) {
+				return false;
+			}
+			std::memcpy(info.salt.data(), iv.data(), 4);
+			std::memcpy(info.iv.data(), iv.data() + 4, 8);
+		} else if (version == TLS1_2_VERSION) {
+			info.version = 0x0303;
+			
+			std::array<unsigned char, SSL3_MASTER_SECRET_SIZE> masterSecret;
+			std::size_t masterSecretLength =
+			SSL_SESSION_get_master_key(SSL_get_session(ssl), masterSecret.data(), masterSecret.size());
+			
+			std::array<unsigned char, SSL3_RANDOM_SIZE * 2> seed;
+			SSL_get_server_random(ssl, seed.data(), SSL3_RANDOM_SIZE);
+			SSL_get_client_random(ssl, seed.data() + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+			
+			// client_write_key, server_write_key, client_write_IV, server_write_IV
+			std::vector<unsigned char> keyBlock(keyLength * 2 + 8);
+			bool ok = tls12KeyBlock(md, masterSecret.data(), masterSecretLength,
+									seed.data(), seed.size(), keyBlock.size(), keyBlock.data());
+			OPENSSL_cleanse(masterSecret.data(), masterSecret.size());
+			if (!ok) {
+				return false;
+			}
+			std::memcpy(info.key.data(), keyBlock.data() + keyLength, keyLength);
+			std::memcpy(info.salt.data(), keyBlock.data() + keyLength * 2 + 4, 4);
+			// OpenSSL uses the sequence number as the explicit nonce.
+			info.iv = info.recordSequence;
+			OPENSSL_cleanse(keyBlock.data(), keyBlock.size());
+		} else {
+			return false;
+		}
+		return true;
+	}
+	
+	bool KernelTls::enableTransmit(int fd)
+	{
+#if defined(__linux__)
+		if (transmitEnabled) {
+			return true;
+		}
+		
+		CryptoInfo info;
+		if (!getTransmitInfo(info)) {
+			return false;
+		}
+		
+		if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+			OPENSSL_cleanse(info.key.data(), info.key.size());
+			return false;
+		}
+		
+		int ret;
+		if (info.aes256) {
+			tls12_crypto_info_aes_gcm_256 crypto;
+			std::memset(&crypto, 0, sizeof(crypto));
+			crypto.info.version = info.version;
+			crypto.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+			std::memcpy(crypto.key, info.key.data(), sizeof(crypto.key));
+			std::memcpy(crypto.salt, info.salt.data(), sizeof(crypto.salt));
+			std::memcpy(crypto.iv, info.iv.data(), sizeof(crypto.iv));
+			std::memcpy(crypto.rec_seq, info.recordSequence.data(), sizeof(crypto.rec_seq));
+			ret = ::setsockopt(fd, SOL_TLS, TLS_TX, &crypto, sizeof(crypto));
+			OPENSSL_cleanse(&crypto, sizeof(crypto));
+		} else {
+			tls12_crypto_info_aes_gcm_128 crypto;
+			std::memset(&crypto, 0, sizeof(crypto));
+			crypto.info.version = info.version;
+			crypto.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+			std::memcpy(crypto.key, info.key.data(), sizeof(crypto.key));
+			std::memcpy(crypto.salt, info.salt.data(), sizeof(crypto.salt));
+			std::memcpy(crypto.iv, info.iv.data(), sizeof(crypto.iv));
+			std::memcpy(crypto.rec_seq, info.recordSequence.data(), sizeof(crypto.rec_seq));
+			ret = ::setsockopt(fd, SOL_TLS, TLS_TX, &crypto, sizeof(crypto));
+			OPENSSL_cleanse(&crypto, sizeof(crypto));
+		}
+		OPENSSL_cleanse(info.key.data(), info.key.size());
+		
+		// A failed TLS_TX leaves the ULP attached, but without any keys
+		// installed it passes data through unchanged.
+		transmitEnabled = ret == 0;
+		return transmitEnabled;
+#else
+		(void) fd;
+		return false;
+#endif
+	}
+}
@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ssl.hpp>
+
+namespace mcore
+{
+	/** Hands the transmit side of an established TLS connection over to
+	 * the kernel (Linux kTLS) so written data is encrypted by the kernel
+	 * instead of OpenSSL. Only AES-GCM suites of TLS 1.2 and 1.3 are
+	 * supported. The receive side stays with OpenSSL.
+	 *
+	 * The object must be attached to the connection before the handshake,
+	 * because it has to observe the records written by OpenSSL. */
+	class KernelTls :
+	boost::noncopyable
+	{
+	public:
+		/** Transmit parameters for the kernel. */
+		struct CryptoInfo
+		{
+			std::uint16_t version;
+			bool aes256;
+			std::vector<unsigned char> key;
+			std::array<unsigned char, 4> salt;
+			std::array<unsigned char, 8> iv;
+			std::array<unsigned char, 8> recordSequence;
+		};
+		
+		/** Must be called once for the context whose connections use <KernelTls>. */
+		static void setupContext(boost::asio::ssl::context&);
+		
+		explicit KernelTls(SSL *);
+		~KernelTls();
+		
+		/** Computes the parameters of the transmit side. Must be called after
+		 * the handshake and while OpenSSL has nothing left to write. */
+		bool getTransmitInfo(CryptoInfo&) const;
+		
+		/** Installs the transmit parameters to the socket. After a successful
+		 * call, plaintext must be written to the socket directly and OpenSSL
+		 * must not write anything. Returns `false` (and leaves the connection
+		 * untouched) if kTLS is not available for this connection. */
+		bool enableTransmit(int fd);
+		
+		bool isTransmitEnabled() const { return transmitEnabled; }
+		
+	private:
+		SSL *const ssl;
+		std::vector<unsigned char> serverTrafficSecret; // TLS 1.3
+		bool countingRecords = false;
+		std::uint64_t writeSequence = 0;
+		bool transmitEnabled = false;
+		
+		static int dataIndex();
+		static void handleKeyLog(const SSL *, const char *line);
+		static void handleMessage(int writing, int version, int contentType, const void *buf,
+								  std::size_t len, SSL *, void *arg);
+	};
+}
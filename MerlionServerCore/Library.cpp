@@ -20,30 +20,239 @@
 #include <atomic>
 #include "Public.h"
 #include <algorithm>
+#include <cstring>
 #include "Exceptions.hpp"
+#include <boost/format.hpp>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using boost::format;
 
 namespace mcore
 {
-    Library::Library():
-    _ioService(new boost::asio::io_service()),
-    work(new boost::asio::io_service::work(*_ioService))
+	namespace
+	{
+		/** CPUs this process may run on, or `-1`s (one per core) when
+		 * they can't be enumerated. */
+		std::vector<int> allowedCpus()
+		{
+			std::vector<int> cpus;
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+				for (int i = 0; i < CPU_SETSIZE; ++i)
+					if (CPU_ISSET(i, &set))
+						cpus.push_back(i);
+			}
+#endif
+			if (cpus.empty())
+				cpus.resize(std::max<std::size_t>(std::thread::hardware_concurrency(), 1), -1);
+			return cpus;
+		}
+		
+#if defined(__linux__)
+		const int maxCpus = CPU_SETSIZE;
+#else
+		const int maxCpus = 1024;
+#endif
+		
+		/** Parses a CPU list such as "0-3,8". */
+		std::vector<int> parseCpuList(const char *text)
+		{
+			std::vector<int> cpus;
+			if (text == nullptr)
+				return cpus;
+			
+			std::vector<std::string> parts;
+			std::string textString(text);
+			boost::split(parts, textString, boost::is_any_of(","));
+			for (auto& part: parts) {
+				boost::trim(part);
+				if (part.empty())
+					continue;
+				
+				auto dash = part.find('-');
+				int first, last;
+				try {
+					first = std::stoi(part.substr(0, dash));
+					last = dash == std::string::npos ? first : std::stoi(part.substr(dash + 1));
+				} catch (const std::logic_error&) {
+					MSCThrow(InvalidFormatException(str(format("Invalid CPU list '%s'.") % text)));
+				}
+				if (first < 0 || last < first || last >= maxCpus)
+					MSCThrow(InvalidFormatException(str(format("Invalid CPU list '%s'.") % text)));
+				
+				for (int i = first; i <= last; ++i)
+					cpus.push_back(i);
+			}
+			return cpus;
+		}
+	}
+	
+	LibraryParameters::LibraryParameters(const MSCLibraryParameters& p):
+	shardIoServices((p.flags & MSCLF_ShardIoServices) != 0),
+	numIoThreads(p.numIoThreads),
+	ioCpus(parseCpuList(p.ioCpus)),
+	numDeployThreads(p.numDeployThreads ? p.numDeployThreads : 1),
+	numCallbackThreads(p.numCallbackThreads ? p.numCallbackThreads : 2),
+	blockingCpus(parseCpuList(p.blockingCpus)),
+	ioThreadNiceness(p.ioThreadNiceness),
+	blockingThreadNiceness(p.blockingThreadNiceness)
+	{ }
+	
+    Library::Library(const LibraryParameters& params):
+	shards(createShards(!params.shardIoServices ? 1 :
+						params.numIoThreads ? params.numIoThreads :
+						params.ioCpus.size() ? params.ioCpus.size() : allowedCpus().size())),
+	nextShard(0)
     {
-        std::size_t numWorkers = std::max<std::size_t>(
-                std::thread::hardware_concurrency(), 2) * 2;
-
-        for (std::size_t i = 0; i < numWorkers; ++i) {
-            workers.emplace_back();
-            Worker& worker = workers.back();
-            worker.thread.reset(new std::thread([this] {
-                workerRunner();
-            }));
-        }
+		if (params.shardIoServices) {
+			auto cpus = params.ioCpus.empty() ? allowedCpus() : params.ioCpus;
+			numIoThreads = shards.size();
+			for (std::size_t i = 0; i < shards.size(); ++i) {
+				int cpu = cpus[i % cpus.size()];
+				startWorker(shards[i]->service, cpu >= 0 ? std::vector<int>{cpu} : std::vector<int>(),
+							params.ioThreadNiceness);
+			}
+		} else {
+			numIoThreads = params.numIoThreads ? params.numIoThreads :
+			std::max<std::size_t>(std::thread::hardware_concurrency(), 2) * 2;
+			
+			for (std::size_t i = 0; i < numIoThreads; ++i)
+				startWorker(ioService(), params.ioCpus, params.ioThreadNiceness);
+		}
+		
+		startBlockingPool(deployPool, std::max<std::size_t>(params.numDeployThreads, 1), params);
+		startBlockingPool(callbackPool, std::max<std::size_t>(params.numCallbackThreads, 1), params);
+		
+		for (auto& shard: shards)
+			probeQueueDelay(*shard);
+		
+		BOOST_LOG_SEV(log, LogLevel::Info) <<
+		format("Running %d I/O thread(s) on %d io_service(s), %d deploy thread(s) and %d callback thread(s).") %
+		numIoThreads % shards.size() % deployPool.numThreads % callbackPool.numThreads;
     }
 
-    void Library::workerRunner()
+	std::vector<std::unique_ptr<Library::IoShard>> Library::createShards(std::size_t count)
+	{
+		std::vector<std::unique_ptr<IoShard>> shards;
+		for (std::size_t i = 0; i < count; ++i)
+			shards.emplace_back(new IoShard());
+		return shards;
+	}
+	
+	void Library::startBlockingPool(BlockingPool& pool, std::size_t numThreads,
+									const LibraryParameters& params)
+	{
+		pool.numThreads = numThreads;
+		for (std::size_t i = 0; i < numThreads; ++i)
+			startWorker(pool.service, params.blockingCpus, params.blockingThreadNiceness);
+	}
+	
+	void Library::startWorker(boost::asio::io_service& service, const std::vector<int>& cpus,
+							  int niceness)
+	{
+		workers.emplace_back();
+		Worker& worker = workers.back();
+		worker.thread.reset(new std::thread([this, &service, cpus, niceness] {
+			workerRunner(service, cpus, niceness);
+		}));
+	}
+	
+    void Library::workerRunner(boost::asio::io_service& service, const std::vector<int>& cpus,
+							   int niceness)
     {
-        _ioService->run();
+#if defined(__linux__)
+		// Both are advisory: the thread still works without them.
+		if (!cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu: cpus)
+				CPU_SET(cpu, &set);
+			int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (err) {
+				BOOST_LOG_SEV(log, LogLevel::Warn) <<
+				format("Failed to set the CPU affinity of a thread.: %s") % std::strerror(err);
+			}
+		}
+		if (niceness != 0) {
+			if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), niceness)) {
+				BOOST_LOG_SEV(log, LogLevel::Warn) <<
+				format("Failed to set the nice value of a thread.: %s") % std::strerror(errno);
+			}
+		}
+#else
+		(void) cpus;
+		(void) niceness;
+#endif
+        service.run();
     }
+	
+	void Library::probeQueueDelay(IoShard& shard)
+	{
+		shard.probeTimer.expires_from_now(std::chrono::seconds(1));
+		shard.probeTimer.async_wait([this, &shard] (const boost::system::error_code& error) {
+			if (error)
+				return;
+			
+			auto late = std::chrono::steady_clock::now() - shard.probeTimer.expires_at();
+			shard.queueDelay = static_cast<std::uint64_t>(std::max<std::int64_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(late).count(), 0));
+			probeQueueDelay(shard);
+		});
+	}
+	
+	TimingWheel& Library::timingWheel(boost::asio::io_service& service)
+	{
+		for (auto& shard: shards)
+			if (&shard->service == &service)
+				return shard->timingWheel;
+		MSCThrow(InvalidArgumentException("service"));
+	}
+	
+	void Library::post(BlockingPool& pool, std::function<void()>&& f)
+	{
+		++pool.numPending;
+		auto task = std::make_shared<std::function<void()>>(std::move(f));
+		pool.service.post([this, &pool, task] {
+			--pool.numPending;
+			try {
+				(*task)();
+			} catch (...) {
+				BOOST_LOG_SEV(log, LogLevel::Error) <<
+				"Unhandled exception in a blocking task.: " <<
+				boost::current_exception_diagnostic_information();
+			}
+			++pool.numCompleted;
+		});
+	}
+	
+	void Library::getStatistics(MSCLibraryStatistics& stats) const
+	{
+		std::uint64_t maxDelay = 0, totalDelay = 0;
+		for (const auto& shard: shards) {
+			std::uint64_t delay = shard->queueDelay;
+			maxDelay = std::max(maxDelay, delay);
+			totalDelay += delay;
+		}
+		
+		stats.numIoServices = static_cast<std::uint32_t>(shards.size());
+		stats.numIoThreads = static_cast<std::uint32_t>(numIoThreads);
+		stats.numDeployThreads = static_cast<std::uint32_t>(deployPool.numThreads);
+		stats.numCallbackThreads = static_cast<std::uint32_t>(callbackPool.numThreads);
+		stats.maxIoQueueDelay = maxDelay;
+		stats.averageIoQueueDelay = totalDelay / shards.size();
+		stats.numPendingDeployTasks = deployPool.numPending;
+		stats.numCompletedDeployTasks = deployPool.numCompleted;
+		stats.numPendingCallbackTasks = callbackPool.numPending;
+		stats.numCompletedCallbackTasks = callbackPool.numCompleted;
+	}
 
     void Library::addListener(LibraryListener *listener)
     {
@@ -64,7 +273,10 @@ namespace mcore
 
     Library::~Library()
     {
-        _ioService->stop();
+        for (auto& shard: shards)
+            shard->service.stop();
+		deployPool.service.stop();
+		callbackPool.service.stop();
 
         {
             std::lock_guard<std::mutex> lock(manageMutex);
@@ -72,7 +284,10 @@ namespace mcore
                 listener->onBeingDestroyed(*this);
         }
 
-        work.reset(nullptr);
+        for (auto& shard: shards)
+            shard->work.reset(nullptr);
+		deployPool.work.reset(nullptr);
+		callbackPool.work.reset(nullptr);
         for (Worker& worker: workers)
             worker.thread->join();
 
@@ -94,9 +309,34 @@ extern "C" MSCResult MSCLibraryCreate(MSCLibrary *libOut)
     });
 }
 
+extern "C" MSCResult MSCLibraryCreateEx(const MSCLibraryParameters *params, MSCLibrary *libOut)
+{
+    return mcore::convertExceptionsToResultCode([&] {
+        *libOut = nullptr;
+		if (params == nullptr)
+			MSCThrow(mcore::InvalidArgumentException("params"));
+		
+		auto library = std::make_shared<mcore::Library>(mcore::LibraryParameters(*params));
+        *libOut = library->handle();
+    });
+}
+
 extern "C" MSCResult MSCLibraryDestroy(MSCLibrary library)
 {
     return mcore::convertExceptionsToResultCode([&] {
         delete mcore::Library::fromHandle(library);
     });
 }
+
+extern "C" MSCResult MSCLibraryGetStatistics(MSCLibrary library, MSCLibraryStatistics *outStats)
+{
+	return mcore::convertExceptionsToResultCode([&] {
+		if (!library)
+			MSCThrow(mcore::InvalidArgumentException("library"));
+		if (outStats == nullptr)
+			MSCThrow(mcore::InvalidArgumentException("outStats"));
+		
+		auto& lib = *mcore::Library::fromHandle(library);
+		lib->getStatistics(*outStats);
+	});
+}
@@ -23,18 +23,84 @@
 #include <thread>
 #include <mutex>
 #include <unordered_set>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <boost/asio/steady_timer.hpp>
+#include "BufferPool.hpp"
+#include "TimingWheel.hpp"
+#include "Logging.hpp"
 
 namespace mcore
 {
     class LibraryListener;
+	
+	struct LibraryParameters
+	{
+		/** Run one io_service per I/O thread, each pinned to one core,
+		 * instead of one io_service on all I/O threads. */
+		bool shardIoServices = false;
+		
+		/** Zero selects `max(cores, 2) * 2`, or one per core when sharded. */
+		std::size_t numIoThreads = 0;
+		/** Empty: any CPU the process may run on. */
+		std::vector<int> ioCpus;
+		
+		std::size_t numDeployThreads = 1;
+		std::size_t numCallbackThreads = 2;
+		/** CPUs for the deploy and callback threads. Empty: any. */
+		std::vector<int> blockingCpus;
+		
+		int ioThreadNiceness = 0;
+		int blockingThreadNiceness = 0;
+		
+		LibraryParameters() { }
+		LibraryParameters(const MSCLibraryParameters&);
+	};
 
 	class Library:
 	public std::enable_shared_from_this<Library>,
 	boost::noncopyable
     {
         std::unordered_set<LibraryListener *> listeners;
-
-        std::unique_ptr<boost::asio::io_service> _ioService;
+		TypedLogger<Library> log;
+		
+		struct IoShard
+		{
+			boost::asio::io_service service;
+			std::unique_ptr<boost::asio::io_service::work> work;
+			
+			/** Measures how long a handler waits in the queue. */
+			boost::asio::steady_timer probeTimer;
+			std::atomic<std::uint64_t> queueDelay;
+			
+			/** Expired timers run on this shard's service. */
+			TimingWheel timingWheel;
+			
+			IoShard(): work(new boost::asio::io_service::work(service)),
+			probeTimer(service), queueDelay(0), timingWheel(service) { }
+		};
+		
+		/** Threads for work that may block for long, kept off the I/O threads. */
+		struct BlockingPool
+		{
+			boost::asio::io_service service;
+			std::unique_ptr<boost::asio::io_service::work> work;
+			std::size_t numThreads = 0;
+			std::atomic<std::uint64_t> numPending;
+			std::atomic<std::uint64_t> numCompleted;
+			
+			BlockingPool(): work(new boost::asio::io_service::work(service)),
+			numPending(0), numCompleted(0) { }
+		};
+		
+		std::vector<std::unique_ptr<IoShard>> shards;
+		std::atomic<std::size_t> nextShard;
+		static std::vector<std::unique_ptr<IoShard>> createShards(std::size_t count);
+		std::size_t numIoThreads;
+		
+		BlockingPool deployPool;
+		BlockingPool callbackPool;
 
         struct Worker
         {
@@ -42,14 +108,19 @@ namespace mcore
         };
 
         std::list<Worker> workers;
-        std::unique_ptr<boost::asio::io_service::work> work;
 
-        void workerRunner();
+		void startWorker(boost::asio::io_service&, const std::vector<int>& cpus, int niceness);
+        void workerRunner(boost::asio::io_service&, const std::vector<int>& cpus, int niceness);
+		void startBlockingPool(BlockingPool&, std::size_t numThreads, const LibraryParameters&);
+		void probeQueueDelay(IoShard&);
+		void post(BlockingPool&, std::function<void()>&&);
 
         std::mutex manageMutex;
+		
+		BufferPool _bufferPool;
 
     public:
-        Library();
+        Library(const LibraryParameters& = LibraryParameters());
         ~Library();
 
         void addListener(LibraryListener *);
@@ -58,7 +129,30 @@ namespace mcore
 		MSCLibrary handle() { return reinterpret_cast<MSCLibrary>(new std::shared_ptr<Library>(shared_from_this())); }
         static std::shared_ptr<Library> *fromHandle(MSCLibrary handle) { return reinterpret_cast<std::shared_ptr<Library> *>(handle); }
 
-        boost::asio::io_service& ioService() const { return *_ioService; }
+        /** The first shard. Used for objects that aren't per-connection. */
+        boost::asio::io_service& ioService() const { return shards.front()->service; }
+		
+		std::size_t numIoServices() const { return shards.size(); }
+		std::size_t ioThreadCount() const { return numIoThreads; }
+		boost::asio::io_service& ioService(std::size_t index) const { return shards[index]->service; }
+		
+		/** Picks a shard for a new connection in round-robin order. */
+		boost::asio::io_service& nextIoService() { return ioService(nextShard++ % shards.size()); }
+		
+		/** Runs package deployment off the I/O threads. */
+		void postDeploy(std::function<void()> f) { post(deployPool, std::move(f)); }
+		
+		/** Runs an application callback off the I/O threads. */
+		void postCallback(std::function<void()> f) { post(callbackPool, std::move(f)); }
+		
+		/** Pool for short-lived buffers such as those of received messages. */
+		BufferPool& bufferPool() { return _bufferPool; }
+		
+		/** Wheel for coarse timeouts of connections served by `service`,
+		 * which must be one of the I/O services. */
+		TimingWheel& timingWheel(boost::asio::io_service& service);
+		
+		void getStatistics(MSCLibraryStatistics&) const;
 
     };
 
@@ -18,6 +18,7 @@
 #include "LikeMatcher.hpp"
 #include "Exceptions.hpp"
 #include <cctype>
+#include <boost/functional/hash.hpp>
 
 namespace mcore
 {
@@ -25,55 +26,111 @@ namespace mcore
 	{
 		bool isValidLiteralChar(char c)
 		{
-			if(std::isalnum(c) || c == '_' || c == '.' || c == ' ' || c == '-') {
+			if(std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == ' ' || c == '-') {
 				return true;
 			}
 			return false;
 		}
+		
+		// Clients usually request one of a few version patterns.
+		const std::size_t maxCachedMatchers = 1024;
+		
+		using CacheList = std::list<std::pair<std::string, std::shared_ptr<const LikeMatcher>>>;
+		
+		struct StringRefHash
+		{
+			std::size_t operator()(boost::string_ref s) const
+			{ return boost::hash_range(s.begin(), s.end()); }
+		};
+		
+		std::mutex cacheMutex;
+		CacheList cacheList; // most recently used first
+		// Keys refer to the patterns stored in `cacheList`, so that lookups
+		// don't need a std::string.
+		std::unordered_map<boost::string_ref, CacheList::iterator, StringRefHash> cacheMap;
 	}
 	
 	LikeMatcher::LikeMatcher(const std::string &pattern)
 	{
-		std::vector<char> str;
+		auto addChar = [this] (char c) {
+			Element e;
+			e.universal = false;
+			e.chars.set(static_cast<unsigned char>(c));
+			elements.push_back(e);
+		};
+		
+		elements.reserve(pattern.size());
 		
 		std::size_t i = 0;
 		int numUniversals = 0;
 		while (i < pattern.size()) {
 			char c = pattern[i];
 			if (c == '[') {
-				str.push_back('['); ++i;
+				++i;
 				std::size_t start = i;
+				Element e;
+				e.universal = false;
+				bool negate = false;
+				int last = -1;
 				while (true) {
 					if (i >= pattern.size()) {
 						MSCThrow(InvalidFormatException());
 					}
 					c = pattern[i];
 					if (c == ']' && i > start) {
-						str.push_back('['); ++i;
+						++i;
 						break;
 					} else if (c == '-' && i > start) {
-						str.push_back('-'); ++i;
+						++i;
 						if (i >= pattern.size() || !isValidLiteralChar(pattern[i])) {
 							MSCThrow(InvalidFormatException());
 						}
-						str.push_back(pattern[i]); ++i;
+						if (last < 0) {
+							// Nothing to start a range from (e.g. "[^-a]"); both are literals.
+							e.chars.set('-');
+							last = static_cast<unsigned char>(pattern[i]);
+							e.chars.set(last); ++i;
+							continue;
+						}
+						int first = last;
+						last = static_cast<unsigned char>(pattern[i]);
+						if (last < first) {
+							MSCThrow(InvalidFormatException());
+						}
+						for (int ch = first; ch <= last; ++ch)
+							e.chars.set(ch);
+						last = -1;
+						++i;
 					} else if (c == '^' && i == start) {
-						str.push_back('^'); ++i;
+						negate = true; ++i;
 					} else {
 						if (isValidLiteralChar(c)) {
-							str.push_back(c); ++i;
+							last = static_cast<unsigned char>(c);
+							e.chars.set(last); ++i;
 						} else {
 							MSCThrow(InvalidFormatException());
 						}
 					}
 				}
+				if (negate)
+					e.chars.flip();
+				elements.push_back(e);
 			} else if (c == '_') {
-				str.push_back('.'); ++i;
+				Element e;
+				e.universal = false;
+				e.chars.set();
+				elements.push_back(e);
+				++i;
 			} else if (c == '%') {
-				str.push_back('.'); str.push_back('*'); ++i;
+				++i;
 				++numUniversals;
 				if (numUniversals > 8)
 					MSCThrow(InvalidFormatException());
+				if (elements.empty() || !elements.back().universal) {
+					Element e;
+					e.universal = true;
+					elements.push_back(e);
+				}
 			} else if (c == '\\') {
 				++i;
 				if (i >= pattern.size()) {
@@ -86,26 +143,85 @@ namespace mcore
 					case 't': c = '\t'; break;
 				}
 				if (isValidLiteralChar(c)) {
-					str.push_back(c); ++i;
+					addChar(c); ++i;
 				} else {
 					MSCThrow(InvalidFormatException());
 				}
 			} else {
 				if (isValidLiteralChar(c)) {
-					str.push_back(c); ++i;
+					addChar(c); ++i;
 				} else {
 					MSCThrow(InvalidFormatException());
 				}
 			}
 		}
 		
-		regex.reset(new std::regex(str.data(), str.size(),
-								   std::regex_constants::ECMAScript));
+	}
+	
+	std::shared_ptr<const LikeMatcher> LikeMatcher::get(boost::string_ref patternRef)
+	{
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			auto it = cacheMap.find(patternRef);
+			if (it != cacheMap.end()) {
+				cacheList.splice(cacheList.begin(), cacheList, it->second);
+				return it->second->second;
+			}
+		}
+		
+		// Compile outside the lock. Throws if the pattern is invalid.
+		std::string pattern = patternRef.to_string();
+		std::shared_ptr<const LikeMatcher> matcher = std::make_shared<LikeMatcher>(pattern);
+		
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto it = cacheMap.find(pattern);
+		if (it != cacheMap.end()) {
+			// Another thread compiled it meanwhile.
+			cacheList.splice(cacheList.begin(), cacheList, it->second);
+			return it->second->second;
+		}
 		
+		if (cacheList.size() >= maxCachedMatchers) {
+			// Erase the key before the string it refers to.
+			cacheMap.erase(cacheList.back().first);
+			cacheList.pop_back();
+		}
+		cacheList.emplace_front(std::move(pattern), std::move(matcher));
+		cacheMap.emplace(cacheList.front().first, cacheList.begin());
+		return cacheList.front().second;
 	}
 	
-	bool LikeMatcher::match(const std::string &subject)
+	bool LikeMatcher::match(const std::string &subject) const
 	{
-		return std::regex_match(subject, *regex);
+		// Greedy matching that backtracks only to the last "%" seen.
+		// Each other element matches exactly one character, so this
+		// never needs to revisit an earlier "%".
+		const std::size_t none = static_cast<std::size_t>(-1);
+		std::size_t p = 0, s = 0;
+		std::size_t retryP = none, retryS = 0;
+		
+		while (s < subject.size()) {
+			if (p < elements.size()) {
+				const auto& e = elements[p];
+				if (e.universal) {
+					retryP = ++p;
+					retryS = s;
+					continue;
+				} else if (e.chars[static_cast<unsigned char>(subject[s])]) {
+					++p; ++s;
+					continue;
+				}
+			}
+			if (retryP == none)
+				return false;
+			
+			// Let the last "%" consume one more character.
+			p = retryP;
+			s = ++retryS;
+		}
+		
+		while (p < elements.size() && elements[p].universal)
+			++p;
+		return p == elements.size();
 	}
 }
@@ -16,15 +16,31 @@
 
 #pragma once
 
+#include <bitset>
+#include <boost/utility/string_ref.hpp>
+
 namespace mcore
 {
+	/** Matches strings against an SQL LIKE pattern. */
 	class LikeMatcher
 	{
-		std::unique_ptr<std::regex> regex;
+		struct Element
+		{
+			/** Matches any sequence of characters ("%") when set. Otherwise
+			 * matches exactly one character in <chars>. */
+			bool universal;
+			std::bitset<256> chars;
+		};
+		
+		std::vector<Element> elements;
 	public:
 		LikeMatcher(const std::string &pattern);
 		
-		bool match(const std::string &subject);
+		/** Returns a shared matcher for the pattern, compiling it only if
+		 * it isn't cached yet. The pattern is copied only on a miss. */
+		static std::shared_ptr<const LikeMatcher> get(boost::string_ref pattern);
+		
+		bool match(const std::string &subject) const;
 	};
 }
 
@@ -21,10 +21,14 @@
 #include "MasterNodeConnection.hpp"
 #include "Utils.hpp"
 #include <vector>
+#include <limits>
 #include "MasterNode.hpp"
 #include "MasterClient.hpp"
 #include "Balancer.hpp"
 #include "Version.h"
+#include "SslSessionTicketKeys.hpp"
+#include "AdmissionControl.hpp"
+#include "KernelTls.hpp"
 
 namespace asio = boost::asio;
 namespace ssl = boost::asio::ssl;
@@ -36,6 +40,42 @@ namespace mcore
     MasterParameters::MasterParameters(MSCMasterParameters const &param)
     {
 		allowVersionSpecification = (param.flags & MSCMF_DisallowVersionSpecification) == 0;
+		terminateWebSocket = (param.flags & MSCMF_TerminateWebSocket) != 0;
+		sslSessionResumption = (param.flags & MSCMF_DisableSslSessionResumption) == 0;
+		kernelTls = (param.flags & MSCMF_EnableKernelTls) != 0;
+		
+		sslSessionCacheSize = param.sslSessionCacheSize ? param.sslSessionCacheSize : 20480;
+		sslSessionTimeout = std::chrono::seconds(param.sslSessionTimeout ? param.sslSessionTimeout : 300);
+		sslTicketKeyRotationInterval = std::chrono::seconds
+		(param.sslTicketKeyRotationInterval ? param.sslTicketKeyRotationInterval : 3600);
+		
+		// Zero is resolved by <Master>, which knows the I/O thread count.
+		maxConcurrentHandshakes = param.maxConcurrentHandshakes;
+		maxQueuedHandshakes = param.maxQueuedHandshakes ? param.maxQueuedHandshakes : 1024;
+		
+		webSocketCompression = (param.flags & MSCMF_EnableWebSocketCompression) != 0;
+		webSocketCompressionNoContextTakeover =
+		(param.flags & MSCMF_WebSocketCompressionNoContextTakeover) != 0;
+		webSocketCompressionWindowBits = param.webSocketCompressionWindowBits ?
+		static_cast<int>(param.webSocketCompressionWindowBits) : 15;
+		webSocketCompressionMemoryLevel = param.webSocketCompressionMemoryLevel ?
+		static_cast<int>(param.webSocketCompressionMemoryLevel) : 8;
+		if (webSocketCompressionWindowBits < 9 || webSocketCompressionWindowBits > 15) {
+			MSCThrow(InvalidArgumentException("webSocketCompressionWindowBits"));
+		}
+		if (webSocketCompressionMemoryLevel < 1 || webSocketCompressionMemoryLevel > 9) {
+			MSCThrow(InvalidArgumentException("webSocketCompressionMemoryLevel"));
+		}
+		webSocketCompressionLevel = param.webSocketCompressionLevel ?
+		static_cast<int>(param.webSocketCompressionLevel) : 1;
+		if (webSocketCompressionLevel < 1 || webSocketCompressionLevel > 9) {
+			MSCThrow(InvalidArgumentException("webSocketCompressionLevel"));
+		}
+		webSocketMaxInflatedMessageSize = param.webSocketMaxInflatedMessageSize ?
+		static_cast<std::size_t>(param.webSocketMaxInflatedMessageSize) : 1024 * 1024;
+		
+		numClientAcceptors = param.numClientAcceptors ? param.numClientAcceptors :
+		std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
 		
         if (param.nodeEndpoint == nullptr) {
             MSCThrow(InvalidArgumentException("nodeEndpoint"));
@@ -79,15 +119,40 @@ namespace mcore
 	_library(library),
 	_parameters(parameters),
 	nodeAcceptor(library->ioService(), parseTcpEndpoint(parameters.nodeEndpoint)),
-	clientAcceptor(library->ioService(), parseTcpEndpoint(parameters.clientEndpoint)),
 	heartbeatTimer(library->ioService()),
 	heartbeatRunning(true),
-	_sslContext(ssl::context::tlsv1),
+	clientHandshakes(std::make_shared<AdmissionControl>
+					 (parameters.maxConcurrentHandshakes ? parameters.maxConcurrentHandshakes :
+					  // Leave at least half of the I/O threads to established clients.
+					  std::max<std::size_t>(library->ioThreadCount() / 2, 1),
+					  parameters.maxQueuedHandshakes)),
+	_sslContext(ssl::context::sslv23_server),
 	disposed(false),
 	nodeAcceptorRunning(true),
-	clientAcceptorRunning(true)
+	nextClientId(1),
+	numRunningClientAcceptors(0),
+	topologyGeneration(0),
+	storedTopologyGeneration(0)
 	{
 		// Setup SSL
+		// Accept TLS 1.0 and later; prefer forward-secret suites.
+		sslContext().set_options(ssl::context::default_workarounds |
+								 ssl::context::no_sslv2 |
+								 ssl::context::no_sslv3 |
+								 ssl::context::no_compression |
+								 ssl::context::single_dh_use);
+		SSL_CTX_set_options(sslContext().native_handle(), SSL_OP_CIPHER_SERVER_PREFERENCE);
+		SSL_CTX_set_cipher_list(sslContext().native_handle(),
+								"ECDHE+AESGCM:ECDHE+CHACHA20:ECDHE+AES:HIGH:!aNULL:!MD5:!RC4:!3DES");
+#if defined(SSL_CTX_set_ecdh_auto)
+		SSL_CTX_set_ecdh_auto(sslContext().native_handle(), 1);
+#endif
+		setupSslSessionResumption();
+		if (parameters.kernelTls) {
+			KernelTls::setupContext(sslContext());
+			BOOST_LOG_SEV(log, LogLevel::Info) << "Kernel TLS is enabled for pass-through clients.";
+		}
+		
 		std::string pw = parameters.sslPassword;
 		sslContext().set_password_callback([pw](std::size_t, ssl::context::password_purpose) { return pw; });
 		
@@ -119,11 +184,13 @@ namespace mcore
 		// Prepare to accept the first client and node
 		BOOST_LOG_SEV(log, LogLevel::Debug) << "Preparing to accept clients and nodes.";
 		waitingNodeConnection = std::make_shared<MasterNodeConnection>(*this);
-		waitingClient = std::make_shared<MasterClient>(*this, 1,
-													   _parameters.allowVersionSpecification);
+		openClientAcceptors();
 		
         acceptNodeConnectionAsync(true);
-        acceptClientAsync(true);
+		numRunningClientAcceptors = clientAcceptors.size();
+		for (auto& acceptor: clientAcceptors) {
+			acceptClientAsync(*acceptor, &acceptor == &clientAcceptors.front());
+		}
 
 		// Start heartbeat
 		BOOST_LOG_SEV(log, LogLevel::Debug) << "Starting heartbeat.";
@@ -133,6 +200,34 @@ namespace mcore
 		format("Merlion Master Server Core (%s) running.") % MSC_VERSION_STRING;
     }
 
+	void Master::setupSslSessionResumption()
+	{
+		auto *handle = sslContext().native_handle();
+		
+		if (!_parameters.sslSessionResumption) {
+			SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_OFF);
+			SSL_CTX_set_options(handle, SSL_OP_NO_TICKET);
+			BOOST_LOG_SEV(log, LogLevel::Info) << "SSL session resumption is disabled.";
+			return;
+		}
+		
+		// OpenSSL's internal cache is shared by all connections of the context.
+		static const unsigned char sessionIdContext[] = "Merlion";
+		SSL_CTX_set_session_id_context(handle, sessionIdContext, sizeof(sessionIdContext) - 1);
+		SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(handle, static_cast<long>(_parameters.sslSessionCacheSize));
+		SSL_CTX_set_timeout(handle, static_cast<long>(_parameters.sslSessionTimeout.count()));
+		
+		sslTicketKeys.reset(new SslSessionTicketKeys(_parameters.sslTicketKeyRotationInterval));
+		sslTicketKeys->install(sslContext());
+		
+		BOOST_LOG_SEV(log, LogLevel::Info) <<
+		format("SSL session cache holds up to %d sessions for %d seconds. "
+			   "Session ticket keys are rotated every %d seconds.") %
+		_parameters.sslSessionCacheSize % _parameters.sslSessionTimeout.count() %
+		_parameters.sslTicketKeyRotationInterval.count();
+	}
+
     void Master::checkValid() const
     {
         if (_library == nullptr)
@@ -174,6 +269,9 @@ namespace mcore
             return;
 		
 		// Do heartbeat
+		if (sslTicketKeys) {
+			sslTicketKeys->rotateIfNeeded();
+		}
         {
             std::lock_guard<std::recursive_mutex> lock(listenersMutex);
             for (auto *l: listeners)
@@ -241,146 +339,221 @@ namespace mcore
         nodeConnections.erase(it);
     }
     
-    void Master::acceptClientAsync(bool initial)
+	void Master::openClientAcceptors()
+	{
+		auto endpoint = parseTcpEndpoint(_parameters.clientEndpoint);
+		std::size_t count = _parameters.numClientAcceptors;
+		std::size_t numShards = _library->numIoServices();
+#if defined(SO_REUSEPORT)
+		// Every io_service shard gets at least one acceptor so that clients
+		// are spread over all of them.
+		count = std::max(count, numShards);
+#else
+		count = 1;
+#endif
+		
+		for (std::size_t i = 0; i < count; ++i) {
+			std::unique_ptr<ClientAcceptor> a(new ClientAcceptor(_library->ioService(i % numShards)));
+			auto& acceptor = a->acceptor;
+			acceptor.open(endpoint.protocol());
+			acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+			using reusePort = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+			acceptor.set_option(reusePort(true));
+#endif
+			acceptor.bind(endpoint);
+			acceptor.listen();
+			clientAcceptors.push_back(std::move(a));
+		}
+	}
+	
+    void Master::acceptClientAsync(ClientAcceptor& a, bool initial)
 	{
 		if (initial) {
 			BOOST_LOG_SEV(log, LogLevel::Info) <<
-			format("Listening for clients at %s.") % clientAcceptor.local_endpoint();
+			format("Listening for clients at %s with %d socket(s).") %
+			a.acceptor.local_endpoint() % clientAcceptors.size();
 		}
 		try {
-			clientAcceptor.async_accept(waitingClient->tcpSocket(),
-			[=](const boost::system::error_code& errorCode) {
+			a.acceptor.async_accept(a.socket,
+			[this, &a](const boost::system::error_code& errorCode) {
 				if (errorCode.value() == boost::asio::error::operation_aborted || disposed) {
-					std::lock_guard<std::mutex> guard(clientAcceptorMutex);
-					clientAcceptorRunning = false;
-					clientAcceptorCV.notify_all();
+					clientAcceptorStopped();
 					return;
 				} else if (errorCode) {
-					if (initial) {
-						BOOST_LOG_SEV(log, LogLevel::Fatal) <<
-						format("Accepting client connection failed: %s.") % errorCode;
-					}
-					std::lock_guard<std::mutex> guard(clientAcceptorMutex);
-					clientAcceptorRunning = false;
-					clientAcceptorCV.notify_all();
-					return;
-				} else {
-					// New client connected.
-					auto conn = waitingClient;
-					
-					// Prepare to accept the next client.
-					{
-						std::lock_guard<std::recursive_mutex> lock(clientsMutex);
-						clients[conn->id()] = std::move(waitingClient);
-						waitingClient = std::make_shared<MasterClient>(*this, conn->id() + 1,
-																	   _parameters.allowVersionSpecification);
+					auto delay = acceptRetryDelay(errorCode);
+					if (delay) {
+						BOOST_LOG_SEV(log, LogLevel::Warn) <<
+						format("Accepting client connection failed: %s. Retrying in %d ms.") %
+						errorCode % delay->total_milliseconds();
+						retryAcceptClient(a, *delay);
+						return;
 					}
 					
-					std::weak_ptr<MasterClient> weakConn(conn);
-					
-					// Setup "someone needs to respond to me" handler
-					conn->onNeedsResponse.connect([this, weakConn](const std::shared_ptr<MasterClientResponse>& r) {
-						
-						auto conn = weakConn.lock();
-						if (!conn) {
-							// Unexpected...
-							BOOST_LOG_SEV(log, LogLevel::Error) <<
-							"onNeedsResponse raised by unexistent MasterClient.";
-							return;
-						}
-						
-						// Use balancer to choose a server.
-						auto domain = bindClientToDomain(conn);
-						 
-						if (!domain) {
-							r->reject("Could not find a suitable domain. Overload possible.");
-							return;
-						}
-						
-						auto version = domain->second;
-						
-						BOOST_LOG_SEV(log, LogLevel::Debug) <<
-						format("Bound client '%d' to '%s' at '%s'.") % conn->id() %
-						version % domain->first->nodeInfo().nodeName;
-						
-						// Make sure MasterClientResponse is in pendingClients
-						// until it is done
-						{
-							std::lock_guard<std::recursive_mutex> lock(pendingClientsMutex);
-							PendingClient pend;
-							pend.response = r;
-							pend.version = version;
-							pendingClients.emplace(r->client()->id(), std::move(pend));
-						}
-						
-						std::function<void(bool)> onResponded = [this, conn](bool) {
-							std::lock_guard<std::recursive_mutex> lock(pendingClientsMutex);
-							pendingClients.erase(conn->id());
-						};
-						
-						r->onResponded.connect(onResponded);
-						
-						// It is not impossible that time-out already happened...
-						if (r->isResponded()) {
-							onResponded(false);
-							return;
-						}
-						
-						// Let node process the response.
-						domain->first->acceptClient(r, version);
-					});
-					
-					// Register client shutdown handler.
-					conn->onShutdown.connect([this, weakConn]() {
-						
-						auto conn = weakConn.lock();
-						if (!conn) {
-							// Unexpected...
-							BOOST_LOG_SEV(log, LogLevel::Error) <<
-							"onShutdown raised by unexistent MasterClient.";
-							return;
-						}
-						
-						removeClient(conn->id());
-					});
-					
-					// Start service
-					conn->handleNewClient();
+					// Close the socket so that the kernel stops handing it
+					// connections that would never be accepted; the other
+					// acceptors sharing the port keep serving.
+					BOOST_LOG_SEV(log, LogLevel::Fatal) <<
+					format("Accepting client connection failed: %s. Closing the acceptor.") % errorCode;
+					boost::system::error_code ignored;
+					a.acceptor.close(ignored);
+					clientAcceptorStopped();
+					return;
 				}
-
-				// Accept next connection
-				acceptClientAsync(false);
+				
+				// Accept the next connection before setting up this one so
+				// that accepting isn't serialized behind MasterClient's
+				// (TLS context) construction.
+				asio::ip::tcp::socket socket(std::move(a.socket));
+				acceptClientAsync(a, false);
+				
+				handleNewClient(a.service, std::move(socket));
 			});
 		} catch (...) {
-			std::lock_guard<std::mutex> guard(clientAcceptorMutex);
-			clientAcceptorRunning = false;
-			clientAcceptorCV.notify_all();
+			clientAcceptorStopped();
 			throw;
 		}
 	}
 	
-	boost::optional<Master::PendingClient>
-	Master::dequePendingClient(std::uint64_t clientId)
+	boost::optional<boost::posix_time::time_duration>
+	Master::acceptRetryDelay(const boost::system::error_code& errorCode)
 	{
-		std::lock_guard<std::recursive_mutex> lock(pendingClientsMutex);
+		namespace errc = boost::system::errc;
 		
-		auto it = pendingClients.find(clientId);
-		if (it == pendingClients.end()) {
-			return boost::none;
+		// Out of descriptors or memory; wait for some to be released
+		// instead of spinning on the same error.
+		if (errorCode == errc::too_many_files_open ||
+			errorCode == errc::too_many_files_open_in_system ||
+			errorCode == errc::no_buffer_space ||
+			errorCode == errc::not_enough_memory) {
+			return boost::posix_time::milliseconds(100);
 		}
 		
-		auto ret = std::move(it->second);
-		pendingClients.erase(it);
+		// The pending connection failed before it was accepted; only that
+		// connection is affected.
+		if (errorCode == errc::connection_aborted ||
+			errorCode == errc::connection_reset ||
+			errorCode == errc::interrupted ||
+			errorCode == errc::resource_unavailable_try_again ||
+			errorCode == errc::protocol_error ||
+			errorCode == errc::operation_not_permitted ||
+			errorCode == errc::network_down ||
+			errorCode == errc::network_unreachable ||
+			errorCode == errc::host_unreachable) {
+			return boost::posix_time::milliseconds(0);
+		}
 		
-		return std::move(ret);
+		return boost::none;
+	}
+	
+	void Master::retryAcceptClient(ClientAcceptor& a, boost::posix_time::time_duration delay)
+	{
+		a.retryTimer.expires_from_now(delay);
+		a.retryTimer.async_wait([this, &a](const boost::system::error_code& errorCode) {
+			if (errorCode || disposed) {
+				clientAcceptorStopped();
+				return;
+			}
+			acceptClientAsync(a, false);
+		});
+	}
+	
+	void Master::clientAcceptorStopped()
+	{
+		std::lock_guard<std::mutex> guard(clientAcceptorMutex);
+		--numRunningClientAcceptors;
+		clientAcceptorCV.notify_all();
+	}
+	
+	void Master::handleNewClient(asio::io_service& service, asio::ip::tcp::socket&& socket)
+	{
+		// New client connected.
+		auto conn = std::make_shared<MasterClient>(*this, service, nextClientId++,
+												   _parameters.allowVersionSpecification,
+												   clientStreamFraming());
+		conn->tcpSocket() = std::move(socket);
+		
+		clients.set(conn->id(), conn);
+		
+		std::weak_ptr<MasterClient> weakConn(conn);
+		
+		// Setup "someone needs to respond to me" handler
+		conn->onNeedsResponse.connect([this, weakConn](const std::shared_ptr<MasterClientResponse>& r) {
+			
+			auto conn = weakConn.lock();
+			if (!conn) {
+				// Unexpected...
+				BOOST_LOG_SEV(log, LogLevel::Error) <<
+				"onNeedsResponse raised by unexistent MasterClient.";
+				return;
+			}
+			
+			// Use balancer to choose a server.
+			auto domain = bindClientToDomain(conn);
+			 
+			if (!domain) {
+				r->reject("Could not find a suitable domain. Overload possible.");
+				return;
+			}
+			
+			auto version = domain->second;
+			
+			BOOST_LOG_SEV(log, LogLevel::Debug) <<
+			format("Bound client '%d' to '%s' at '%s'.") % conn->id() %
+			version % domain->first->nodeInfo().nodeName;
+			
+			// Make sure MasterClientResponse is in pendingClients
+			// until it is done
+			{
+				PendingClient pend;
+				pend.response = r;
+				pend.version = version;
+				pendingClients.set(r->client()->id(), std::move(pend));
+			}
+			
+			std::function<void(bool)> onResponded = [this, conn](bool) {
+				pendingClients.erase(conn->id());
+			};
+			
+			r->onResponded.connect(onResponded);
+			
+			// It is not impossible that time-out already happened...
+			if (r->isResponded()) {
+				onResponded(false);
+				return;
+			}
+			
+			// Let node process the response.
+			domain->first->acceptClient(r, version);
+		});
+		
+		// Register client shutdown handler.
+		conn->onShutdown.connect([this, weakConn]() {
+			
+			auto conn = weakConn.lock();
+			if (!conn) {
+				// Unexpected...
+				BOOST_LOG_SEV(log, LogLevel::Error) <<
+				"onShutdown raised by unexistent MasterClient.";
+				return;
+			}
+			
+			removeClient(conn->id());
+		});
+		
+		// Start service
+		conn->handleNewClient(clientHandshakes);
+	}
+	
+	boost::optional<Master::PendingClient>
+	Master::dequePendingClient(std::uint64_t clientId)
+	{
+		return pendingClients.take(clientId);
 	}
 	
 	void Master::removeClient(std::uint64_t clientId)
 	{
-		{
-			std::lock_guard<std::recursive_mutex> lock(clientsMutex);
-			clients.erase(clientId);
-		}
+		clients.erase(clientId);
 		{
 			std::lock_guard<std::recursive_mutex> lock2(listenersMutex);
 			for (auto *l: listeners) l->clientDisconnected(clientId);
@@ -389,12 +562,8 @@ namespace mcore
 	
 	std::shared_ptr<MasterClient> Master::getClient(std::uint64_t clientId)
 	{
-		std::lock_guard<std::recursive_mutex> lock(clientsMutex);
-		auto it = clients.find(clientId);
-		if (it != clients.end())
-			return it->second;
-		else
-			return nullptr;
+		auto client = clients.find(clientId);
+		return client ? *client : nullptr;
 	}
 	
     void Master::invalidate()
@@ -415,7 +584,12 @@ namespace mcore
         }
 		
 		nodeAcceptor.cancel();
-		clientAcceptor.cancel();
+		for (auto& a: clientAcceptors) {
+			// Acceptors closed after a fatal error would throw here.
+			boost::system::error_code ignored;
+			a->acceptor.cancel(ignored);
+			a->retryTimer.cancel(ignored);
+		}
 
         // Wait until node/client acceptor is closed
 		{
@@ -424,36 +598,27 @@ namespace mcore
 		}
 		{
 			std::unique_lock<std::mutex> acceptorLock(clientAcceptorMutex);
-			clientAcceptorCV.wait(acceptorLock, [&]{ return !clientAcceptorRunning; });
+			clientAcceptorCV.wait(acceptorLock, [&]{ return numRunningClientAcceptors == 0; });
 		}
 
 		// Delete node/client acceptor
         waitingNodeConnection->shutdown();
         waitingNodeConnection.reset();
 		
-		waitingClient->shutdown();
-		waitingClient.reset();
-		
 		nodeAcceptor.close();
-		clientAcceptor.close();
+		for (auto& a: clientAcceptors) {
+			boost::system::error_code ignored;
+			a->acceptor.close(ignored);
+			a->socket.close(ignored);
+		}
 		
 		// Reject all pending clients
-		std::vector<PendingClient> pclientList;
-		{
-			std::lock_guard<std::recursive_mutex> lock(pendingClientsMutex);
-			for (const auto& e: pendingClients)
-				pclientList.push_back(e.second);
-		}
+		auto pclientList = pendingClients.values();
 		for (const auto& c: pclientList)
 			c.response->reject("Server is going down.");
 		
 		// Shut all clients down
-		std::vector<std::shared_ptr<MasterClient>> clientList;
-		{
-			std::lock_guard<std::recursive_mutex> lock(clientsMutex);
-			for (const auto& e: clients)
-				clientList.push_back(e.second);
-		}
+		auto clientList = clients.values();
 		for (const auto& c: clientList)
 			c->shutdown();
 
@@ -467,6 +632,16 @@ namespace mcore
 		
 		for (const auto& c: nodeConns)
 			c->shutdown();
+		
+		// Drop the nodes held by the snapshot while the master is intact,
+		// and don't let later rebuilds store a new one.
+		std::shared_ptr<const Topology> lastTopology;
+		{
+			std::lock_guard<std::mutex> lock(topologyMutex);
+			storedTopologyGeneration = std::numeric_limits<std::uint64_t>::max();
+			lastTopology = std::atomic_exchange(&topology, std::shared_ptr<const Topology>());
+		}
+		lastTopology.reset();
 
         _library = nullptr;
     }
@@ -478,52 +653,162 @@ namespace mcore
 	
 	void Master::addNode(const std::shared_ptr<MasterNode>& node)
 	{
-		std::lock_guard<std::recursive_mutex> lock(nodesMutex);
-		nodes[node.get()] = node;
+		{
+			std::lock_guard<std::recursive_mutex> lock(nodesMutex);
+			nodes[node.get()] = node;
+		}
+		updateTopology();
 	}
 	
 	void Master::removeNode(MasterNode *node)
 	{
-		std::lock_guard<std::recursive_mutex> lock(nodesMutex);
-		nodes.erase(node);
+		{
+			std::lock_guard<std::recursive_mutex> lock(nodesMutex);
+			nodes.erase(node);
+		}
+		updateTopology();
 	}
 
     void Master::addVersion(const std::string &name)
     {
-        std::lock_guard<std::recursive_mutex> lock(versionsMutex);
+		{
+			std::lock_guard<std::recursive_mutex> lock(versionsMutex);
 
-        MasterVersion ver;
-        ver.name = name;
-        ver.throttle = 0.0;
-        versions[name] = ver;
+			MasterVersion ver;
+			ver.name = name;
+			ver.throttle = 0.0;
+			versions[name] = ver;
 
-        std::lock_guard<std::recursive_mutex> lock2(listenersMutex);
-        for (auto *l: listeners) l->versionAdded(*this, name);
+			std::lock_guard<std::recursive_mutex> lock2(listenersMutex);
+			for (auto *l: listeners) l->versionAdded(*this, name);
+		}
+		updateTopology();
     }
 
     void Master::removeVersion(const std::string &name)
     {
-        std::lock_guard<std::recursive_mutex> lock(versionsMutex);
-        versions.erase(name);
+		{
+			std::lock_guard<std::recursive_mutex> lock(versionsMutex);
+			versions.erase(name);
 
-        std::lock_guard<std::recursive_mutex> lock2(listenersMutex);
-        for (auto *l: listeners) l->versionRemoved(*this, name);
+			std::lock_guard<std::recursive_mutex> lock2(listenersMutex);
+			for (auto *l: listeners) l->versionRemoved(*this, name);
+		}
+		updateTopology();
     }
 
     void Master::setVersionThrottle(const std::string &name, double d)
     {
-        std::lock_guard<std::recursive_mutex> lock(versionsMutex);
-        auto it = versions.find(name);
-        if (it != versions.end())
-            it->second.throttle = d;
+		{
+			std::lock_guard<std::recursive_mutex> lock(versionsMutex);
+			auto it = versions.find(name);
+			if (it != versions.end())
+				it->second.throttle = d;
+		}
+		updateTopology();
 	}
 	
 	void Master::setNodeThrottle(const std::string &name, double d)
 	{
-		std::lock_guard<std::recursive_mutex> lock(nodeThrottlesMutex);
-		nodeThrottles[name] = d;
+		{
+			std::lock_guard<std::recursive_mutex> lock(nodeThrottlesMutex);
+			nodeThrottles[name] = d;
+		}
+		updateTopology();
+	}
+	
+	void Master::updateTopology()
+	{
+		// The mutexes are taken one at a time (and `topologyMutex` only
+		// to store the result) so that this can be called from anywhere
+		// without lock-order problems. Concurrent rebuilds are resolved by
+		// keeping the one started last, which has seen every change made
+		// before it started.
+		auto generation = ++topologyGeneration;
+		
+		auto nodeList = getAllNodes();
+		std::unordered_map<std::string, double> nodeThrottleList;
+		{
+			std::lock_guard<std::recursive_mutex> lock(nodeThrottlesMutex);
+			nodeThrottleList = nodeThrottles;
+		}
+		std::unordered_map<std::string, double> versionThrottleList;
+		{
+			std::lock_guard<std::recursive_mutex> lock(versionsMutex);
+			for (const auto& e: versions)
+				versionThrottleList.emplace(e.first, e.second.throttle);
+		}
+		
+		auto topo = std::make_shared<Topology>();
+		std::unordered_map<std::string, std::size_t> versionIndices;
+		for (const auto& node: nodeList) {
+			Topology::Node tnode;
+			tnode.node = node;
+			
+			auto it = nodeThrottleList.find(node->nodeInfo().nodeName);
+			double nodeThrottle = it == nodeThrottleList.end() ? 0.0 : it->second;
+			
+			if (nodeThrottle > 0.0) {
+				for (const auto& domain: *node->domainInfos()) {
+					auto it2 = versionThrottleList.find(domain.versionName);
+					if (it2 == versionThrottleList.end() || it2->second <= 0.0)
+						continue;
+					
+					auto index = versionIndices.emplace(domain.versionName,
+														topo->versionNames.size());
+					if (index.second)
+						topo->versionNames.push_back(domain.versionName);
+					
+					Topology::Domain tdomain;
+					tdomain.version = index.first->second;
+					tdomain.desired = nodeThrottle * it2->second;
+					tdomain.load = domain.load;
+					tnode.domains.push_back(std::move(tdomain));
+				}
+			}
+			
+			if (!tnode.domains.empty())
+				topo->nodes.push_back(std::move(tnode));
+		}
+		
+		std::lock_guard<std::mutex> lock(topologyMutex);
+		if (generation > storedTopologyGeneration) {
+			storedTopologyGeneration = generation;
+			std::atomic_store(&topology, std::shared_ptr<const Topology>(std::move(topo)));
+		}
 	}
 
+	void Master::bindRoom(const std::shared_ptr<MasterNode>& node,
+						  const std::string& room, const std::string& version)
+	{
+		rooms.update(room, [&] (std::vector<RoomBinding>& bindings) {
+			for (auto& binding: bindings) {
+				if (binding.node == node.get()) {
+					binding.version = version;
+					return true;
+				}
+			}
+			
+			RoomBinding binding;
+			binding.node = node.get();
+			binding.nodeRef = node;
+			binding.version = version;
+			bindings.push_back(std::move(binding));
+			return true;
+		});
+	}
+	
+	void Master::unbindRoom(const MasterNode *node, const std::string& room)
+	{
+		rooms.update(room, [node] (std::vector<RoomBinding>& bindings) {
+			bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+										  [node] (const RoomBinding& binding) {
+											  return binding.node == node;
+										  }), bindings.end());
+			return !bindings.empty();
+		});
+	}
+    
     std::vector<std::string> Master::getAllVersionNames()
     {
         std::vector<std::string> ret;
@@ -552,64 +837,65 @@ namespace mcore
 	{
 		using RetType = std::pair<std::shared_ptr<MasterNode>, std::string>;
 		
-		auto room = client->room();
+		auto topo = std::atomic_load(&topology);
+		if (!topo)
+			return boost::none;
 		
-		std::vector<Balancer<RetType>::Item> items;
-		{
-			std::lock_guard<std::recursive_mutex> lock(nodeConnectionsMutex);
-			std::lock_guard<std::recursive_mutex> lock2(nodeThrottlesMutex);
-			std::lock_guard<std::recursive_mutex> lock3(versionsMutex);
-			for (const auto& c: nodes) {
-				auto node = c.second;
-				if (!node->isConnected())
-					continue;
-				
-				// Has room?
-				auto verOrNone = node->findDomainForRoom(room);
-				if (verOrNone) {
-					auto ver = *verOrNone;
-					if (client->doesAcceptVersion(ver))
-						return RetType(node, ver);
+		// Has room?
+		const auto& room = client->room();
+		if (!room.empty()) {
+			auto bindings = rooms.find(room);
+			if (bindings) {
+				for (const auto& binding: *bindings) {
+					auto node = binding.nodeRef.lock();
+					if (node && node->isConnected() &&
+						client->doesAcceptVersion(binding.version))
+						return RetType(node, binding.version);
 				}
+			}
+		}
+		
+		// Most versions are served by many nodes; match each one against
+		// the client's request only once. (-1: not checked yet)
+		std::vector<signed char> versionAccepted(topo->versionNames.size(), -1);
+		
+		// Keyed by the indices of the node and the domain.
+		using Key = std::pair<std::size_t, std::size_t>;
+		std::vector<Balancer<Key>::Item> items;
+		
+		for (std::size_t i = 0; i < topo->nodes.size(); ++i) {
+			const auto& n = topo->nodes[i];
+			if (!n.node->isConnected())
+				continue;
+			
+			for (std::size_t j = 0; j < n.domains.size(); ++j) {
+				const auto& domain = n.domains[j];
 				
-				// Get node throttle value
-				auto it = nodeThrottles.find(node->nodeInfo().nodeName);
-				if (it == nodeThrottles.end())
+				// Client accepts the version?
+				auto& accepted = versionAccepted[domain.version];
+				if (accepted < 0)
+					accepted = client->doesAcceptVersion(topo->versionNames[domain.version]) ? 1 : 0;
+				if (!accepted)
 					continue;
 				
-				double nodeThrottle = it->second;
-				if (nodeThrottle <= 0.0)
-					continue;
+				// Add as balancer item
+				Balancer<Key>::Item item;
 				
-				// For every domains of the node...
-				for (const auto& domain: node->domainStatuses()) {
-					auto it2 = versions.find(domain.versionName);
-					if (it2 == versions.end())
-						continue;
-					
-					// Get version throttle value
-					double versionThrottle = it2->second.throttle;
-					if (versionThrottle <= 0.0)
-						continue;
-					
-					// Client accepts the version?
-					if (!client->doesAcceptVersion(it2->first))
-						continue;
-					
-					// Add as balancer item
-					Balancer<RetType>::Item item;
-					
-					item.key = RetType(node, domain.versionName);
-					item.current = static_cast<double>(domain.numClients);
-					item.desired = nodeThrottle * versionThrottle;
-					
-					items.emplace_back(std::move(item));
-				}
+				item.key = Key(i, j);
+				item.current = static_cast<double>(domain.load->numClients.load(std::memory_order_relaxed));
+				item.desired = domain.desired;
+				
+				items.emplace_back(std::move(item));
 			}
 		}
 		
 		// Invoke balancer
-		return Balancer<RetType>().performBalancing(items);
+		auto key = Balancer<Key>().performBalancing(items);
+		if (!key)
+			return boost::none;
+		
+		const auto& n = topo->nodes[key->first];
+		return RetType(n.node, topo->versionNames[n.domains[key->second].version]);
 	}
 }
 
@@ -26,7 +26,11 @@
 #include <mutex>
 #include <list>
 #include <functional>
+#include <chrono>
+#include <atomic>
 #include "Logging.hpp"
+#include "Protocol.hpp"
+#include "ShardedMap.hpp"
 
 namespace mcore
 {
@@ -36,6 +40,8 @@ namespace mcore
     class MasterListener;
     class MasterClient;
 	class MasterClientResponse;
+	class SslSessionTicketKeys;
+	class AdmissionControl;
 
     struct MasterParameters
     {
@@ -46,6 +52,21 @@ namespace mcore
 		std::string sslPassword;
 		std::function<std::string(const std::string&)> getPackagePathFunction;
 		bool allowVersionSpecification;
+		bool terminateWebSocket;
+		bool sslSessionResumption;
+		bool kernelTls;
+		std::size_t sslSessionCacheSize;
+		std::chrono::seconds sslSessionTimeout;
+		std::chrono::seconds sslTicketKeyRotationInterval;
+		std::size_t maxConcurrentHandshakes;
+		std::size_t maxQueuedHandshakes;
+		bool webSocketCompression;
+		bool webSocketCompressionNoContextTakeover;
+		int webSocketCompressionWindowBits;
+		int webSocketCompressionMemoryLevel;
+		int webSocketCompressionLevel;
+		std::size_t webSocketMaxInflatedMessageSize;
+		std::size_t numClientAcceptors;
 		
         MasterParameters() { }
         MasterParameters(const MSCMasterParameters&);
@@ -56,6 +77,21 @@ namespace mcore
         std::string name;
         double throttle;
     };
+	
+	/** Number of clients of a domain. Shared by <MasterNode> and the
+	 * topology snapshots, so that it can be updated without locks. */
+	struct MasterDomainLoad
+	{
+		std::atomic<std::size_t> numClients;
+		
+		MasterDomainLoad(): numClients(0) { }
+	};
+	
+	struct MasterDomainInfo
+	{
+		std::string versionName;
+		std::shared_ptr<MasterDomainLoad> load;
+	};
 
     class Master:
 	boost::noncopyable
@@ -95,18 +131,45 @@ namespace mcore
 		std::unordered_map<MasterNode *, std::shared_ptr<MasterNode>> nodes;
 		std::recursive_mutex nodesMutex;
 		
-        std::shared_ptr<MasterClient> waitingClient;
-        std::unordered_map<std::uint64_t, std::shared_ptr<MasterClient>> clients;
-        boost::asio::ip::tcp::acceptor clientAcceptor;
+		/** One of the sockets listening on the client endpoint, with the
+		 * socket its next connection is accepted into. Clients accepted
+		 * by it are served by the same io_service. `retryTimer` delays
+		 * accepting again after a transient error. */
+		struct ClientAcceptor
+		{
+			boost::asio::io_service& service;
+			boost::asio::ip::tcp::acceptor acceptor;
+			boost::asio::ip::tcp::socket socket;
+			boost::asio::deadline_timer retryTimer;
+			
+			ClientAcceptor(boost::asio::io_service& service):
+			service(service), acceptor(service), socket(service), retryTimer(service) { }
+		};
+		
+        ShardedMap<std::uint64_t, std::shared_ptr<MasterClient>> clients;
+		std::vector<std::unique_ptr<ClientAcceptor>> clientAcceptors;
+		std::atomic<std::uint64_t> nextClientId;
 		std::mutex clientAcceptorMutex;
 		std::condition_variable clientAcceptorCV;
-		bool clientAcceptorRunning;
-        std::recursive_mutex clientsMutex;
+		std::size_t numRunningClientAcceptors;
+		std::shared_ptr<AdmissionControl> clientHandshakes;
 		void removeClient(std::uint64_t);
-        void acceptClientAsync(bool initial);
+		void openClientAcceptors();
+        void acceptClientAsync(ClientAcceptor&, bool initial);
+		/** Returns how long to wait before accepting again after the
+		 * error, or none if the acceptor is unusable. */
+		static boost::optional<boost::posix_time::time_duration>
+		acceptRetryDelay(const boost::system::error_code&);
+		void retryAcceptClient(ClientAcceptor&, boost::posix_time::time_duration delay);
+		void clientAcceptorStopped();
+		void handleNewClient(boost::asio::io_service&, boost::asio::ip::tcp::socket&& socket);
+		ClientStreamFraming clientStreamFraming() const
+		{
+			return _parameters.terminateWebSocket ?
+			ClientStreamFraming::Message : ClientStreamFraming::WebSocket;
+		}
 		
-		std::unordered_map<std::uint64_t, PendingClient> pendingClients;
-		std::recursive_mutex pendingClientsMutex;
+		ShardedMap<std::uint64_t, PendingClient> pendingClients;
 
         std::unordered_set<MasterListener *> listeners;
         std::recursive_mutex listenersMutex;
@@ -117,7 +180,45 @@ namespace mcore
 		std::unordered_map<std::string, double> nodeThrottles;
 		std::recursive_mutex nodeThrottlesMutex;
 		
+		/** Immutable view of the nodes, their domains and the throttles for
+		 * <bindClientToDomain>, which reads it without locks. Rebuilt
+		 * whenever any of them changes. */
+		struct Topology
+		{
+			struct Domain
+			{
+				std::size_t version; // Index into `versionNames`
+				double desired;
+				std::shared_ptr<const MasterDomainLoad> load;
+			};
+			struct Node
+			{
+				std::shared_ptr<MasterNode> node;
+				std::vector<Domain> domains;
+			};
+			std::vector<std::string> versionNames;
+			std::vector<Node> nodes;
+		};
+		std::shared_ptr<const Topology> topology;
+		std::atomic<std::uint64_t> topologyGeneration;
+		std::uint64_t storedTopologyGeneration;
+		std::mutex topologyMutex;
+		
+		/** Which nodes and versions each room is bound to, oldest binding
+		 * first. Maintained by the nodes so that a room is found without
+		 * asking each of them. A node binds a room at most once. */
+		struct RoomBinding
+		{
+			const MasterNode *node;
+			std::weak_ptr<MasterNode> nodeRef;
+			std::string version;
+		};
+		ShardedMap<std::string, std::vector<RoomBinding>> rooms;
+		
+		// Referenced by `_sslContext`, so declared before it.
+		std::unique_ptr<SslSessionTicketKeys> sslTicketKeys;
         boost::asio::ssl::context _sslContext;
+		void setupSslSessionResumption();
 
         void invalidate();
         void checkValid() const;
@@ -154,6 +255,16 @@ namespace mcore
         MSCMaster handle() { return reinterpret_cast<MSCMaster>(this); }
         static Master *fromHandle(MSCMaster handle) { return reinterpret_cast<Master *>(handle); }
 		
+		/** Rebuilds the snapshot used by <bindClientToDomain>. Must not be
+		 * called with any of the master's or nodes' mutexes held. */
+		void updateTopology();
+		
+		void bindRoom(const std::shared_ptr<MasterNode>&,
+					  const std::string& room, const std::string& version);
+		/** Removes the node's binding of the room. Bindings by other nodes
+		 * are kept. */
+		void unbindRoom(const MasterNode *, const std::string& room);
+		
 		boost::optional<std::pair<std::shared_ptr<MasterNode>, std::string>>
 		bindClientToDomain(const std::shared_ptr<MasterClient>& client);
     };
@@ -24,6 +24,10 @@
 #include <boost/format.hpp>
 #include "MasterNode.hpp"
 #include "LikeMatcher.hpp"
+#include "AdmissionControl.hpp"
+#include "KernelTls.hpp"
+#include <boost/utility/string_ref.hpp>
+#include <cctype>
 
 namespace asio = boost::asio;
 namespace ssl = boost::asio::ssl;
@@ -35,7 +39,7 @@ namespace mcore
 
 	namespace
 	{
-		std::string decodeRoomName(const std::string& encoded)
+		void decodeRoomName(boost::string_ref encoded, std::string& ret)
 		{
 			auto hex_decode = [] (char c) -> int
 			{
@@ -52,7 +56,6 @@ namespace mcore
 			if (encoded.size() & 1)
 				MSCThrow(InvalidFormatException("Length of the encoded room name must be even."));
 			
-			std::string ret;
 			ret.resize(encoded.size() >> 1);
 			
 			for (std::size_t i = 0; i < ret.size(); ++i) {
@@ -65,23 +68,78 @@ namespace mcore
 					MSCThrow(InvalidFormatException("Encoded room name contains an invalid character."));
 				}
 			}
+		}
+		
+		/** Splits "/<version>/<room>" into its two segments, which may be empty. */
+		bool parseClientPath(boost::string_ref path, boost::string_ref& version, boost::string_ref& room)
+		{
+			if (path.empty() || path[0] != '/')
+				return false;
+			path.remove_prefix(1);
+			
+			auto slash = path.find('/');
+			if (slash == boost::string_ref::npos)
+				return false;
 			
-			return ret;
+			version = path.substr(0, slash);
+			room = path.substr(slash + 1);
+			return room.find('/') == boost::string_ref::npos;
+		}
+		
+		/** Checks whether a comma-separated Sec-WebSocket-Protocol value lists the protocol. */
+		bool hasSubprotocol(boost::string_ref encoded, boost::string_ref protocol)
+		{
+			while (!encoded.empty()) {
+				auto comma = encoded.find(',');
+				auto token = encoded.substr(0, comma);
+				encoded = comma == boost::string_ref::npos ?
+				boost::string_ref() : encoded.substr(comma + 1);
+				
+				while (!token.empty() && std::isspace(static_cast<unsigned char>(token.front())))
+					token.remove_prefix(1);
+				while (!token.empty() && std::isspace(static_cast<unsigned char>(token.back())))
+					token.remove_suffix(1);
+				
+				if (boost::iequals(token, protocol))
+					return true;
+			}
+			return false;
 		}
 	}
 	
-    MasterClient::MasterClient(Master& master, std::uint64_t id,
-							   bool allowSpecifyVersion):
+    MasterClient::MasterClient(Master& master, asio::io_service& service,
+							   std::uint64_t id,
+							   bool allowSpecifyVersion,
+							   ClientStreamFraming framing):
 	clientId(id),
-	service(master.library()->ioService()),
+	service(service),
 	_strand(service),
 	sslContext(master.sslContext()),
 	sslSocket(service, sslContext),
 	webSocketServer(sslSocket),
 	disposed(false),
-	timeoutTimer(service),
-	allowSpecifyVersion(allowSpecifyVersion)
+	timeoutTimer(master.library()->timingWheel(service)),
+	allowSpecifyVersion(allowSpecifyVersion),
+	_framing(framing)
     {
+		const auto& params = master.parameters();
+		if (params.kernelTls) {
+			kernelTls.reset(new KernelTls(sslSocket.native_handle()));
+		}
+		
+		// Messages are only compressed where WebSocket is terminated.
+		if (params.webSocketCompression && framing == ClientStreamFraming::Message) {
+			asiows::web_socket_deflate_options options;
+			options.enabled = true;
+			options.server_max_window_bits = params.webSocketCompressionWindowBits;
+			options.client_max_window_bits = params.webSocketCompressionWindowBits;
+			options.server_no_context_takeover = params.webSocketCompressionNoContextTakeover;
+			options.client_no_context_takeover = params.webSocketCompressionNoContextTakeover;
+			options.mem_level = params.webSocketCompressionMemoryLevel;
+			options.level = params.webSocketCompressionLevel;
+			options.max_inflated_message_size = params.webSocketMaxInflatedMessageSize;
+			webSocketServer.set_deflate_options(options);
+		}
     }
 
     MasterClient::~MasterClient()
@@ -89,7 +147,7 @@ namespace mcore
 		BOOST_LOG_SEV(log, LogLevel::Debug) << "Finalized.";
     }
 
-    void MasterClient::handleNewClient()
+    void MasterClient::handleNewClient(const std::shared_ptr<AdmissionControl>& handshakeAdmission)
     {
 		auto self = shared_from_this();
 		std::lock_guard<ioMutexType> lock(mutex);
@@ -98,19 +156,80 @@ namespace mcore
 		log.setChannel(str(format("Client:%d [%s]") % clientId % tcpSocket().remote_endpoint()));
 		BOOST_LOG_SEV(log, LogLevel::Debug) << "Client connected from " << tcpSocket().remote_endpoint();
 		
-        sslSocket.async_handshake(sslSocketType::server, _strand.wrap([this, self](const boost::system::error_code& error) {
-            handshakeDone(error);
-        }));
-        
-        timeoutTimer.expires_from_now(boost::posix_time::seconds(5));
-        timeoutTimer.async_wait(_strand.wrap([this, self](const boost::system::error_code& error) {
-            if (error)
-                return;
+		// Time spent waiting for the admission counts.
+        timeoutTimer.expiresFromNow(std::chrono::seconds(5), _strand.wrap([this, self] {
 			BOOST_LOG_SEV(log, LogLevel::Debug) << "Timed out. Disconnecting.";
             shutdown();
         }));
+		
+		// The queue must not keep clients that have gone alive; they also
+		// remove themselves from it when shut down.
+		std::weak_ptr<MasterClient> weakSelf = self;
+		this->handshakeAdmission = handshakeAdmission;
+		handshakeTicket = handshakeAdmission->enter([weakSelf] {
+			auto self = weakSelf.lock();
+			if (!self || self->disposed)
+				return false;
+			
+			// A freed slot is handed over from the completion handler of
+			// another client, which may run on another shard. Start the
+			// handshake on this client's own strand.
+			self->_strand.post([self] {
+				if (!self->startHandshake())
+					self->handshakeAdmission->leave();
+			});
+			return true;
+		});
+		if (handshakeTicket == AdmissionControl::Rejected) {
+			BOOST_LOG_SEV(log, LogLevel::Debug) << "Too many pending TLS handshakes. Disconnecting.";
+			shed();
+		}
     }
 	
+	bool MasterClient::startHandshake()
+	{
+		auto self = shared_from_this();
+		std::lock_guard<ioMutexType> lock(mutex);
+		
+		if (disposed) {
+			// Timed out while waiting.
+			return false;
+		}
+		
+        sslSocket.async_handshake(sslSocketType::server, _strand.wrap([this, self](const boost::system::error_code& error) {
+			// Let the next client in before doing anything else.
+			handshakeAdmission->leave();
+            handshakeDone(error);
+        }));
+		return true;
+	}
+	
+	void MasterClient::enableKernelTlsTransmit()
+	{
+		if (!kernelTls) {
+			return;
+		}
+		if (kernelTls->enableTransmit(tcpSocket().native_handle())) {
+			BOOST_LOG_SEV(log, LogLevel::Debug) << "Kernel TLS enabled for sending.";
+		} else {
+			BOOST_LOG_SEV(log, LogLevel::Debug) << "Kernel TLS is unavailable. Using OpenSSL.";
+			kernelTls.reset();
+		}
+	}
+	
+	bool MasterClient::isKernelTlsTransmitEnabled() const
+	{
+		return kernelTls && kernelTls->isTransmitEnabled();
+	}
+	
+	void MasterClient::shed()
+	{
+		// Reset the connection so no TLS work or TIME_WAIT state is spent on it.
+		boost::system::error_code ec;
+		tcpSocket().set_option(asio::socket_base::linger(true, 0), ec);
+		shutdown();
+	}
+	
 	void MasterClient::rejectHandshake(int status)
 	{
 		auto self = shared_from_this();
@@ -131,10 +250,6 @@ namespace mcore
 		}
 	}
 	
-	static std::regex urlRegex {
-		"\\/([^/]*)\\/([^/]*)"
-	};
-	
     void MasterClient::handshakeDone(const boost::system::error_code &error)
 	{
 		auto self = shared_from_this();
@@ -160,31 +275,17 @@ namespace mcore
 			try {
 				
 				// Read subprotocols.
-				std::vector<std::string> protos;
-				boost::split(protos, webSocketServer.encoded_protocols(),
-							 [] (char c) { return c == ','; },
-							 boost::token_compress_on);
-				
-				bool valid = false;
-				for (auto& proto: protos) {
-					boost::trim(proto);
-					if (boost::iequals(proto, "merlion.yvt.jp")) {
-						valid = true;
-						break;
-					}
-				}
-				
-				if (!valid) {
+				if (!hasSubprotocol(webSocketServer.encoded_protocols(), "merlion.yvt.jp")) {
 					// Protocol negotiation failed.
 					BOOST_LOG_SEV(log, LogLevel::Debug) << "WebSocket subprotocol negotiation failed. Disconnecting.";
 					rejectHandshake(asiows::http_status_codes::bad_request);
 					return;
 				}
 				
-				std::string path = webSocketServer.http_absolute_path().path;
-				std::smatch matches;
+				const std::string& path = webSocketServer.http_absolute_path().path;
+				boost::string_ref encodedVersion, encodedRoom;
 				
-				if (!std::regex_match(path, matches, urlRegex)) {
+				if (!parseClientPath(path, encodedVersion, encodedRoom)) {
 					BOOST_LOG_SEV(log, LogLevel::Debug) << "Unrecognizable path format. Disconnecting.: " <<
 					boost::current_exception_diagnostic_information();
 					rejectHandshake(asiows::http_status_codes::not_found);
@@ -192,23 +293,22 @@ namespace mcore
 				}
 				
 				try {
-					_room = decodeRoomName(matches[2].str());
+					decodeRoomName(encodedRoom, _room);
 				} catch (...) {
 					BOOST_LOG_SEV(log, LogLevel::Debug) << "Decoding room name failed. Disconnecting.: " <<
 					boost::current_exception_diagnostic_information();
 					rejectHandshake(asiows::http_status_codes::bad_request);
+					return;
 				}
 				
 				BOOST_LOG_SEV(log, LogLevel::Debug) <<
-				format("Client requests room '%s' (hex encoded).") % matches[2].str();
-				
-				std::string requestedVersion = matches[1].str();
+				format("Client requests room '%s' (hex encoded).") % encodedRoom;
 				
 				BOOST_LOG_SEV(log, LogLevel::Debug) <<
-				format("Client requests version '%s'.") % requestedVersion;
+				format("Client requests version '%s'.") % encodedVersion;
 				
 				if (allowSpecifyVersion) {
-					versionRequest.reset(new LikeMatcher(requestedVersion));
+					versionRequest = LikeMatcher::get(encodedVersion);
 					BOOST_LOG_SEV(log, LogLevel::Debug) <<
 					"Version request string parsed.";
 				} else {
@@ -218,14 +318,8 @@ namespace mcore
 				
 				std::shared_ptr<MasterClientResponse> resp(new MasterClientResponse(shared_from_this()));
 				
-				timeoutTimer.cancel();
-				
 				// Request a node to start a connection.
-				timeoutTimer.expires_from_now(boost::posix_time::seconds(5));
-				timeoutTimer.async_wait([resp](const boost::system::error_code& error) {
-					if (error)
-						return;
-					
+				timeoutTimer.expiresFromNow(std::chrono::seconds(5), [resp] {
 					resp->reject("Timed out.",
 								 asiows::http_status_codes::request_timeout);
 				});
@@ -274,6 +368,9 @@ namespace mcore
 				onfail();
 				shutdown();
 			} else {
+				if (webSocketServer.socket().deflate_enabled()) {
+					BOOST_LOG_SEV(log, LogLevel::Debug) << "Using permessage-deflate.";
+				}
 				auto gotHandler = onsuccess();
 				handler = gotHandler;
 				try {
@@ -312,7 +409,10 @@ namespace mcore
 			
 			onShutdown();
 			
-			try { sslSocket.shutdown(); } catch (...) { }
+			if (!isKernelTlsTransmitEnabled()) {
+				// OpenSSL can no longer write once the kernel took over.
+				try { sslSocket.shutdown(); } catch (...) { }
+			}
 			try { tcpSocket().shutdown(socketType::shutdown_both); } catch (...) { }
 			try { tcpSocket().close(); } catch (...) { }
 			assert(!tcpSocket().is_open());
@@ -324,6 +424,9 @@ namespace mcore
 			handler.reset();
 			
 			timeoutTimer.cancel();
+			
+			if (handshakeAdmission)
+				handshakeAdmission->cancel(handshakeTicket);
 		});
     }
 	
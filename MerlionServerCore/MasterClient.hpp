@@ -22,10 +22,13 @@
 #include "Protocol.hpp"
 #include "Logging.hpp"
 #include <atomic>
+#include <array>
 #include "Utils.hpp"
 #include "Exceptions.hpp"
 #include "AsyncPipe.hpp"
+#include "AdmissionControl.hpp"
 #include "WebSocket.hpp"
+#include "TimingWheel.hpp"
 
 namespace mcore
 {
@@ -35,6 +38,7 @@ namespace mcore
 	class MasterClientResponse;
 	class LikeMatcher;
 	class BaseMasterClientHandler;
+	class KernelTls;
 	
     class MasterClient :
 	public std::enable_shared_from_this<MasterClient>,
@@ -52,10 +56,13 @@ namespace mcore
 		friend class MasterClientResponse;
 		template <class T>
 		friend class MasterClientHandler;
+		template <class T>
+		friend class MasterClientMessageHandler;
 		
 		TypedLogger<MasterClient> log;
 		
 		bool allowSpecifyVersion;
+		ClientStreamFraming const _framing;
         
         std::uint64_t clientId;
 
@@ -70,17 +77,30 @@ namespace mcore
         boost::asio::ssl::context& sslContext;
         sslSocketType sslSocket;
 		webSocketServerType webSocketServer;
+		std::unique_ptr<KernelTls> kernelTls; // refers to `sslSocket`
 		
 		std::weak_ptr<BaseMasterClientHandler> handler;
         
-        boost::asio::deadline_timer timeoutTimer;
+        TimingWheel::Timer timeoutTimer;
+		
+		std::shared_ptr<AdmissionControl> handshakeAdmission;
+		AdmissionControl::Ticket handshakeTicket = AdmissionControl::Rejected;
 		
 		std::string version;
 		std::string _room;
-		std::unique_ptr<LikeMatcher> versionRequest;
+		std::shared_ptr<const LikeMatcher> versionRequest;
 		
+		/** Called in the strand once admitted. Returns `false` without
+		 * starting if the client has gone. */
+		bool startHandshake();
         void handshakeDone(const boost::system::error_code&);
 		void rejectHandshake(int);
+		void shed();
+		
+		/** Lets the kernel encrypt the data sent from now on, if enabled
+		 * and possible. Must be called in the strand with no writes pending. */
+		void enableKernelTlsTransmit();
+		bool isKernelTlsTransmitEnabled() const;
 		
 		void connectionApproved(std::function<std::shared_ptr<BaseMasterClientHandler>()> onsuccess,
 								std::function<void()> onfail,
@@ -89,8 +109,10 @@ namespace mcore
 		
 		
     public:
-        MasterClient(Master& master, std::uint64_t id,
-					 bool allowSpecifyVersion);
+        MasterClient(Master& master, boost::asio::io_service& service,
+					 std::uint64_t id,
+					 bool allowSpecifyVersion,
+					 ClientStreamFraming framing);
         ~MasterClient();
         
         std::uint64_t id() const { return clientId; }
@@ -99,9 +121,15 @@ namespace mcore
 		
 		const std::string& room() const { return _room; }
 		
+		/** Framing of the data stream between the master and the node. */
+		ClientStreamFraming framing() const { return _framing; }
+		
 		bool doesAcceptVersion(const std::string&);
 		
-        void handleNewClient();
+		/** Starts the TLS handshake once `handshakeAdmission` lets it in.
+		 * The client is disconnected right away if too many handshakes are
+		 * waiting. */
+        void handleNewClient(const std::shared_ptr<AdmissionControl>& handshakeAdmission);
         void shutdown();
 		
 		boost::signals2::signal<void(const std::shared_ptr<MasterClientResponse>&)> onNeedsResponse;
@@ -139,12 +167,14 @@ namespace mcore
 		friend class MasterClient;
 		template <class T>
 		friend class MasterClientHandler;
+		template <class T>
+		friend class MasterClientMessageHandler;
 		virtual void handleClient(std::shared_ptr<MasterClient>) = 0;
 		virtual void shutdown() = 0;
 	};
 	
-	/** For an implementation of T, see
-	 * <MasterNodeClientStream::ClientHandler>. */
+	/** For implementations of T, see
+	 * <MasterNodeClientStream::ClientHandler> and <DataChannelStream>. */
 	template <class T>
 	class MasterClientHandler :
 	boost::noncopyable,
@@ -185,6 +215,12 @@ namespace mcore
 				auto client = this->client;
 				strand.dispatch([buffer, callback, client, this] {
 					auto& strand = client->_strand;
+					if (client->isKernelTlsTransmitEnabled()) {
+						client->tcpSocket().async_write_some
+						(std::move(buffer),
+						 strand.wrap(std::move(callback)));
+						return;
+					}
 					auto& sslSocket = client->sslSocket;
 					sslSocket.async_write_some
 					(std::move(buffer),
@@ -204,6 +240,8 @@ namespace mcore
 			std::shared_ptr<ClientInputOutput> io
 			(new ClientInputOutput(client));
 			
+			client->enableKernelTlsTransmit();
+			
 			// Pass-through WebSocket packets.
 			
 			// Start downstream
@@ -245,5 +283,264 @@ namespace mcore
 		handled(false)
 		{ }
 	};
+	
+	/** Terminates WebSocket on the master. Pings and close handshakes are
+	 * handled here, and only complete application messages are exchanged
+	 * with T, each framed as described in <ClientStreamFraming::Message>. */
+	template <class T>
+	class MasterClientMessageHandler :
+	boost::noncopyable,
+	public std::enable_shared_from_this<MasterClientMessageHandler<T>>,
+	public BaseMasterClientHandler
+	{
+		T baseHandler;
+		std::atomic<bool> handled;
+		std::shared_ptr<MasterClient> client;
+		
+		// Following members are only accessed in the client's strand.
+		std::vector<char> upstreamBuffer;
+		std::size_t upstreamLength;
+		std::array<char, 4> downstreamHeader;
+		std::vector<char> downstreamBuffer;
+		std::size_t downstreamOffset;
+		bool downstreamStreaming = false;
+		
+		MasterClient::webSocketServerType::socket_type& webSocket()
+		{
+			return client->webSocketServer.socket();
+		}
+		
+		void receiveUpstream()
+		{
+			auto self = this->shared_from_this();
+			webSocket().async_receive_message(client->_strand.wrap([self, this] (const boost::system::error_code& error) {
+				if (error) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Upstream error.: " << error;
+					client->shutdown();
+					return;
+				}
+				upstreamLength = 0;
+				readUpstream();
+			}));
+		}
+		
+		void readUpstream()
+		{
+			if (upstreamLength == ClientMessageMaxLength) {
+				// Forward what we have so far as a chunk.
+				sendUpstream(true);
+				return;
+			}
+			
+			auto self = this->shared_from_this();
+			auto readSize = std::min<std::size_t>(4096, ClientMessageMaxLength - upstreamLength);
+			upstreamBuffer.resize(4 + upstreamLength + readSize);
+			webSocket().async_read_some(boost::asio::buffer(upstreamBuffer.data() + 4 + upstreamLength, readSize),
+										client->_strand.wrap([self, this] (const boost::system::error_code& error, std::size_t count) {
+				if (error) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Upstream error.: " << error;
+					client->shutdown();
+					return;
+				}
+				
+				if (count == 0) {
+					// End of message.
+					sendUpstream(false);
+					return;
+				}
+				
+				upstreamLength += count;
+				readUpstream();
+			}));
+		}
+		
+		void sendUpstream(bool continued)
+		{
+			auto self = this->shared_from_this();
+			encodeClientMessageHeader(upstreamBuffer.data(),
+									  static_cast<std::uint32_t>(upstreamLength) |
+									  (continued ? ClientMessageContinuedFlag : 0));
+			upstreamBuffer.resize(4 + upstreamLength);
+			boost::asio::async_write(*baseHandler, boost::asio::buffer(upstreamBuffer),
+									 client->_strand.wrap([self, this, continued] (const boost::system::error_code& error, std::size_t) {
+				if (error) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Upstream error.: " << error;
+					client->shutdown();
+					return;
+				}
+				if (continued) {
+					upstreamLength = 0;
+					readUpstream();
+				} else {
+					receiveUpstream();
+				}
+			}));
+		}
+		
+		void receiveDownstream()
+		{
+			auto self = this->shared_from_this();
+			boost::asio::async_read(*baseHandler, boost::asio::buffer(downstreamHeader),
+									client->_strand.wrap([self, this] (const boost::system::error_code& error, std::size_t) {
+				if (error == boost::asio::error::eof) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Downstream reached EOF.";
+					auto client = this->client;
+					webSocket().async_shutdown(asiows::web_socket_close_status_codes::normal_closure, "", false,
+											   client->_strand.wrap([client] (const boost::system::error_code&) {
+						client->shutdown();
+					}));
+					return;
+				} else if (error) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Downstream error.: " << error;
+					client->shutdown();
+					return;
+				}
+				
+				auto header = decodeClientMessageHeader(downstreamHeader.data());
+				auto length = header & ~ClientMessageContinuedFlag;
+				bool continued = (header & ClientMessageContinuedFlag) != 0;
+				if (length > ClientMessageMaxLength) {
+					BOOST_LOG_SEV(client->log, LogLevel::Warn) <<
+					"Node sent a message that is too long. Disconnecting.";
+					client->shutdown();
+					return;
+				}
+				
+				downstreamBuffer.resize(length);
+				boost::asio::async_read(*baseHandler, boost::asio::buffer(downstreamBuffer),
+										client->_strand.wrap([self, this, continued] (const boost::system::error_code& error, std::size_t) {
+					if (error) {
+						BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+						"Downstream error.: " << error;
+						client->shutdown();
+						return;
+					}
+					if (continued || downstreamStreaming) {
+						sendDownstreamChunk(continued);
+					} else {
+						sendDownstream();
+					}
+				}));
+			}));
+		}
+		
+		void sendDownstream()
+		{
+			auto self = this->shared_from_this();
+			asiows::web_socket_message_header header;
+			header.reserved1 = true; // compress if permessage-deflate is in use
+			webSocket().async_send_message(header, boost::asio::buffer(downstreamBuffer),
+										   client->_strand.wrap([self, this] (const boost::system::error_code& error) {
+				if (error) {
+					BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+					"Downstream error.: " << error;
+					client->shutdown();
+					return;
+				}
+				receiveDownstream();
+			}));
+		}
+		
+		// Chunks of a streamed message are written as WebSocket frames
+		// as they arrive, without buffering the entire message.
+		void sendDownstreamChunk(bool continued)
+		{
+			auto self = this->shared_from_this();
+			if (!downstreamStreaming) {
+				downstreamStreaming = true;
+				asiows::web_socket_message_header header;
+				header.reserved1 = true; // compress if permessage-deflate is in use
+				webSocket().async_begin_write(header, client->_strand.wrap([self, this, continued] (const boost::system::error_code& error) {
+					if (error) {
+						BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+						"Downstream error.: " << error;
+						client->shutdown();
+						return;
+					}
+					downstreamOffset = 0;
+					writeDownstreamChunk(continued);
+				}));
+				return;
+			}
+			downstreamOffset = 0;
+			writeDownstreamChunk(continued);
+		}
+		
+		void writeDownstreamChunk(bool continued)
+		{
+			auto self = this->shared_from_this();
+			if (downstreamOffset < downstreamBuffer.size()) {
+				webSocket().async_write_some(boost::asio::buffer(downstreamBuffer.data() + downstreamOffset,
+																 downstreamBuffer.size() - downstreamOffset),
+											 client->_strand.wrap([self, this, continued] (const boost::system::error_code& error, std::size_t count) {
+					if (error) {
+						BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+						"Downstream error.: " << error;
+						client->shutdown();
+						return;
+					}
+					downstreamOffset += count;
+					writeDownstreamChunk(continued);
+				}));
+			} else if (continued) {
+				receiveDownstream();
+			} else {
+				downstreamStreaming = false;
+				webSocket().async_end_write(client->_strand.wrap([self, this] (const boost::system::error_code& error) {
+					if (error) {
+						BOOST_LOG_SEV(client->log, LogLevel::Debug) <<
+						"Downstream error.: " << error;
+						client->shutdown();
+						return;
+					}
+					receiveDownstream();
+				}));
+			}
+		}
+		
+		void handleClient(std::shared_ptr<MasterClient> client) override final
+		{
+			if (handled.exchange(true)) {
+				MSCThrow(InvalidOperationException("handleClient was called twice."));
+			}
+			
+			// Called in the client's strand.
+			this->client = client;
+			receiveUpstream();
+			receiveDownstream();
+		}
+		
+		void shutdown()
+		{
+			baseHandler->shutdown();
+		}
+	public:
+		MasterClientMessageHandler(const T& baseHandler):
+		baseHandler(baseHandler),
+		handled(false)
+		{ }
+		MasterClientMessageHandler(T&& baseHandler):
+		baseHandler(baseHandler),
+		handled(false)
+		{ }
+	};
+	
+	/** Creates a handler which relays the client's traffic to `stream`
+	 * using the given framing. */
+	template <class T>
+	std::shared_ptr<BaseMasterClientHandler>
+	makeMasterClientHandler(const T& stream, ClientStreamFraming framing)
+	{
+		switch (framing) {
+			case ClientStreamFraming::Message:
+				return std::make_shared<MasterClientMessageHandler<T>>(stream);
+			default:
+				return std::make_shared<MasterClientHandler<T>>(stream);
+		}
+	}
 }
-
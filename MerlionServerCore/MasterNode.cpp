@@ -32,7 +32,8 @@ namespace mcore
 	MasterNode::MasterNode(const MasterNodeConnection::ptr&connection):
         connection(connection),
         connected(false),
-        sendReady(true)
+        sendReady(true),
+		_domainInfos(std::make_shared<std::vector<MasterDomainInfo>>())
 	{
 		channel = str(format("Unknown Node [%s]") % connection->tcpSocket().remote_endpoint());
 		log.setChannel(channel);
@@ -201,18 +202,34 @@ namespace mcore
 					case MasterCommand::VersionLoaded:
 						{
 							auto version = reader.readString();
-							std::lock_guard<std::recursive_mutex> lock(domainsMutex);
-							Domain& domain = domains[version];
-							domain.versionName = version;
-							domain.startTime = boost::posix_time::second_clock::universal_time();
+							{
+								std::lock_guard<std::recursive_mutex> lock(domainsMutex);
+								Domain& domain = domains[version];
+								domain.versionName = version;
+								domain.startTime = boost::posix_time::second_clock::universal_time();
+								if (!domain.load)
+									domain.load = std::make_shared<MasterDomainLoad>();
+								updateDomainInfos();
+							}
+							master().updateTopology();
 							break;
 						}
 
 					case MasterCommand::VersionUnloaded:
 						{
 							auto version = reader.readString();
-							std::lock_guard<std::recursive_mutex> lock(domainsMutex);
-							domains.erase(version);
+							{
+								std::lock_guard<std::recursive_mutex> lock(domainsMutex);
+								auto it = domains.find(version);
+								if (it != domains.end()) {
+									auto rooms = std::move(it->second.rooms);
+									for (const auto& room: rooms)
+										unbindRoom(room);
+									domains.erase(it);
+								}
+								updateDomainInfos();
+							}
+							master().updateTopology();
 							break;
 						}
 
@@ -223,8 +240,13 @@ namespace mcore
 							std::lock_guard<std::recursive_mutex> lock(domainsMutex);
 							auto it = domains.find(version);
 							if (it != domains.end()) {
+								// A room belongs to one domain at a time.
+								unbindRoom(room);
+								
 								Domain& domain = it->second;
 								domain.rooms.insert(room);
+								roomVersions[room] = version;
+								master().bindRoom(self, room, version);
 							}
 							break;
 						}
@@ -233,9 +255,7 @@ namespace mcore
 						{
 							auto room = reader.readString();
 							std::lock_guard<std::recursive_mutex> lock(domainsMutex);
-							for (auto& d: domains) {
-								d.second.rooms.erase(room);
-							}
+							unbindRoom(room);
 							break;
 						}
 
@@ -294,15 +314,21 @@ namespace mcore
 	
 	void MasterNode::sendClientConnected(std::uint64_t clientId,
 										 const std::string &version,
-										 const std::string &room)
+										 const std::string &room,
+										 ClientStreamFraming framing)
 	{
 		auto self = shared_from_this();
 		{
 			std::lock_guard<std::recursive_mutex> lock(sendMutex);
-			sendBuffer.write(NodeCommand::Connect);
+			// Nodes which predate ConnectEx only understand the WebSocket framing.
+			sendBuffer.write(framing == ClientStreamFraming::WebSocket ?
+							 NodeCommand::Connect : NodeCommand::ConnectEx);
 			sendBuffer.write(clientId);
 			sendBuffer.writeString(version);
 			sendBuffer.writeString(room);
+			if (framing != ClientStreamFraming::WebSocket) {
+				sendBuffer.write(framing);
+			}
 			
 			flushSendBuffer();
 		}
@@ -365,12 +391,13 @@ namespace mcore
 			return;
 		}
 		
-		it->second.clients.emplace(response->client()->id(),
-								   response->client());
+		if (it->second.clients.emplace(response->client()->id(),
+									   response->client()).second)
+			++it->second.load->numClients;
 		
 		BOOST_LOG_SEV(log, LogLevel::Debug) <<
 		format("Sending client connect request (id = '%d').") % client->id();
-		sendClientConnected(client->id(), version, client->room());
+		sendClientConnected(client->id(), version, client->room(), client->framing());
 		BOOST_LOG_SEV(log, LogLevel::Debug) <<
 		format("Client connect request sent (id = '%d').") % client->id();
 	}
@@ -391,8 +418,29 @@ namespace mcore
 		
 		connected = false;
         master().removeListener(this);
+		
+		{
+			std::lock_guard<std::recursive_mutex> lock(domainsMutex);
+			for (const auto& item: roomVersions)
+				master().unbindRoom(this, item.first);
+		}
+		
 		master().removeNode(this);
     }
+	
+	void MasterNode::unbindRoom(const std::string& room)
+	{
+		std::lock_guard<std::recursive_mutex> lock(domainsMutex);
+		auto it = roomVersions.find(room);
+		if (it == roomVersions.end())
+			return;
+		
+		auto it2 = domains.find(it->second);
+		if (it2 != domains.end())
+			it2->second.rooms.erase(room);
+		roomVersions.erase(it);
+		master().unbindRoom(this, room);
+	}
 
     void MasterNode::heartbeat(Master &param)
     {
@@ -408,7 +456,8 @@ namespace mcore
 	{
 		std::lock_guard<std::recursive_mutex> lock(domainsMutex);
 		for (auto& item: domains)
-			item.second.clients.erase(clientId);
+			if (item.second.clients.erase(clientId))
+				--item.second.load->numClients;
 	}
 	
 	std::size_t MasterNode::numClients()
@@ -440,19 +489,19 @@ namespace mcore
 		  startTime).total_seconds());;
 	}
 	
-	boost::optional<std::string> MasterNode::findDomainForRoom(const std::string& room)
+	void MasterNode::updateDomainInfos()
 	{
-		if (room.empty())
-			return boost::none;
+		auto infos = std::make_shared<std::vector<MasterDomainInfo>>();
 		
 		std::lock_guard<std::recursive_mutex> lock(domainsMutex);
+		infos->reserve(domains.size());
 		for (const auto& item: domains) {
-			auto it = item.second.rooms.find(room);
-			if (it != item.second.rooms.end())
-				return item.first;
+			MasterDomainInfo info;
+			info.versionName = item.second.versionName;
+			info.load = item.second.load;
+			infos->push_back(std::move(info));
 		}
-		
-		return boost::none;
+		std::atomic_store(&_domainInfos, std::shared_ptr<const std::vector<MasterDomainInfo>>(std::move(infos)));
 	}
 	
 	std::vector<MasterNode::DomainStatus> MasterNode::domainStatuses()
@@ -51,9 +51,18 @@ namespace mcore
 			std::unordered_map<std::uint64_t, std::shared_ptr<MasterClient>> clients;
             std::unordered_set<std::string> rooms;
 			boost::posix_time::ptime startTime;
+			std::shared_ptr<MasterDomainLoad> load;
         };
         std::unordered_map<std::string, Domain> domains;
         std::recursive_mutex domainsMutex;
+		
+		// Version each room is bound to. Guarded by `domainsMutex`.
+		std::unordered_map<std::string, std::string> roomVersions;
+		void unbindRoom(const std::string& room);
+		
+		// Copy of `domains` for <Master::updateTopology>; replaced atomically.
+		std::shared_ptr<const std::vector<MasterDomainInfo>> _domainInfos;
+		void updateDomainInfos();
 
         volatile bool connected;
 
@@ -88,8 +97,6 @@ namespace mcore
 		
 		const std::string& hostNameString() const { return _hostNameString; }
 		
-		boost::optional<std::string> findDomainForRoom(const std::string&);
-		
 		struct DomainStatus
 		{
 			std::string versionName;
@@ -99,6 +106,9 @@ namespace mcore
 		};
 		std::vector<DomainStatus> domainStatuses();
 		
+		std::shared_ptr<const std::vector<MasterDomainInfo>> domainInfos() const
+		{ return std::atomic_load(&_domainInfos); }
+		
 		void acceptClient(const std::shared_ptr<MasterClientResponse>& response,
 						  const std::string& version);
 		
@@ -109,7 +119,8 @@ namespace mcore
         void sendHeartbeat();
 		void sendClientConnected(std::uint64_t clientId,
 								 const std::string& version,
-								 const std::string& room);
+								 const std::string& room,
+								 ClientStreamFraming framing);
 
         void service() override;
     };
@@ -130,7 +130,7 @@ namespace mcore
 			req->response->accept
 			([this, self, cli] {
 				std::shared_ptr<ClientHandler> handler(new ClientHandler(self));
-				return std::make_shared<MasterClientHandler<std::shared_ptr<ClientHandler>>>(handler);
+				return makeMasterClientHandler(handler, cli->framing());
 			}, [this, self, cli] {
 				 shutdown();
 			}, req->version);
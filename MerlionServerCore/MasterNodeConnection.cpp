@@ -24,6 +24,7 @@
 #include <cassert>
 #include "MasterNode.hpp"
 #include "MasterNodeClientStream.hpp"
+#include "MasterNodeDataChannel.hpp"
 
 namespace asio = boost::asio;
 using boost::format;
@@ -32,11 +33,11 @@ namespace mcore
 {
     MasterNodeConnection::MasterNodeConnection(Master &master):
         _master(master),
-        service(master.ioService()),
+        service(master.library()->nextIoService()),
         accepted(false),
         disposed(false)
     {
-        socket = std::make_shared<socketType>(master.library()->ioService());
+        socket = std::make_shared<socketType>(service);
     }
 
     MasterNodeConnection::~MasterNodeConnection()
@@ -102,6 +103,8 @@ namespace mcore
                     MSCThrow(NotImplementedException());
 				} else if (header == DataStreamMagic) {
 					h = std::make_shared<MasterNodeClientStream>(shared_from_this());
+				} else if (header == DataChannelMagic) {
+					h = std::make_shared<MasterNodeDataChannel>(shared_from_this());
                 } else {
                     MSCThrow(InvalidOperationException(
                             str(format("Invalid header magic 0x%08x received.") % header)));
@@ -59,6 +59,7 @@ namespace mcore
         ~MasterNodeConnection();
 
         Master& master() const { return _master; }
+		boost::asio::io_service& ioService() const { return service; }
 		
 		// tired to add "nodes" to Master:)
 		std::shared_ptr<MasterNode> masterNode();
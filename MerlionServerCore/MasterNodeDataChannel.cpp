@@ -0,0 +1,88 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "MasterNodeDataChannel.hpp"
+#include "Master.hpp"
+#include "MasterClient.hpp"
+#include "Library.hpp"
+
+using boost::format;
+
+namespace mcore
+{
+	MasterNodeDataChannel::MasterNodeDataChannel(const MasterNodeConnection::ptr &connection):
+	connection(connection)
+	{
+		std::string channelName = str(format("Data Channel [%s]") % connection->tcpSocket().remote_endpoint());
+		log.setChannel(channelName);
+		connection->setChannelName(channelName);
+	}
+	
+	MasterNodeDataChannel::~MasterNodeDataChannel()
+	{
+		
+	}
+	
+	void MasterNodeDataChannel::service()
+	{
+		auto self = shared_from_this();
+		
+		// The channel refers to the connection's socket while keeping the connection alive.
+		std::shared_ptr<DataChannel::socketType> socket(connection, &connection->tcpSocket());
+		channel = std::make_shared<DataChannel>(connection->ioService(), socket);
+		channel->setChannelName(str(format("Data Channel [%s]") % socket->remote_endpoint()));
+		
+		channel->onStreamOpened.connect([this, self] (const DataChannelStream::ptr& stream) {
+			streamOpened(stream);
+		});
+		channel->onClosed.connect([this, self] {
+			connection->shutdown();
+		});
+		
+		BOOST_LOG_SEV(log, LogLevel::Info) << "Data channel established.";
+		
+		channel->start();
+	}
+	
+	void MasterNodeDataChannel::streamOpened(const DataChannelStream::ptr &stream)
+	{
+		auto clientId = stream->id();
+		auto req = connection->master().dequePendingClient(clientId);
+		
+		if (!req) {
+			BOOST_LOG_SEV(log, LogLevel::Debug) <<
+			format("Client %d was not found in the master pending client table.") % clientId;
+			stream->shutdown();
+			return;
+		}
+		
+		auto framing = req->response->client()->framing();
+		req->response->accept
+		([stream, framing] {
+			return makeMasterClientHandler(stream, framing);
+		}, [stream] {
+			stream->shutdown();
+		}, req->version);
+	}
+	
+	void MasterNodeDataChannel::connectionShutdown()
+	{
+		if (channel) {
+			channel->shutdown();
+		}
+	}
+}
@@ -27,13 +27,13 @@
 #include "Library.hpp"
 #include "NodeVersionManager.hpp"
 #include "NodeClientSocket.hpp"
+#include "NodeDataChannelPool.hpp"
 
 namespace asio = boost::asio;
 using boost::format;
 
 namespace mcore
 {
-	
 	NodeParameters::NodeParameters(MSCNodeParameters const &param)
 	{
 		if (param.nodeName == nullptr) {
@@ -148,6 +148,9 @@ namespace mcore
 				MSCThrow(InvalidOperationException("Reporting node failure failed."));
 			}
 		};
+		
+		if (param.numDataChannels)
+			numDataChannels = param.numDataChannels;
 	}
 	
 	class Node::DomainInstance:
@@ -196,12 +199,14 @@ namespace mcore
 		info.serverSoftwareName = MSC_VERSION_STRING;
 		
 		versionLoader = std::make_shared<NodeVersionLoader>(endpoint);
+		_dataChannels = std::make_shared<NodeDataChannelPool>(library, endpoint,
+															 parameters.numDataChannels);
 		
 		versionLoader->onNeedsDownloadFileName.connect([=](const std::string &version, std::string &path) {
 			path = _parameters.getPackageDownloadPathFunction(version);
 		});
 		
-		versionManager = std::make_shared<NodeVersionManager>(versionLoader);
+		versionManager = std::make_shared<NodeVersionManager>(versionLoader, library);
 		
 		versionManager->onStartDomain.connect([=](std::shared_ptr<NodeVersionManagerDomain> domain) {
 			auto version = domain->version();
@@ -214,28 +219,37 @@ namespace mcore
 				return;
 			}
 			
-			// (Actually we can do this in another thread...)
-			try {
-				_parameters.loadVersionFunction(version);
-			} catch (...) {
-				BOOST_LOG_SEV(log, LogLevel::Error) <<
-				format("Failed to start the domain of version '%s'.: ") %
-				version << boost::current_exception_diagnostic_information();
-				
-				domain->loadFailed();
-				return;
-			}
-			
-			_strand.post([=] {
-				auto ndom = std::make_shared<NodeDomain>(*this, version);
-				domains.emplace(version, ndom);
-				
-				std::shared_ptr<DomainInstance> inst
-				{ new DomainInstance(shared_from_this(), version) };
-				
-				domain->loaded(inst);
+			// Loading runs the application's code; keep it off the I/O threads.
+			auto self = shared_from_this();
+			_library->postCallback([this, self, domain, version] {
+				try {
+					_parameters.loadVersionFunction(version);
+				} catch (...) {
+					BOOST_LOG_SEV(log, LogLevel::Error) <<
+					format("Failed to start the domain of version '%s'.: ") %
+					version << boost::current_exception_diagnostic_information();
+					
+					domain->loadFailed();
+					return;
+				}
 				
-				ndom->setAcceptsClient(true);
+				_strand.post([this, self, domain, version] {
+					if (state == State::Disconnected) {
+						// Shut down while the version was being loaded.
+						_parameters.unloadVersionFunction(version);
+						return;
+					}
+					
+					auto ndom = std::make_shared<NodeDomain>(*this, version);
+					domains.emplace(version, ndom);
+					
+					std::shared_ptr<DomainInstance> inst
+					{ new DomainInstance(shared_from_this(), version) };
+					
+					domain->loaded(inst);
+					
+					ndom->setAcceptsClient(true);
+				});
 			});
 		});
 		
@@ -330,6 +344,9 @@ namespace mcore
 			versionLoader->shutdown();
 		versionLoader.reset();
 		
+		if (_dataChannels)
+			_dataChannels->shutdown();
+		
 		timeoutTimer.cancel();
 		reconnectTimer.cancel();
 		
@@ -494,21 +511,31 @@ namespace mcore
 						case NodeCommand::Nop:
 							break;
 						case NodeCommand::Connect:
+						case NodeCommand::ConnectEx:
 						{
 							auto clientId = reader.read<std::uint64_t>();
 							auto version = reader.readString();
 							auto room = reader.readString();
+							auto framing = ClientStreamFraming::WebSocket;
+							if (cmd == NodeCommand::ConnectEx) {
+								framing = reader.read<ClientStreamFraming>();
+							}
 							
 							BOOST_LOG_SEV(log, LogLevel::Debug) <<
 							format("Handling client %d. (Version = '%s')") % clientId % version;
 							
 							try {
+								if (framing != ClientStreamFraming::WebSocket &&
+									framing != ClientStreamFraming::Message) {
+									MSCThrow(InvalidDataException("Unknown client stream framing."));
+								}
+								
 								auto it = domains.find(version);
 								if (it == domains.end()) {
 									MSCThrow(InvalidOperationException
 											 (str(format("Version '%s' not found.") % version)));
 								}
-								auto client = std::make_shared<NodeClient>(it->second, clientId, room);
+								auto client = std::make_shared<NodeClient>(it->second, clientId, room, framing);
 								client->onConnectionRejected.connect([this](const NodeClient::ptr& client) {
 									sendRejectClient(client->clientId());
 								});
@@ -737,6 +764,37 @@ extern "C" MSCResult MSCNodeVersionUnloaded(MSCNode node, const char *version)
 	});
 }
 
+extern "C" MSCResult MSCNodeBindRoom(MSCNode node, const char *room,
+									 std::int32_t roomNameLen, const char *version)
+{
+	return mcore::convertExceptionsToResultCode([&] {
+		if (!node)
+			MSCThrow(mcore::InvalidArgumentException("node"));
+		if (room == nullptr || roomNameLen < 0) {
+			MSCThrow(mcore::InvalidArgumentException("room"));
+		}
+		if (version == nullptr) {
+			MSCThrow(mcore::InvalidArgumentException("version"));
+		}
+		auto n = *mcore::Node::fromHandle(node);
+		n->bindRoom(std::string(room, static_cast<std::size_t>(roomNameLen)), version);
+	});
+}
+
+extern "C" MSCResult MSCNodeUnbindRoom(MSCNode node, const char *room,
+									   std::int32_t roomNameLen)
+{
+	return mcore::convertExceptionsToResultCode([&] {
+		if (!node)
+			MSCThrow(mcore::InvalidArgumentException("node"));
+		if (room == nullptr || roomNameLen < 0) {
+			MSCThrow(mcore::InvalidArgumentException("room"));
+		}
+		auto n = *mcore::Node::fromHandle(node);
+		n->unbindRoom(std::string(room, static_cast<std::size_t>(roomNameLen)));
+	});
+}
+
 extern "C" MSCResult MSCNodeForwardLog(MSCNode node, const MSCLogEntry *entry)
 {
 	return mcore::convertExceptionsToResultCode([&] {
@@ -36,6 +36,7 @@ namespace mcore
 		std::function<void(std::uint64_t, const std::shared_ptr<NodeClientSocket>&)> setupClientFunction;
 		std::function<void(std::uint64_t)> destroyClientFunction;
 		std::function<void()> failureFunction;
+		std::size_t numDataChannels = 4;
 		
 		NodeParameters() = default;
 		NodeParameters(MSCNodeParameters const &param);
@@ -46,6 +47,7 @@ namespace mcore
 	class NodeClient;
 	class NodeVersionManager;
 	class NodeVersionLoader;
+	class NodeDataChannelPool;
 	
 	class Node: boost::noncopyable,
 	public std::enable_shared_from_this<Node>
@@ -82,6 +84,7 @@ namespace mcore
 		class DomainInstance;
 		std::shared_ptr<NodeVersionManager> versionManager;
 		std::shared_ptr<NodeVersionLoader> versionLoader;
+		std::shared_ptr<NodeDataChannelPool> _dataChannels;
 		
 		boost::asio::deadline_timer timeoutTimer;
 		boost::asio::deadline_timer reconnectTimer;
@@ -118,6 +121,8 @@ namespace mcore
 		const NodeParameters& parameters() const { return _parameters; }
 		const boost::asio::ip::tcp::endpoint& masterEndpoint() const
 		{ return endpoint; }
+		const std::shared_ptr<NodeDataChannelPool>& dataChannels() const
+		{ return _dataChannels; }
 		
 		void versionLoaded(const std::string&);
 		void versionUnloaded(const std::string&);
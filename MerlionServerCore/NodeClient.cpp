@@ -20,26 +20,24 @@
 #include "Node.hpp"
 #include "Library.hpp"
 #include "Exceptions.hpp"
-#include "AsyncPipe.hpp"
 #include "NodeClientSocket.hpp"
+#include "NodeDataChannelPool.hpp"
 
 using boost::format;
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
-using pipes = asio::local::stream_protocol;
 
 namespace mcore
 {
 	NodeClient::NodeClient(const std::shared_ptr<NodeDomain> &domain,
 						   std::uint64_t clientId,
-						   const std::string& room):
+						   const std::string& room,
+						   ClientStreamFraming framing):
 	domain(domain),
 	_clientId(clientId),
 	state(State::NotAccepted),
 	room(room),
-	masterSocket(domain->node().library()->ioService()),
-	appSocket(domain->node().library()->ioService()),
-	pipe {0, 0},
+	framing(framing),
 	_strand {domain->node().library()->ioService()},
 	closed {false},
 	library {domain->node().library()},
@@ -73,7 +71,7 @@ namespace mcore
 		auto lib = node.library();
 		assert(lib != nullptr);
 		
-		lib->ioService().post([this, createFunc, destroyFunc, dom, self]() {
+		lib->postCallback([this, createFunc, destroyFunc, dom, self]() {
 			
 			BOOST_LOG_SEV(log, LogLevel::Debug) << "Dispatching the application to accept the client.";
 			
@@ -144,58 +142,37 @@ namespace mcore
 		
 		state = State::ConnectingToMaster;
 		
-		BOOST_LOG_SEV(log, LogLevel::Debug) << "Connecting to the master server.";
+		BOOST_LOG_SEV(log, LogLevel::Debug) << "Opening a stream to the master server.";
 		
 		Node& node = dom->node();
 		const auto& param = node.parameters();
 		auto setupFunc = param.setupClientFunction;
 		auto destroyFunc = param.destroyClientFunction;
-		auto endpoint = node.masterEndpoint();
 		
-		masterSocket.async_connect(endpoint, _strand.wrap([this, self, setupFunc, destroyFunc, dom](const boost::system::error_code& error) {
+		node.dataChannels()->openStream(_clientId, _strand.wrap([this, self, setupFunc, destroyFunc, dom]
+		(const boost::system::error_code& error, const std::shared_ptr<DataChannelStream>& stream) {
 			
 			try {
+				if (state == State::Closed) {
+					BOOST_LOG_SEV(log, LogLevel::Debug) << "Opening the stream was cancelled.";
+					if (stream) stream->shutdown();
+					MSCThrow(boost::system::system_error(asio::error::operation_aborted));
+				}
+				
 				if (error) {
 					MSCThrow(boost::system::system_error(error));
 				}
 				
-				BOOST_LOG_SEV(log, LogLevel::Debug) << "Connected to the master server.";
+				BOOST_LOG_SEV(log, LogLevel::Debug) << "Stream to the master server was opened.";
 				
-				asio::write(masterSocket, asio::buffer(&DataStreamMagic, 4));
-				asio::write(masterSocket, asio::buffer(&_clientId, 8));
-				
-				if (state == State::Closed) {
-					BOOST_LOG_SEV(log, LogLevel::Debug) << "...but cancelled.";
-					masterSocket.shutdown(ip::tcp::socket::shutdown_both);
-					masterSocket.close();
-					try {
-						destroyFunc(clientId());
-					} catch (...) {
-						// Very problematic...
-						BOOST_LOG_SEV(log, LogLevel::Error)
-						<< format("ROLLBACK FAILURE: Failed to destroying a client handler after being disconnected.")
-						<< boost::current_exception_diagnostic_information();
-					}
-					
-					state = State::Closed;
-					return;
-				}
+				masterStream = stream;
 				
 				assert(state == State::ConnectingToMaster);
 				
 				state = State::SettingUpApplication;
 				
-				BOOST_LOG_SEV(log, LogLevel::Debug) << "Creating UNIX pipes.";
-				
-				if (socketpair(AF_UNIX, SOCK_STREAM, 0, pipe))
-					throw SystemErrorException(str(format("Error while creating pipe.: %d") % errno));
-				
-				appSocket.assign(pipes(), pipe[0]);
-				pipe[0] = 0; // ownership moved
-				
 				// Create client socket
-				auto csock = std::make_shared<NodeClientSocket>(library, displayName, pipe[1]);
-				pipe[1] = 0; // ownership moved
+				auto csock = std::make_shared<NodeClientSocket>(library, displayName, masterStream, framing);
 				setupFunc(clientId(), csock);
 				
 				state = State::Servicing;
@@ -207,8 +184,7 @@ namespace mcore
 					BOOST_LOG_SEV(log, LogLevel::Error) << "Failed to setup a client handler.: " <<
 					boost::current_exception_diagnostic_information();
 					
-					try { masterSocket.shutdown(ip::tcp::socket::shutdown_both); } catch (...) { }
-					masterSocket.close();
+					masterStream->shutdown();
 					
 				} else {
 					BOOST_LOG_SEV(log, LogLevel::Error) << "Failed to establish a connection.: " <<
@@ -216,11 +192,6 @@ namespace mcore
 					onConnectionRejected(self);
 				}
 				
-				if (pipe[0]) close(pipe[0]);
-				if (pipe[1]) close(pipe[1]);
-				
-				if (appSocket.is_open()) appSocket.close();
-				
 				try {
 					destroyFunc(clientId());
 				} catch (...) {
@@ -243,9 +214,8 @@ namespace mcore
 		auto self = shared_from_this();
 		assert(state == State::ConnectingToMaster);
 		
+		// Handled when the stream was opened.
 		state = State::Closed;
-		try { masterSocket.close(); } catch (...) { }
-		masterSocket.cancel();
 	}
 	
 	void NodeClient::startService()
@@ -255,45 +225,27 @@ namespace mcore
 		
 		BOOST_LOG_SEV(log, LogLevel::Debug) << "Starting service.";
 		
-		startAsyncPipe(masterSocket, appSocket, 8192, _strand.wrap([this, self](const boost::system::error_code& error, std::uint64_t) {
-			if (error) {
-				BOOST_LOG_SEV(log, LogLevel::Debug) << "Downstream stream error.: " << error;
-				terminateService();
-			} else {
-				try { appSocket.close(); } catch(...) { }
-				socketDown();
-			}
-		}));
-		startAsyncPipe(appSocket, masterSocket, 8192, _strand.wrap([this, self](const boost::system::error_code& error, std::uint64_t) {
-			if (error) {
-				BOOST_LOG_SEV(log, LogLevel::Debug) << "Upstream stream error.: " << error;
-				terminateService();
-			} else {
-				try { appSocket.close(); } catch(...) { }
-				socketDown();
+		// NodeClientSocket talks to the master through the stream directly;
+		// we only have to know when it goes away.
+		masterStream->waitClosed(_strand.wrap([this, self] {
+			BOOST_LOG_SEV(log, LogLevel::Debug) << "Stream closed.";
+			if (state == State::Servicing) {
+				state = State::Closed;
+				closed.store(true);
+				onClosed(self);
 			}
 		}));
-		
-	}
-	
-	void NodeClient::socketDown()
-	{
-		auto self = shared_from_this();
-		if (!appSocket.is_open()) {
-			BOOST_LOG_SEV(log, LogLevel::Debug) << "Pipe closed.";
-			terminateService();
-		}
 	}
 	
 	void NodeClient::terminateService()
 	{
 		auto self = shared_from_this();
-		//assert(state == State::Servicing);
 		
-		if (appSocket.is_open()) appSocket.close();
+		if (state == State::Closed)
+			return;
+		state = State::Closed;
 		
-		try { masterSocket.shutdown(ip::tcp::socket::shutdown_both); } catch (...) { }
-		try { masterSocket.close(); } catch(...) { }
+		if (masterStream) masterStream->shutdown();
 		
 		closed.store(true);
 		onClosed(self);
@@ -18,11 +18,13 @@
 
 #include <atomic>
 #include "Logging.hpp"
+#include "Protocol.hpp"
 
 namespace mcore
 {
 	class NodeDomain;
 	class Library;
+	class DataChannelStream;
 	
 	class NodeClient :
 	public std::enable_shared_from_this<NodeClient>,
@@ -47,13 +49,10 @@ namespace mcore
 		std::atomic<bool> closed;
 		boost::asio::strand _strand;
 		std::string const room;
+		ClientStreamFraming const framing;
 		std::string const displayName;
 		
-		boost::asio::ip::tcp::socket masterSocket;
-		int pipe[2];
-		
-		boost::asio::local::stream_protocol::socket appSocket;
-		void socketDown();
+		std::shared_ptr<DataChannelStream> masterStream;
 		
 		void connectToMaster();
 		void cancelConnectToMaster();
@@ -65,7 +64,8 @@ namespace mcore
 		using ptr = std::shared_ptr<NodeClient>;
 		NodeClient(const std::shared_ptr<NodeDomain> &domain,
 				   std::uint64_t clientId,
-				   const std::string& room);
+				   const std::string& room,
+				   ClientStreamFraming framing);
 		~NodeClient();
 		
 		std::uint64_t clientId() const { return _clientId; }
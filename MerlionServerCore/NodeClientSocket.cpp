@@ -21,19 +21,103 @@
 using boost::format;
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
-using pipes = asio::local::stream_protocol;
 
 namespace mcore
 {
+	NodeClientMessage::NodeClientMessage(const void *data, std::size_t length)
+	{
+		asio::const_buffer message(data, length);
+		encode(&message, 1);
+	}
+	
+	NodeClientMessage::NodeClientMessage(const asio::const_buffer *messages, std::size_t count)
+	{
+		encode(messages, count);
+	}
+	
+	void NodeClientMessage::encode(const asio::const_buffer *messages, std::size_t count)
+	{
+		// Servers never mask frames.
+		auto hdr = asiows::web_socket_message_header().frame_header();
+		hdr.fin = true;
+		
+		std::size_t totalSize = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			auto length = asio::buffer_size(messages[i]);
+			if (length > ClientMessageMaxLength) {
+				// Too long. (limitation of Merlion, not WebSocket)
+				MSCThrow(InvalidArgumentException("Packet cannot be longer than 65536 bytes.", "length"));
+			}
+			hdr.payload_length = length;
+			totalSize += asiows::web_socket_frame_header_size(hdr) + length;
+		}
+		
+		frames.resize(totalSize);
+		lengthPrefixes.resize(count);
+		lengthPrefixedBuffers.reserve(count * 2);
+		
+		char *out = frames.data();
+		for (std::size_t i = 0; i < count; ++i) {
+			auto length = asio::buffer_size(messages[i]);
+			hdr.payload_length = length;
+			out += asiows::encode_web_socket_frame_header(hdr, out);
+			std::memcpy(out, asio::buffer_cast<const void *>(messages[i]), length);
+			
+			encodeClientMessageHeader(lengthPrefixes[i].data(), static_cast<std::uint32_t>(length));
+			lengthPrefixedBuffers.push_back(asio::buffer(lengthPrefixes[i]));
+			lengthPrefixedBuffers.push_back(asio::buffer(out, length));
+			
+			out += length;
+		}
+		assert(out == frames.data() + totalSize);
+		
+		webSocketBuffers.push_back(asio::buffer(frames.data(), frames.size()));
+	}
+	
+	std::shared_ptr<const NodeClientMessage>
+	NodeClientMessage::makeChunks(const void *data, std::size_t length, bool last)
+	{
+		std::vector<asio::const_buffer> chunks;
+		const char *p = static_cast<const char *>(data);
+		do {
+			auto chunkLength = std::min(length, ClientMessageMaxLength);
+			chunks.emplace_back(p, chunkLength);
+			p += chunkLength;
+			length -= chunkLength;
+		} while (length > 0);
+		
+		auto message = std::make_shared<NodeClientMessage>(chunks.data(), chunks.size());
+		for (std::size_t i = 0; i < chunks.size(); ++i) {
+			if (!last || i + 1 < chunks.size()) {
+				auto& prefix = message->lengthPrefixes[i];
+				encodeClientMessageHeader(prefix.data(), decodeClientMessageHeader(prefix.data()) |
+										  ClientMessageContinuedFlag);
+			}
+		}
+		return message;
+	}
+	
+	const std::vector<asio::const_buffer>& NodeClientMessage::buffers(ClientStreamFraming framing) const
+	{
+		switch (framing) {
+			case ClientStreamFraming::Message:
+				return lengthPrefixedBuffers;
+			default:
+				return webSocketBuffers;
+		}
+	}
+	
 	NodeClientSocket::NodeClientSocket(std::shared_ptr<Library> library,
-									   const std::string& displayName, int stream) :
+									   const std::string& displayName,
+									   const std::shared_ptr<DataChannelStream>& transport,
+									   ClientStreamFraming framing) :
 	library(library),
-	socket(library->ioService()),
-	_strand(library->ioService()),
-	webSocket(socket)
+	transport(transport),
+	framing(framing),
+	_strand(transport->ioService()),
+	webSocket(*transport)
 	{
 		log.setChannel(displayName);
-		socket.assign(pipes(), stream);
 	}
 	NodeClientSocket::~NodeClientSocket()
 	{
@@ -62,10 +146,15 @@ namespace mcore
 					}
 				}
 				
+				if (framing == ClientStreamFraming::Message) {
+					// The master performs the closing handshake.
+					transport->shutdown();
+					return;
+				}
+				
 				webSocket.async_shutdown(asiows::web_socket_close_status_codes::normal_closure, "", false,
 										 _strand.wrap([self, this] (const boost::system::error_code &) {
-					boost::system::error_code error;
-					socket.close(error);
+					transport->shutdown();
 				}));
 				
 			} catch (...) {
@@ -78,115 +167,207 @@ namespace mcore
 	}
 	
 	template <class Callback>
-	void NodeClientSocket::receive(Callback &&cb)
+	class NodeClientSocket::ReceiveOperation
 	{
-		struct ReceiveOperation
+	public:
+		enum class State
 		{
-			enum class State
-			{
-				ReceiveMessage,
-				ReadMessage
-			};
-			State state = State::ReceiveMessage;
-			std::shared_ptr<NodeClientSocket> socket;
-			typename std::remove_reference<Callback>::type callback;
-			decltype(shutdownListeners)::iterator shutdownListenersIter;
-			
-			ReceiveOperation(const std::shared_ptr<NodeClientSocket> &socket,
-					   Callback &&cb) :
-			socket(socket),
-			callback(cb)
-			{ }
-			
-			bool done()
-			{
-				socket->receiving_ = false;
-				if (!socket->shutdownListeners.empty()) {
-					socket->shutdownListeners.erase(shutdownListenersIter);
-					return true;
-				} else {
-					return false;
-				}
-			}
+			ReceiveMessage,
+			ReadMessage,
 			
-			void operator () (const boost::system::error_code& error, std::size_t count = 0)
-			{
-				switch (state) {
-					case State::ReceiveMessage:
-						if (error) {
-							socket->receiveBuffer.resize(0);
-							if(done())
-								callback(socket->receiveBuffer, error.message());
-						} else {
-							state = State::ReadMessage;
-							perform();
+			// ClientStreamFraming::Message
+			ReadLength,
+			ReadPayload
+		};
+		State state = State::ReceiveMessage;
+		std::shared_ptr<NodeClientSocket> socket;
+		typename std::remove_reference<Callback>::type callback;
+		decltype(shutdownListeners)::iterator shutdownListenersIter;
+		
+		// Started by <receiveNext>. The shutdown listener is registered
+		// by <startReceiving> once for the entire subscription.
+		bool persistent;
+		
+		ReceiveOperation(const std::shared_ptr<NodeClientSocket> &socket,
+				   Callback &&cb, bool persistent = false) :
+		socket(socket),
+		callback(cb),
+		persistent(persistent)
+		{ }
+		
+		bool done()
+		{
+			socket->receiving_ = false;
+			if (persistent) {
+				return static_cast<bool>(socket->receiveHandler);
+			} else if (!socket->shutdownListeners.empty()) {
+				socket->shutdownListeners.erase(shutdownListenersIter);
+				return true;
+			} else {
+				return false;
+			}
+		}
+		
+		void operator () (const boost::system::error_code& error, std::size_t count = 0)
+		{
+			switch (state) {
+				case State::ReceiveMessage:
+					if (error) {
+						socket->receiveBuffer.reset();
+						if(done())
+							callback(socket->receiveBuffer, error.message());
+					} else {
+						state = State::ReadMessage;
+						perform();
+					}
+					break;
+				case State::ReadMessage:
+					if (error) {
+						socket->receiveBuffer.reset();
+						if(done())
+							callback(socket->receiveBuffer, error.message());
+					} else if (count == 0) {
+						// The buffer goes back to the pool once the callback returns.
+						auto buffer = std::move(socket->receiveBuffer);
+						buffer.resize(socket->receiveBufferLen);
+						
+						try {
+							if (done())
+								callback(buffer, std::string());
+						} catch (...) {
+							BOOST_LOG_SEV(socket->log, LogLevel::Error)
+							<< "Error occured in packet receive handler.: "
+							<< boost::current_exception_diagnostic_information();
 						}
-						break;
-					case State::ReadMessage:
-						if (error) {
-							socket->receiveBuffer.resize(0);
-							if(done())
-								callback(socket->receiveBuffer, error.message());
-						} else if (count == 0) {
-							socket->receiveBuffer.resize(socket->receiveBufferLen);
-							
-							try {
-								if (done())
-									callback(socket->receiveBuffer, std::string());
-							} catch (...) {
-								BOOST_LOG_SEV(socket->log, LogLevel::Error)
-								<< "Error occured in packet receive handler.: "
-								<< boost::current_exception_diagnostic_information();
-							}
+					} else {
+						socket->receiveBufferLen += count;
+						
+						if (socket->receiveBufferLen > ClientMessageMaxLength) {
+							// Too long.
+							socket->receiveBuffer.reset();
+							auto self = socket;
+							socket->webSocket.async_shutdown(asiows::web_socket_close_status_codes::too_big,
+															 "Packet size is limited to 65536 bytes.", true,
+															 socket->_strand.wrap([self](const boost::system::error_code&){}));
+							if (done())
+								callback(socket->receiveBuffer, "Received packet is too long.");
+							return;
+						}
+						
+						perform();
+					}
+					break;
+				case State::ReadLength:
+					if (error) {
+						socket->receiveBuffer.reset();
+						if(done())
+							callback(socket->receiveBuffer, error.message());
+					} else {
+						auto header = decodeClientMessageHeader(socket->receiveHeader.data());
+						socket->receiveChunkLen = header & ~ClientMessageContinuedFlag;
+						socket->receiveChunkContinued = (header & ClientMessageContinuedFlag) != 0;
+						
+						auto length = socket->receiveBufferLen + socket->receiveChunkLen;
+						if (length > ClientMessageMaxLength) {
+							// Too long. Such messages can only be received by
+							// <beginReceiveMessage>.
+							socket->receiveBuffer.reset();
+							socket->transport->shutdown();
+							if (done())
+								callback(socket->receiveBuffer, "Received packet is too long.");
+							return;
+						}
+						
+						if (!socket->receiveBuffer.data()) {
+							socket->receiveBuffer = socket->library->bufferPool().allocate(length);
 						} else {
-							socket->receiveBufferLen += count;
-							
-							if (socket->receiveBufferLen > 65536) {
-								// Too long.
-								socket->receiveBuffer.resize(0);
-								auto self = socket;
-								socket->webSocket.async_shutdown(asiows::web_socket_close_status_codes::too_big,
-																 "Packet size is limited to 65536 bytes.", true,
-																 socket->_strand.wrap([self](const boost::system::error_code&){}));
-								if (done())
-									callback(socket->receiveBuffer, "Received packet is too long.");
-								return;
-							}
-							
-							socket->receiveBuffer.resize(socket->receiveBufferLen);
-							perform();
+							socket->receiveBuffer.resize(length);
 						}
-						break;
-				}
-			}
-			
-			void perform()
-			{
-				switch (state) {
-					case State::ReceiveMessage:
-						{
-							auto cb = callback;
-							socket->shutdownListeners.emplace_front([cb] {
-								vslim::vector_slim<char> dummyBuffer;
-								cb(dummyBuffer, "Socket is disconnected.");
-							});
+						state = State::ReadPayload;
+						perform();
+					}
+					break;
+				case State::ReadPayload:
+					if (error) {
+						socket->receiveBuffer.reset();
+						if(done())
+							callback(socket->receiveBuffer, error.message());
+					} else if (socket->receiveChunkContinued) {
+						socket->receiveBufferLen += socket->receiveChunkLen;
+						state = State::ReadLength;
+						perform();
+					} else {
+						// The buffer goes back to the pool once the callback returns.
+						auto buffer = std::move(socket->receiveBuffer);
+						
+						try {
+							if (done())
+								callback(buffer, std::string());
+						} catch (...) {
+							BOOST_LOG_SEV(socket->log, LogLevel::Error)
+							<< "Error occured in packet receive handler.: "
+							<< boost::current_exception_diagnostic_information();
 						}
-						shutdownListenersIter = socket->shutdownListeners.begin();
-						socket->webSocket.async_receive_message(socket->_strand.wrap(std::move(*this)));
-						break;
-					case State::ReadMessage:
-						socket->receiveBuffer.resize(socket->receiveBufferLen + 4096);
-						socket->webSocket.async_read_some(asio::buffer(socket->receiveBuffer.data() + socket->receiveBufferLen,
-																	   4096), socket->_strand.wrap(std::move(*this)));
-						break;
-				}
+					}
+					break;
 			}
-		};
+		}
 		
+		void perform()
+		{
+			// `*this` (and therefore `socket`) is moved into the handler,
+			// so don't access `socket` in the same expression.
+			auto& s = *socket;
+			switch (state) {
+				case State::ReceiveMessage:
+					if (!persistent) {
+						auto cb = callback;
+						socket->shutdownListeners.emplace_front([cb] {
+							BufferPool::Buffer dummyBuffer;
+							cb(dummyBuffer, "Socket is disconnected.");
+						});
+						shutdownListenersIter = socket->shutdownListeners.begin();
+					}
+					if (s.framing == ClientStreamFraming::Message) {
+						state = State::ReadLength;
+						perform();
+					} else {
+						s.webSocket.async_receive_message(s._strand.wrap(std::move(*this)));
+					}
+					break;
+				case State::ReadMessage:
+					// The buffer is allocated only after a message has arrived,
+					// so idle sockets don't hold one.
+					if (!s.receiveBuffer.data()) {
+						s.receiveBuffer = s.library->bufferPool().allocate(BufferPool::MinBufferSize);
+					} else if (s.receiveBufferLen == s.receiveBuffer.capacity()) {
+						s.receiveBuffer.resize(s.receiveBufferLen + 1);
+					}
+					s.receiveBuffer.resize(s.receiveBuffer.capacity());
+					s.webSocket.async_read_some(asio::buffer(s.receiveBuffer.data() + s.receiveBufferLen,
+															 s.receiveBuffer.size() - s.receiveBufferLen),
+												s._strand.wrap(std::move(*this)));
+					break;
+				case State::ReadLength:
+					asio::async_read(*s.transport, asio::buffer(s.receiveHeader),
+									 s._strand.wrap(std::move(*this)));
+					break;
+				case State::ReadPayload:
+					asio::async_read(*s.transport, asio::buffer(s.receiveBuffer.data() + s.receiveBufferLen,
+																s.receiveChunkLen),
+									 s._strand.wrap(std::move(*this)));
+					break;
+			}
+		}
+	};
+	
+	template <class Callback>
+	void NodeClientSocket::receive(Callback &&cb)
+	{
 		auto self = shared_from_this();
 		
 		_strand.dispatch([self, this, cb] () mutable {
-			if (receiving_) {
+			if (receiving_ || receiveHandler || readingMessage_) {
 				cb(receiveBuffer, std::string("Cannot perform multiple reads at once."));
 				return;
 			} else if (down_) {
@@ -197,28 +378,113 @@ namespace mcore
 			receiving_ = true;
 			
 			receiveBufferLen = 0;
-			receiveBuffer.resize(0);
+			receiveBuffer.reset();
 			
-			ReceiveOperation op(shared_from_this(), std::move(cb));
+			ReceiveOperation<typename std::remove_reference<Callback>::type> op(shared_from_this(), std::move(cb));
 			op.perform();
 		});
 		
 	}
 	
+	void NodeClientSocket::startReceiving(ReceiveHandler &&handler, std::uint32_t credit)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, handler, credit] () mutable {
+			if (receiving_ || receiveHandler || readingMessage_) {
+				handler(receiveBuffer, std::string("Cannot perform multiple reads at once."));
+				return;
+			} else if (down_) {
+				handler(receiveBuffer, std::string("Socket is disconnected."));
+				return;
+			}
+			
+			receiveHandler = std::move(handler);
+			receiveCredit = credit;
+			
+			shutdownListeners.emplace_front([this] {
+				auto handler = std::move(receiveHandler);
+				receiveHandler = nullptr;
+				
+				BufferPool::Buffer dummyBuffer;
+				handler(dummyBuffer, "Socket is disconnected.");
+			});
+			receiveHandlerListener = shutdownListeners.begin();
+			
+			receiveNext();
+		});
+	}
+	
+	void NodeClientSocket::grantReceiveCredit(std::uint32_t credit)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, credit] {
+			receiveCredit += credit;
+			receiveNext();
+		});
+	}
+	
+	void NodeClientSocket::receiveNext()
+	{
+		if (!receiveHandler || receiving_ || receiveCredit == 0) {
+			return;
+		}
+		
+		--receiveCredit;
+		receiving_ = true;
+		
+		receiveBufferLen = 0;
+		receiveBuffer.reset();
+		
+		auto self = shared_from_this();
+		auto cb = [self, this] (const mcore::BufferPool::Buffer& buffer, const std::string& error) {
+			if (!error.empty()) {
+				// The subscription ends with the error.
+				shutdownListeners.erase(receiveHandlerListener);
+				auto handler = std::move(receiveHandler);
+				receiveHandler = nullptr;
+				handler(buffer, error);
+				return;
+			}
+			
+			try {
+				receiveHandler(buffer, error);
+			} catch (...) {
+				BOOST_LOG_SEV(log, LogLevel::Error)
+				<< "Error occured in packet receive handler.: "
+				<< boost::current_exception_diagnostic_information();
+			}
+			
+			receiveNext();
+		};
+		ReceiveOperation<decltype(cb)> op(self, std::move(cb), true);
+		op.perform();
+	}
+	
 	template <class Callback>
 	void NodeClientSocket::send(const void *data, std::size_t length,
 								Callback &&cb)
 	{
-		if (length > 65536) {
-			// Too long. (limitation of Merlion, not WebSocket)
-			MSCThrow(InvalidArgumentException("Packet cannot be longer than 65536 bytes.", "length"));
-		}
-		
+		send(std::make_shared<const NodeClientMessage>(data, length),
+			 std::forward<Callback>(cb));
+	}
+	
+	template <class Callback>
+	void NodeClientSocket::send(const asio::const_buffer *messages, std::size_t count,
+								Callback &&cb)
+	{
+		send(std::make_shared<const NodeClientMessage>(messages, count),
+			 std::forward<Callback>(cb));
+	}
+	
+	template <class Callback>
+	void NodeClientSocket::send(const std::shared_ptr<const NodeClientMessage> &message,
+								Callback &&cb)
+	{
 		auto self = shared_from_this();
-		auto buffer = std::make_shared<vslim::vector_slim<char>>(length);
-		std::memcpy(buffer->data(), data, length);
 		
-		_strand.dispatch([self, buffer, cb, this] () mutable {
+		_strand.dispatch([self, message, cb, this] () mutable {
 			if (down_) {
 				cb(std::string("Socket is disconnected."));
 				return;
@@ -231,9 +497,7 @@ namespace mcore
 			}
 			auto it = shutdownListeners.begin();
 			
-			asiows::web_socket_message_header header;
-			webSocket.async_send_message(header, asio::buffer(buffer->data(), buffer->size()),
-										 _strand.wrap([self, buffer, cb, this, it] (const boost::system::error_code& error) {
+			auto completion = [self, message, cb, this, it] (const boost::system::error_code& error) {
 				
 				if (!shutdownListeners.empty()) {
 					shutdownListeners.erase(it);
@@ -250,6 +514,361 @@ namespace mcore
 					}
 				}
 				
+			};
+			
+			if (framing == ClientStreamFraming::Message) {
+				enqueueMessage(message, std::move(completion));
+			} else {
+				webSocket.async_send_encoded_message(message->buffers(framing),
+													 _strand.wrap(std::move(completion)));
+			}
+		});
+	}
+	
+	void NodeClientSocket::enqueueMessage(const std::shared_ptr<const NodeClientMessage> &message,
+										  SendCompletion &&completion)
+	{
+		if (writingMessage_) {
+			heldMessages.emplace_back(message, std::move(completion));
+			return;
+		}
+		sendQueue.emplace_back(message, std::move(completion));
+		if (!sending_) {
+			flushSendQueue();
+		}
+	}
+	
+	void NodeClientSocket::flushSendQueue()
+	{
+		if (sendQueue.empty()) {
+			sending_ = false;
+			return;
+		}
+		sending_ = true;
+		
+		auto self = shared_from_this();
+		const auto& message = sendQueue.front().first;
+		asio::async_write(*transport, message->buffers(framing),
+						  _strand.wrap([self, this] (const boost::system::error_code& error, std::size_t) {
+			auto completion = std::move(sendQueue.front().second);
+			sendQueue.pop_front();
+			completion(error);
+			flushSendQueue();
+		}));
+	}
+
+	auto NodeClientSocket::guardStreamOperation(StreamCompletion &&cb) -> StreamCompletion
+	{
+		shutdownListeners.emplace_front([cb] {
+			cb("Socket is disconnected.");
+		});
+		auto it = shutdownListeners.begin();
+		
+		auto self = shared_from_this();
+		return [self, this, cb, it] (const std::string& error) {
+			if (shutdownListeners.empty()) {
+				// Already reported by the shutdown listener.
+				return;
+			}
+			shutdownListeners.erase(it);
+			try {
+				cb(error);
+			} catch (...) {
+				BOOST_LOG_SEV(log, LogLevel::Error)
+				<< "Error occured in message stream completion handler.: "
+				<< boost::current_exception_diagnostic_information();
+			}
+		};
+	}
+	
+	void NodeClientSocket::beginReceiveMessage(StreamCompletion &&cb)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, cb] () mutable {
+			if (receiving_ || receiveHandler || readingMessage_) {
+				cb(std::string("Cannot perform multiple reads at once."));
+				return;
+			} else if (down_) {
+				cb(std::string("Socket is disconnected."));
+				return;
+			}
+			
+			receiving_ = true;
+			auto completion = guardStreamOperation(std::move(cb));
+			auto done = [self, this, completion] (const boost::system::error_code& error) {
+				receiving_ = false;
+				if (error) {
+					completion(error.message());
+				} else {
+					readingMessage_ = true;
+					completion(std::string());
+				}
+			};
+			
+			if (framing == ClientStreamFraming::Message) {
+				asio::async_read(*transport, asio::buffer(receiveHeader),
+								 _strand.wrap([this, done] (const boost::system::error_code& error, std::size_t) {
+					if (!error) {
+						auto header = decodeClientMessageHeader(receiveHeader.data());
+						receiveChunkLen = header & ~ClientMessageContinuedFlag;
+						receiveChunkContinued = (header & ClientMessageContinuedFlag) != 0;
+					}
+					done(error);
+				}));
+			} else {
+				webSocket.async_receive_message(_strand.wrap(std::move(done)));
+			}
+		});
+	}
+	
+	void NodeClientSocket::readMessage(std::size_t maxLength, ReceiveHandler &&handler)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, maxLength, handler] () mutable {
+			if (!readingMessage_ || receiving_) {
+				handler(receiveBuffer, std::string("No message is being received, or a read is in progress."));
+				return;
+			} else if (down_) {
+				handler(receiveBuffer, std::string("Socket is disconnected."));
+				return;
+			} else if (maxLength == 0) {
+				handler(receiveBuffer, std::string("Read length must not be zero."));
+				return;
+			}
+			
+			receiving_ = true;
+			readMessageChunk(maxLength, std::move(handler));
+		});
+	}
+	
+	void NodeClientSocket::readMessageChunk(std::size_t maxLength, ReceiveHandler &&handler)
+	{
+		auto self = shared_from_this();
+		
+		if (framing == ClientStreamFraming::Message &&
+			receiveChunkLen == 0 && receiveChunkContinued) {
+			// Proceed to the next chunk.
+			asio::async_read(*transport, asio::buffer(receiveHeader),
+							 _strand.wrap([self, this, maxLength, handler] (const boost::system::error_code& error, std::size_t) mutable {
+				if (error) {
+					receiving_ = false;
+					readingMessage_ = false;
+					BufferPool::Buffer dummyBuffer;
+					handler(dummyBuffer, error.message());
+					return;
+				}
+				auto header = decodeClientMessageHeader(receiveHeader.data());
+				receiveChunkLen = header & ~ClientMessageContinuedFlag;
+				receiveChunkContinued = (header & ClientMessageContinuedFlag) != 0;
+				readMessageChunk(maxLength, std::move(handler));
+			}));
+			return;
+		}
+		
+		shutdownListeners.emplace_front([handler] {
+			BufferPool::Buffer dummyBuffer;
+			handler(dummyBuffer, "Socket is disconnected.");
+		});
+		auto it = shutdownListeners.begin();
+		
+		auto buffer = std::make_shared<BufferPool::Buffer>
+		(library->bufferPool().allocate(std::min(maxLength, ClientMessageMaxLength)));
+		
+		auto done = [self, this, handler, it, buffer] (const boost::system::error_code& error, std::size_t count) {
+			if (shutdownListeners.empty()) {
+				return;
+			}
+			shutdownListeners.erase(it);
+			receiving_ = false;
+			
+			if (error) {
+				readingMessage_ = false;
+				buffer->reset();
+				handler(*buffer, error.message());
+				return;
+			}
+			
+			if (count == 0) {
+				// End of message.
+				readingMessage_ = false;
+			}
+			buffer->resize(count);
+			try {
+				handler(*buffer, std::string());
+			} catch (...) {
+				BOOST_LOG_SEV(log, LogLevel::Error)
+				<< "Error occured in packet receive handler.: "
+				<< boost::current_exception_diagnostic_information();
+			}
+		};
+		
+		if (framing != ClientStreamFraming::Message) {
+			webSocket.async_read_some(asio::buffer(buffer->data(), buffer->size()),
+									  _strand.wrap(std::move(done)));
+		} else if (receiveChunkLen > 0) {
+			auto readSize = std::min<std::size_t>(buffer->size(), receiveChunkLen);
+			transport->async_read_some(asio::buffer(buffer->data(), readSize),
+									   _strand.wrap([this, done] (const boost::system::error_code& error, std::size_t count) {
+				if (!error && count == 0) {
+					// The transport never returns zero bytes unless it failed.
+					done(asio::error::eof, 0);
+					return;
+				}
+				receiveChunkLen -= static_cast<std::uint32_t>(count);
+				done(error, count);
+			}));
+		} else {
+			_strand.post(std::bind(done, boost::system::error_code(), 0));
+		}
+	}
+	
+	void NodeClientSocket::beginSendMessage(StreamCompletion &&cb)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, cb] () mutable {
+			if (writingMessage_) {
+				cb(std::string("Cannot send multiple streamed messages at once."));
+				return;
+			} else if (down_) {
+				cb(std::string("Socket is disconnected."));
+				return;
+			}
+			
+			writingMessage_ = true;
+			
+			if (framing == ClientStreamFraming::Message) {
+				// Chunks are queued like other messages.
+				cb(std::string());
+				return;
+			}
+			
+			auto completion = guardStreamOperation(std::move(cb));
+			asiows::web_socket_message_header header;
+			streamWritePending_ = true;
+			webSocket.async_begin_write(header, _strand.wrap([this, completion] (const boost::system::error_code& error) {
+				streamWritePending_ = false;
+				if (error) {
+					writingMessage_ = false;
+					completion(error.message());
+				} else {
+					completion(std::string());
+				}
+			}));
+		});
+	}
+	
+	void NodeClientSocket::writeMessage(const void *data, std::size_t length, StreamCompletion &&cb)
+	{
+		auto self = shared_from_this();
+		
+		// The caller's buffer doesn't have to outlive this call.
+		if (framing == ClientStreamFraming::Message) {
+			auto chunks = length > 0 ? NodeClientMessage::makeChunks(data, length, false) : nullptr;
+			_strand.dispatch([self, this, chunks, cb] () mutable {
+				if (!writingMessage_ || streamWritePending_) {
+					cb(std::string("No message is being sent, or a write is in progress."));
+					return;
+				} else if (down_) {
+					cb(std::string("Socket is disconnected."));
+					return;
+				} else if (!chunks) {
+					cb(std::string());
+					return;
+				}
+				
+				auto completion = guardStreamOperation(std::move(cb));
+				streamWritePending_ = true;
+				sendQueue.emplace_back(chunks, [this, completion] (const boost::system::error_code& error) {
+					streamWritePending_ = false;
+					completion(error ? error.message() : std::string());
+				});
+				if (!sending_) {
+					flushSendQueue();
+				}
+			});
+			return;
+		}
+		
+		auto buffer = std::make_shared<std::vector<char>>
+		(static_cast<const char *>(data), static_cast<const char *>(data) + length);
+		_strand.dispatch([self, this, buffer, cb] () mutable {
+			if (!writingMessage_ || streamWritePending_) {
+				cb(std::string("No message is being sent, or a write is in progress."));
+				return;
+			} else if (down_) {
+				cb(std::string("Socket is disconnected."));
+				return;
+			}
+			
+			streamWritePending_ = true;
+			writeMessageSome(buffer, 0, guardStreamOperation(std::move(cb)));
+		});
+	}
+	
+	void NodeClientSocket::writeMessageSome(const std::shared_ptr<std::vector<char>> &buffer,
+											std::size_t offset, StreamCompletion &&completion)
+	{
+		if (offset == buffer->size()) {
+			streamWritePending_ = false;
+			completion(std::string());
+			return;
+		}
+		
+		auto self = shared_from_this();
+		webSocket.async_write_some(asio::buffer(buffer->data() + offset, buffer->size() - offset),
+								   _strand.wrap([self, this, buffer, offset, completion]
+												(const boost::system::error_code& error, std::size_t count) mutable {
+			if (error) {
+				streamWritePending_ = false;
+				completion(error.message());
+				return;
+			}
+			writeMessageSome(buffer, offset + count, std::move(completion));
+		}));
+	}
+	
+	void NodeClientSocket::endSendMessage(StreamCompletion &&cb)
+	{
+		auto self = shared_from_this();
+		
+		_strand.dispatch([self, this, cb] () mutable {
+			if (!writingMessage_ || streamWritePending_) {
+				cb(std::string("No message is being sent, or a write is in progress."));
+				return;
+			} else if (down_) {
+				cb(std::string("Socket is disconnected."));
+				return;
+			}
+			
+			auto completion = guardStreamOperation(std::move(cb));
+			
+			if (framing == ClientStreamFraming::Message) {
+				writingMessage_ = false;
+				sendQueue.emplace_back(NodeClientMessage::makeChunks(nullptr, 0, true),
+									   [completion] (const boost::system::error_code& error) {
+					completion(error ? error.message() : std::string());
+				});
+				
+				// Release messages sent in the meantime.
+				for (auto& item: heldMessages) {
+					sendQueue.emplace_back(std::move(item));
+				}
+				heldMessages.clear();
+				
+				if (!sending_) {
+					flushSendQueue();
+				}
+				return;
+			}
+			
+			streamWritePending_ = true;
+			webSocket.async_end_write(_strand.wrap([this, completion] (const boost::system::error_code& error) {
+				streamWritePending_ = false;
+				writingMessage_ = false;
+				completion(error ? error.message() : std::string());
 			}));
 		});
 	}
@@ -277,7 +896,7 @@ extern "C"
 			if (!socket)
 				MSCThrow(mcore::InvalidArgumentException("socket"));
 			auto &h = mcore::NodeClientSocket::fromHandle(socket);
-			h->receive([callback, userdata] (const vslim::vector_slim<char>& buffer, const std::string& error) {
+			h->receive([callback, userdata] (const mcore::BufferPool::Buffer& buffer, const std::string& error) {
 				std::uint32_t ret;
 				if (error.empty()) {
 					ret = callback(buffer.data(), static_cast<std::uint32_t>(buffer.size()),
@@ -292,6 +911,42 @@ extern "C"
 			});
 		});
 	}
+	MSCResult MSCClientSocketStartReceiving(MSCClientSocket socket,
+											std::uint32_t credit,
+											MSCClientSocketReceiveCallback callback,
+											void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->startReceiving([callback, userdata] (const mcore::BufferPool::Buffer& buffer, const std::string& error) {
+				std::uint32_t ret;
+				if (error.empty()) {
+					ret = callback(buffer.data(), static_cast<std::uint32_t>(buffer.size()),
+								   nullptr, userdata);
+				} else {
+					ret = callback(nullptr, 0,
+								   error.c_str(), userdata);
+				}
+				if (ret) {
+					MSCThrow(mcore::InvalidOperationException("MSCClientSocketReceiveCallback failed."));
+				}
+			}, credit);
+		});
+	}
+	MSCResult MSCClientSocketGrantReceiveCredit(MSCClientSocket socket,
+												std::uint32_t credit)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->grantReceiveCredit(credit);
+		});
+	}
 	MSCResult MSCClientSocketSend(MSCClientSocket socket,
 								const void *data, std::uint32_t dataLength,
 								MSCClientSocketSendCallback callback,
@@ -316,5 +971,188 @@ extern "C"
 			});
 		});
 	}
+	MSCResult MSCClientSocketSendv(MSCClientSocket socket,
+								   const MSCClientSocketBuffer *messages, std::uint32_t numMessages,
+								   MSCClientSocketSendCallback callback,
+								   void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (numMessages > 0 && !messages)
+				MSCThrow(mcore::InvalidArgumentException("messages"));
+			
+			std::vector<boost::asio::const_buffer> buffers;
+			buffers.reserve(numMessages);
+			for (std::uint32_t i = 0; i < numMessages; ++i) {
+				if (messages[i].dataLength > 0 && !messages[i].data)
+					MSCThrow(mcore::InvalidArgumentException("messages"));
+				buffers.emplace_back(messages[i].data, messages[i].dataLength);
+			}
+			
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->send(buffers.data(), buffers.size(), [callback, userdata] (const std::string& error) {
+				std::uint32_t ret;
+				if (error.empty()) {
+					ret = callback(nullptr, userdata);
+				} else {
+					ret = callback(error.c_str(), userdata);
+				}
+				if (ret) {
+					MSCThrow(mcore::InvalidOperationException("MSCClientSocketSendCallback failed."));
+				}
+			});
+		});
+	}
+	MSCResult MSCClientSocketBroadcast(const MSCClientSocket *sockets, std::uint32_t numSockets,
+									   const void *data, std::uint32_t dataLength,
+									   MSCClientSocketSendCallback callback,
+									   void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (numSockets > 0 && !sockets)
+				MSCThrow(mcore::InvalidArgumentException("sockets"));
+			if (dataLength > 0 && !data)
+				MSCThrow(mcore::InvalidArgumentException("data"));
+			for (std::uint32_t i = 0; i < numSockets; ++i) {
+				if (!sockets[i])
+					MSCThrow(mcore::InvalidArgumentException("sockets"));
+			}
+			
+			// The message is encoded only once and shared by all sockets.
+			auto message = std::make_shared<const mcore::NodeClientMessage>(data, dataLength);
+			
+			struct BroadcastState
+			{
+				std::atomic<std::uint32_t> remaining;
+				std::mutex mutex;
+				std::string error;
+			};
+			auto state = std::make_shared<BroadcastState>();
+			state->remaining = numSockets;
+			
+			auto done = [callback, userdata] (const char *error) {
+				if (callback && callback(error, userdata)) {
+					MSCThrow(mcore::InvalidOperationException("MSCClientSocketSendCallback failed."));
+				}
+			};
+			
+			if (numSockets == 0) {
+				done(nullptr);
+				return;
+			}
+			
+			for (std::uint32_t i = 0; i < numSockets; ++i) {
+				auto &h = mcore::NodeClientSocket::fromHandle(sockets[i]);
+				h->send(message, [state, done] (const std::string& error) {
+					if (!error.empty()) {
+						std::lock_guard<std::mutex> lock(state->mutex);
+						if (state->error.empty()) {
+							state->error = error;
+						}
+					}
+					if (--state->remaining == 0) {
+						done(state->error.empty() ? nullptr : state->error.c_str());
+					}
+				});
+			}
+		});
+	}
+	
+	static mcore::NodeClientSocket::StreamCompletion
+	makeStreamCompletion(MSCClientSocketSendCallback callback, void *userdata)
+	{
+		return [callback, userdata] (const std::string& error) {
+			std::uint32_t ret;
+			if (error.empty()) {
+				ret = callback(nullptr, userdata);
+			} else {
+				ret = callback(error.c_str(), userdata);
+			}
+			if (ret) {
+				MSCThrow(mcore::InvalidOperationException("MSCClientSocketSendCallback failed."));
+			}
+		};
+	}
+	MSCResult MSCClientSocketBeginReceiveMessage(MSCClientSocket socket,
+												 MSCClientSocketSendCallback callback,
+												 void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->beginReceiveMessage(makeStreamCompletion(callback, userdata));
+		});
+	}
+	MSCResult MSCClientSocketReadMessage(MSCClientSocket socket,
+										 std::uint32_t maxLength,
+										 MSCClientSocketReceiveCallback callback,
+										 void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->readMessage(maxLength, [callback, userdata] (const mcore::BufferPool::Buffer& buffer, const std::string& error) {
+				std::uint32_t ret;
+				if (error.empty()) {
+					ret = callback(buffer.data(), static_cast<std::uint32_t>(buffer.size()),
+								   nullptr, userdata);
+				} else {
+					ret = callback(nullptr, 0,
+								   error.c_str(), userdata);
+				}
+				if (ret) {
+					MSCThrow(mcore::InvalidOperationException("MSCClientSocketReceiveCallback failed."));
+				}
+			});
+		});
+	}
+	MSCResult MSCClientSocketBeginSendMessage(MSCClientSocket socket,
+											  MSCClientSocketSendCallback callback,
+											  void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->beginSendMessage(makeStreamCompletion(callback, userdata));
+		});
+	}
+	MSCResult MSCClientSocketWriteMessage(MSCClientSocket socket,
+										  const void *data, std::uint32_t dataLength,
+										  MSCClientSocketSendCallback callback,
+										  void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (dataLength > 0 && !data)
+				MSCThrow(mcore::InvalidArgumentException("data"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->writeMessage(data, dataLength, makeStreamCompletion(callback, userdata));
+		});
+	}
+	MSCResult MSCClientSocketEndSendMessage(MSCClientSocket socket,
+											MSCClientSocketSendCallback callback,
+											void *userdata)
+	{
+		return mcore::convertExceptionsToResultCode([&] {
+			if (!socket)
+				MSCThrow(mcore::InvalidArgumentException("socket"));
+			if (!callback)
+				MSCThrow(mcore::InvalidArgumentException("callback"));
+			auto &h = mcore::NodeClientSocket::fromHandle(socket);
+			h->endSendMessage(makeStreamCompletion(callback, userdata));
+		});
+	}
 }
-
@@ -19,35 +19,114 @@
 #include "WebSocket.hpp"
 #include "Logging.hpp"
 #include <list>
+#include <deque>
+#include <array>
 #include "VectorSlim.hpp"
+#include "DataChannel.hpp"
+#include "BufferPool.hpp"
 
 namespace mcore
 {
 	class Library;
 	
+	/** One or more outgoing messages which can be sent to any number of
+	 * clients. Payloads are stored once, already encoded as WebSocket
+	 * frames, and are shared by all sends. */
+	class NodeClientMessage :
+	boost::noncopyable
+	{
+		// Frames are stored back to back, so they can be written at once.
+		vslim::vector_slim<char> frames;
+		std::vector<std::array<char, 4>> lengthPrefixes;
+		
+		std::vector<boost::asio::const_buffer> webSocketBuffers;
+		std::vector<boost::asio::const_buffer> lengthPrefixedBuffers;
+		
+		void encode(const boost::asio::const_buffer *messages, std::size_t count);
+		
+	public:
+		NodeClientMessage(const void *data, std::size_t length);
+		NodeClientMessage(const boost::asio::const_buffer *messages, std::size_t count);
+		
+		/** Creates chunks of a streamed message, which can only be sent with
+		 * <ClientStreamFraming::Message>. `data` is split into as many
+		 * chunks as needed. */
+		static std::shared_ptr<const NodeClientMessage>
+		makeChunks(const void *data, std::size_t length, bool last);
+		
+		/** Returns the encoded messages for the given framing. */
+		const std::vector<boost::asio::const_buffer>& buffers(ClientStreamFraming) const;
+	};
+	
+	/** WebSocket endpoint of a client, as seen by the application.
+	 * Frames are read from and written to the client's stream on the
+	 * data channel to the master.
+	 * When the master terminates WebSocket (<ClientStreamFraming::Message>),
+	 * only length-prefixed messages are exchanged with the transport. */
 	class NodeClientSocket :
 	boost::noncopyable,
 	public std::enable_shared_from_this<NodeClientSocket>
 	{
+	public:
+		using StreamCompletion = std::function<void(const std::string&)>;
+	private:
 		TypedLogger<NodeClientSocket> log;
 		std::shared_ptr<Library> const library;
 		
-		boost::asio::local::stream_protocol::socket socket;
+		std::shared_ptr<DataChannelStream> const transport;
+		ClientStreamFraming const framing;
 		
 		boost::asio::strand _strand;
 		
-		asiows::web_socket<boost::asio::local::stream_protocol::socket&> webSocket;
-		vslim::vector_slim<char> receiveBuffer;
+		asiows::web_socket<DataChannelStream&> webSocket;
+		BufferPool::Buffer receiveBuffer; // Only held while a message is being read
 		std::size_t receiveBufferLen;
+		std::array<char, 4> receiveHeader;
+		std::uint32_t receiveChunkLen; // ClientStreamFraming::Message
+		bool receiveChunkContinued;
+		
+		// Used for ClientStreamFraming::Message. Transport doesn't accept
+		// concurrent writes, so messages are written one by one.
+		using SendCompletion = std::function<void(const boost::system::error_code&)>;
+		std::deque<std::pair<std::shared_ptr<const NodeClientMessage>, SendCompletion>> sendQueue;
+		bool sending_ = false;
+		
+		void enqueueMessage(const std::shared_ptr<const NodeClientMessage>&,
+							SendCompletion&&);
+		void flushSendQueue();
+		
+		// Messages sent while a streamed message is being written are
+		// held until it ends. (ClientStreamFraming::Message)
+		std::deque<std::pair<std::shared_ptr<const NodeClientMessage>, SendCompletion>> heldMessages;
 		
 		std::list<std::function<void()>> shutdownListeners;
 		
+		template <class Callback>
+		class ReceiveOperation;
+		
+		// Subscription made by <startReceiving>.
+		using ReceiveHandler = std::function<void(const BufferPool::Buffer&, const std::string&)>;
+		ReceiveHandler receiveHandler;
+		std::uint64_t receiveCredit = 0;
+		decltype(shutdownListeners)::iterator receiveHandlerListener;
+		
+		void receiveNext();
+		
+		StreamCompletion guardStreamOperation(StreamCompletion&&);
+		void readMessageChunk(std::size_t maxLength, ReceiveHandler&&);
+		void writeMessageSome(const std::shared_ptr<std::vector<char>>&,
+							  std::size_t offset, StreamCompletion&&);
+		
 		bool receiving_ = false;
+		bool readingMessage_ = false; // Between <beginReceiveMessage> and the end of the message
+		bool writingMessage_ = false; // Between <beginSendMessage> and <endSendMessage>
+		bool streamWritePending_ = false;
 		bool down_ = false;
 		
 	public:
 		NodeClientSocket(std::shared_ptr<Library>, const std::string& displayName,
-						 int stream);
+						 const std::shared_ptr<DataChannelStream>& transport,
+						 ClientStreamFraming framing);
 		virtual ~NodeClientSocket();
 		
 		MSCClientSocket createHandle()
@@ -59,10 +138,40 @@ namespace mcore
 		template <class Callback>
 		void receive(Callback&&);
 		
+		/** Delivers received messages to `handler` until the socket is
+		 * disconnected or an error occurs, which is reported to `handler`
+		 * as the last call. Each message consumes one credit, and reading
+		 * stops while no credit is left (see <grantReceiveCredit>). */
+		void startReceiving(ReceiveHandler&& handler, std::uint32_t credit);
+		void grantReceiveCredit(std::uint32_t credit);
+		
 		template <class Callback>
 		void send(const void *data, std::size_t length,
 				  Callback&&);
 		
+		/** Sends multiple messages with a single write. */
+		template <class Callback>
+		void send(const boost::asio::const_buffer *messages, std::size_t count,
+				  Callback&&);
+		
+		/** Sends a message which may be shared with other sockets. */
+		template <class Callback>
+		void send(const std::shared_ptr<const NodeClientMessage>&,
+				  Callback&&);
+		
+		/** Waits for a message whose payload is then read by
+		 * <readMessage>. Unlike <receive>, the message can be of any length. */
+		void beginReceiveMessage(StreamCompletion&&);
+		/** Reads up to `maxLength` bytes of the message. An empty buffer
+		 * (without an error) indicates the end of the message. */
+		void readMessage(std::size_t maxLength, ReceiveHandler&&);
+		
+		/** Starts a message whose payload is then written by <writeMessage>
+		 * piece by piece. Other messages are sent after it ends. */
+		void beginSendMessage(StreamCompletion&&);
+		void writeMessage(const void *data, std::size_t length, StreamCompletion&&);
+		void endSendMessage(StreamCompletion&&);
+		
 		void shutdown();
 	};
 	
@@ -0,0 +1,185 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "NodeDataChannelPool.hpp"
+#include "Library.hpp"
+#include "Protocol.hpp"
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+using boost::format;
+
+namespace mcore
+{
+	// Delay before reconnecting a data channel after the first failure, and
+	// the limit it is doubled up to.
+	static constexpr std::chrono::milliseconds InitialReconnectDelay {100};
+	static constexpr std::chrono::milliseconds MaxReconnectDelay {10000};
+	
+	NodeDataChannelPool::NodeDataChannelPool(const std::shared_ptr<Library> &library,
+											 const ip::tcp::endpoint &endpoint,
+											 std::size_t numChannels):
+	library(library),
+	endpoint(endpoint),
+	_strand(library->ioService()),
+	slots(std::max<std::size_t>(numChannels, 1))
+	{
+		log.setChannel("Data Channel Pool");
+	}
+	
+	NodeDataChannelPool::~NodeDataChannelPool()
+	{
+	}
+	
+	void NodeDataChannelPool::openStream(std::uint64_t clientId, const OpenStreamCallback &callback)
+	{
+		auto self = shared_from_this();
+		_strand.dispatch([this, self, clientId, callback] {
+			if (disposed) {
+				callback(asio::error::shut_down, nullptr);
+				return;
+			}
+			
+			auto index = static_cast<std::size_t>(clientId % slots.size());
+			auto& slot = slots[index];
+			
+			if (slot.channel && slot.channel->isOpen()) {
+				callback(boost::system::error_code(), slot.channel->openStream(clientId));
+				return;
+			}
+			
+			if (!slot.connecting && std::chrono::steady_clock::now() < slot.retryAt) {
+				callback(slot.lastError, nullptr);
+				return;
+			}
+			
+			slot.waiters.emplace_back(clientId, callback);
+			if (!slot.connecting) {
+				connect(index);
+			}
+		});
+	}
+	
+	void NodeDataChannelPool::connect(std::size_t index)
+	{
+		auto self = shared_from_this();
+		auto& slot = slots[index];
+		
+		slot.channel.reset();
+		slot.connecting = true;
+		
+		BOOST_LOG_SEV(log, LogLevel::Debug) <<
+		format("Connecting data channel %d to %s.") % index % endpoint;
+		
+		// Each channel (and the clients it carries) lives on its own shard.
+		auto& service = library->nextIoService();
+		auto socket = std::make_shared<DataChannel::socketType>(service);
+		socket->async_connect(endpoint, _strand.wrap([this, self, index, socket, &service] (const boost::system::error_code& error) {
+			if (error) {
+				connectionFailed(index, error);
+				return;
+			}
+			
+			asio::async_write(*socket, asio::buffer(&DataChannelMagic, 4), _strand.wrap
+			([this, self, index, socket, &service] (const boost::system::error_code& error, std::size_t) {
+				if (error) {
+					connectionFailed(index, error);
+					return;
+				}
+				channelEstablished(index, service, socket);
+			}));
+		}));
+	}
+	
+	void NodeDataChannelPool::connectionFailed(std::size_t index, const boost::system::error_code &error)
+	{
+		auto& slot = slots[index];
+		slot.connecting = false;
+		
+		slot.backoff = slot.backoff.count() == 0 ? InitialReconnectDelay :
+		std::min<std::chrono::milliseconds>(slot.backoff * 2, MaxReconnectDelay);
+		slot.retryAt = std::chrono::steady_clock::now() + slot.backoff;
+		slot.lastError = error;
+		
+		BOOST_LOG_SEV(log, LogLevel::Warn) <<
+		format("Failed to connect data channel %d.: %s. Not reconnecting for %d ms.") %
+		index % error.message() % slot.backoff.count();
+		
+		auto waiters = std::move(slot.waiters);
+		slot.waiters.clear();
+		for (const auto& w: waiters) {
+			w.second(error, nullptr);
+		}
+	}
+	
+	void NodeDataChannelPool::channelEstablished(std::size_t index,
+												 asio::io_service &service,
+												 const std::shared_ptr<DataChannel::socketType> &socket)
+	{
+		auto self = shared_from_this();
+		auto& slot = slots[index];
+		slot.connecting = false;
+		
+		if (disposed) {
+			try { socket->close(); } catch (...) { }
+			connectionFailed(index, asio::error::shut_down);
+			return;
+		}
+		
+		auto channel = std::make_shared<DataChannel>(service, socket);
+		channel->setChannelName(str(format("Data Channel %d") % index));
+		
+		std::weak_ptr<DataChannel> weakChannel = channel;
+		channel->onClosed.connect([this, self, index, weakChannel] {
+			_strand.post([this, self, index, weakChannel] {
+				if (slots[index].channel == weakChannel.lock()) {
+					slots[index].channel.reset();
+				}
+			});
+		});
+		
+		slot.channel = channel;
+		slot.backoff = std::chrono::milliseconds(0);
+		channel->start();
+		
+		BOOST_LOG_SEV(log, LogLevel::Debug) <<
+		format("Data channel %d established.") % index;
+		
+		auto waiters = std::move(slot.waiters);
+		slot.waiters.clear();
+		for (const auto& w: waiters) {
+			w.second(boost::system::error_code(), channel->openStream(w.first));
+		}
+	}
+	
+	void NodeDataChannelPool::shutdown()
+	{
+		auto self = shared_from_this();
+		_strand.dispatch([this, self] {
+			if (disposed)
+				return;
+			disposed = true;
+			
+			for (auto& slot: slots) {
+				if (slot.channel) {
+					slot.channel->shutdown();
+					slot.channel.reset();
+				}
+			}
+		});
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "Logging.hpp"
+#include "DataChannel.hpp"
+
+namespace mcore
+{
+	class Library;
+	
+	/** Keeps a small number of persistent data channels to the master.
+	 * Client streams are distributed over the channels by the client ID. */
+	class NodeDataChannelPool :
+	public std::enable_shared_from_this<NodeDataChannelPool>,
+	boost::noncopyable
+	{
+	public:
+		using OpenStreamCallback =
+		std::function<void(const boost::system::error_code&, const DataChannelStream::ptr&)>;
+	private:
+		TypedLogger<NodeDataChannelPool> log;
+		
+		std::shared_ptr<Library> const library;
+		boost::asio::ip::tcp::endpoint const endpoint;
+		boost::asio::strand _strand;
+		bool disposed = false;
+		
+		struct Slot
+		{
+			DataChannel::ptr channel;
+			bool connecting = false;
+			std::vector<std::pair<std::uint64_t, OpenStreamCallback>> waiters;
+			
+			/** After a failed connect, streams fail with `lastError` until
+			 * `retryAt` instead of reconnecting. `backoff` doubles with
+			 * each consecutive failure. */
+			std::chrono::steady_clock::time_point retryAt;
+			std::chrono::milliseconds backoff {0};
+			boost::system::error_code lastError;
+		};
+		std::vector<Slot> slots;
+		
+		void connect(std::size_t index);
+		void connectionFailed(std::size_t index, const boost::system::error_code&);
+		void channelEstablished(std::size_t index, boost::asio::io_service&,
+								const std::shared_ptr<DataChannel::socketType>&);
+		
+	public:
+		NodeDataChannelPool(const std::shared_ptr<Library>&,
+							const boost::asio::ip::tcp::endpoint&,
+							std::size_t numChannels);
+		~NodeDataChannelPool();
+		
+		/** Opens a stream for the specified client. `callback` is called
+		 * in the pool's strand. */
+		void openStream(std::uint64_t clientId, const OpenStreamCallback& callback);
+		
+		void shutdown();
+	};
+}
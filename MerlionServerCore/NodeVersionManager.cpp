@@ -17,6 +17,7 @@
 #include "NodeVersionManager.hpp"
 #include "Exceptions.hpp"
 #include "NodeVersionLoader.hpp"
+#include "Library.hpp"
 
 using boost::format;
 
@@ -24,8 +25,10 @@ namespace mcore
 {
 	
 	NodeVersionManager::NodeVersionManager
-	(const std::shared_ptr<NodeVersionLoader> &loader):
-	loader(loader)
+	(const std::shared_ptr<NodeVersionLoader> &loader,
+	 const std::shared_ptr<Library> &library):
+	loader(loader),
+	library(library)
 	{
 		if (!loader) {
 			MSCThrow(InvalidArgumentException("loader"));
@@ -53,42 +56,40 @@ namespace mcore
 		});
 		loader->onVersionDownloaded.connect([=](const std::string &version) {
 			auto self = shared_from_this();
-			
-			// Deploy
-			try {
-				onNeedToDeployVersion(version);
-			} catch(...) {
-				BOOST_LOG_SEV(log, LogLevel::Error) <<
-				format("Failed to deploy version '%s'.: ") % version
-				<< boost::current_exception_diagnostic_information();
-				
-				std::lock_guard<std::recursive_mutex> lock(mutex);
-				auto it = domains.find(version);
-				
-				if (it != domains.end()) {
-					auto domain = it->second;
-					domain->downloadFailed();
-				}
-				
+			auto lib = this->library.lock();
+			if (!lib) {
 				return;
 			}
 			
-			BOOST_LOG_SEV(log, LogLevel::Info) <<
-			format("Deployed version '%s'.: ") % version;
+			// Deploying can take long; don't hold up the next download.
+			lib->postDeploy([this, self, version] {
+				deploy(version);
+			});
+		});
+		loader->onVersionDownloadFailed.connect([=](const std::string& version) {
+			auto self = shared_from_this();
 			
-			// Report that version was downloaded.
 			std::lock_guard<std::recursive_mutex> lock(mutex);
-			
 			auto it = domains.find(version);
 			
 			if (it != domains.end()) {
 				auto domain = it->second;
-				domain->downloadDone();
+				domain->downloadFailed();
 			}
-			
 		});
-		loader->onVersionDownloadFailed.connect([=](const std::string& version) {
-			auto self = shared_from_this();
+	}
+	NodeVersionManager::~NodeVersionManager()
+	{ }
+	
+	void NodeVersionManager::deploy(const std::string &version)
+	{
+		// Deploy
+		try {
+			onNeedToDeployVersion(version);
+		} catch(...) {
+			BOOST_LOG_SEV(log, LogLevel::Error) <<
+			format("Failed to deploy version '%s'.: ") % version
+			<< boost::current_exception_diagnostic_information();
 			
 			std::lock_guard<std::recursive_mutex> lock(mutex);
 			auto it = domains.find(version);
@@ -97,10 +98,23 @@ namespace mcore
 				auto domain = it->second;
 				domain->downloadFailed();
 			}
-		});
+			
+			return;
+		}
+		
+		BOOST_LOG_SEV(log, LogLevel::Info) <<
+		format("Deployed version '%s'.: ") % version;
+		
+		// Report that version was downloaded.
+		std::lock_guard<std::recursive_mutex> lock(mutex);
+		
+		auto it = domains.find(version);
+		
+		if (it != domains.end()) {
+			auto domain = it->second;
+			domain->downloadDone();
+		}
 	}
-	NodeVersionManager::~NodeVersionManager()
-	{ }
 	
 	void NodeVersionManager::requestLoadVersion(const std::string &version)
 	{
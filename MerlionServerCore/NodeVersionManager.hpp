@@ -20,6 +20,7 @@
 namespace mcore
 {
 	class NodeVersionLoader;
+	class Library;
 	class NodeVersionManagerDomain;
 	class NodeVersionManagerDomainInstance;
 	
@@ -33,14 +34,19 @@ namespace mcore
 		std::recursive_mutex mutex;
 		
 		std::shared_ptr<NodeVersionLoader> const loader;
+		std::weak_ptr<Library> const library;
 		
 		std::unordered_map<std::string,
 		std::shared_ptr<NodeVersionManagerDomain>> domains;
 		
+		void deploy(const std::string &);
+		
 	public:
 		// NodeVersionLoader must be provided with
 		// its onNeedsDownloadFileName connected to the caller-provided function.
-		NodeVersionManager(const std::shared_ptr<NodeVersionLoader>&);
+		// Downloaded versions are deployed on the library's deploy threads.
+		NodeVersionManager(const std::shared_ptr<NodeVersionLoader>&,
+						   const std::shared_ptr<Library>&);
 		~NodeVersionManager();
 		
 		void requestLoadVersion(const std::string &);
@@ -52,8 +58,7 @@ namespace mcore
 		// If the version needs to be downloaded,
 		// <NodeVersionManagerDomain::needsDownload> should be
 		// called.
-		// <onStartDomain> and <onNeedToDeployVersion> will only be c
-		// called from one thread.
+		// <onStartDomain> is called with the manager's mutex held.
 		boost::signals2::signal<void(std::shared_ptr<NodeVersionManagerDomain>)> onStartDomain;
 		
 		// Called when a version was downloaded, and
@@ -61,8 +66,9 @@ namespace mcore
 		// The handler can throw a exception, and if it does so,
 		// <NodeVersionManager> will output an error and handles it
 		// appropriately.
-		// <onStartDomain> and <onNeedToDeployVersion> will only be c
-		// called from one thread.
+		// <onNeedToDeployVersion> is called on the library's deploy
+		// threads, concurrently for different versions if there are
+		// several of them.
 		boost::signals2::signal<void(const std::string&)> onNeedToDeployVersion;
 	};
 	
@@ -24,6 +24,7 @@ namespace mcore
     static constexpr std::uint32_t ControlStreamHeaderMagic = 0x129a1234;
     static constexpr std::uint32_t VersionDownloadRequestMagic = 0x229b1234;
     static constexpr std::uint32_t DataStreamMagic = 0x3183a443;
+    static constexpr std::uint32_t DataChannelMagic = 0x4183a443;
 
     enum class MasterCommand : std::uint8_t
     {
@@ -41,9 +42,66 @@ namespace mcore
         Nop = 0,
         LoadVersion,
         UnloadVersion,
-        Connect
+        Connect,
+        // Same as Connect, followed by `ClientStreamFraming`.
+        ConnectEx
     };
     
+    /** How the contents of a client's data stream are framed. */
+    enum class ClientStreamFraming : std::uint8_t
+    {
+        // Raw WebSocket frames, relayed byte-by-byte by the master.
+        WebSocket = 0,
+        // WebSocket is terminated on the master. Each application message
+        // is sent as `{ uint32_t length; char data[length]; }`.
+        // Longer messages are split into chunks, each of which but the last
+        // has `ClientMessageContinuedFlag` set in `length`.
+        Message
+    };
+    
+    // Maximum length of an application message sent or received by clients
+    // (unless streamed), and of a chunk in `ClientStreamFraming::Message`.
+    static constexpr std::size_t ClientMessageMaxLength = 65536;
+    
+    static constexpr std::uint32_t ClientMessageContinuedFlag = 0x80000000U;
+    
+    /** Writes the 4-byte little-endian `length` of
+     * `ClientStreamFraming::Message`. `out` needs no alignment. */
+    inline void encodeClientMessageHeader(char *out, std::uint32_t header)
+    {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<char>(header >> (8 * i));
+    }
+    
+    inline std::uint32_t decodeClientMessageHeader(const char *in)
+    {
+        std::uint32_t header = 0;
+        for (int i = 0; i < 4; ++i)
+            header |= static_cast<std::uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        return header;
+    }
+    
+    /** Frame types of the multiplexed data channel.
+     * Every frame starts with the header
+     * `{ DataChannelCommand command; uint64_t streamId; uint32_t length; }`
+     * followed by `length` bytes of payload. */
+    enum class DataChannelCommand : std::uint8_t
+    {
+        // Node -> Master. Stream ID is the client ID.
+        Open = 0,
+        Data,
+        // Payload is `uint32_t` which indicates the number of bytes
+        // the receiver has consumed.
+        Credit,
+        Close
+    };
+
+    static constexpr std::size_t DataChannelFrameHeaderSize = 13;
+    static constexpr std::size_t DataChannelMaxFramePayload = 16384;
+
+    // Number of bytes that can be sent without being credited by the receiver.
+    static constexpr std::size_t DataChannelInitialWindow = 256 * 1024;
+    
     struct NodeInfo
     {
         std::string nodeName;
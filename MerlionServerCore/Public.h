@@ -62,9 +62,84 @@ extern "C" {
 	extern MSCResult MSCRemoveLogSink(MSCLogSinkHandle handle);
 
 	typedef void *MSCLibrary;
+	
+	enum MSCLibraryFlags : std::uint32_t
+	{
+		MSCLF_None = 0,
+		
+		/** Run one I/O queue per I/O thread, each thread pinned to one
+		 * core. Each connection is assigned to a queue when it is
+		 * accepted or opened and all of its handlers run there. */
+		MSCLF_ShardIoServices = 1 << 0
+	};
+	
+	/** Zero and `NULL` members select the defaults. CPU lists have the
+	 * same format as Linux's `cpuset` (e.g. "0-3,8"). Affinity and
+	 * niceness are only applied on Linux. */
+	struct MSCLibraryParameters
+	{
+		MSCLibraryFlags flags;
+		
+		/** Number of I/O threads. The default is `max(cores, 2) * 2`,
+		 * or one per CPU in `ioCpus` with MSCLF_ShardIoServices. */
+		std::uint32_t numIoThreads;
+		/** CPUs the I/O threads run on. With MSCLF_ShardIoServices
+		 * thread `i` is pinned to the `i`-th of them (wrapping around).
+		 * The default is the CPUs the process may run on. */
+		const char *ioCpus;
+		
+		/** Threads deploying downloaded packages. The default is 1. */
+		std::uint32_t numDeployThreads;
+		/** Threads running application callbacks such as accepting a
+		 * client or loading a version. The default is 2. */
+		std::uint32_t numCallbackThreads;
+		/** CPUs the deploy and callback threads run on. */
+		const char *blockingCpus;
+		
+		/** Nice values (-20 - 19) of the threads. */
+		std::int32_t ioThreadNiceness;
+		std::int32_t blockingThreadNiceness;
+	};
+	
+	/** Values in effect and load of a library's threads. */
+	struct MSCLibraryStatistics
+	{
+		std::uint32_t numIoServices;
+		std::uint32_t numIoThreads;
+		std::uint32_t numDeployThreads;
+		std::uint32_t numCallbackThreads;
+		
+		/** How late the I/O queues ran a handler that was due, sampled
+		 * every second, in microseconds. High values mean the I/O
+		 * threads are saturated. */
+		std::uint64_t maxIoQueueDelay;
+		std::uint64_t averageIoQueueDelay;
+		
+		std::uint64_t numPendingDeployTasks;
+		std::uint64_t numCompletedDeployTasks;
+		std::uint64_t numPendingCallbackTasks;
+		std::uint64_t numCompletedCallbackTasks;
+	};
 
 	extern MSCResult MSCLibraryCreate(MSCLibrary *libOut);
+	extern MSCResult MSCLibraryCreateEx(const MSCLibraryParameters *params, MSCLibrary *libOut);
 	extern MSCResult MSCLibraryDestroy(MSCLibrary library);
+	extern MSCResult MSCLibraryGetStatistics(MSCLibrary library, MSCLibraryStatistics *outStats);
+	
+	/** Counters of the client relays in this process. `numBytes / numReads`
+	 * gives the average bytes per read, `numBufferBytes / numPipes` the
+	 * buffer memory per relay direction. */
+	struct MSCRelayStatistics
+	{
+		/** Number of running relays. Each client has two. */
+		std::uint64_t numPipes;
+		std::uint64_t numReads;
+		std::uint64_t numBytes;
+		/** Buffer memory currently held by the relays. */
+		std::uint64_t numBufferBytes;
+	};
+	
+	extern MSCResult MSCGetRelayStatistics(MSCRelayStatistics *outStats);
 
 	typedef void *MSCMaster;
 		
@@ -77,7 +152,28 @@ extern "C" {
 	enum MSCMasterFlags : std::uint32_t
 	{
 		MSCMF_None = 0,
-		MSCMF_DisallowVersionSpecification = 1 << 0
+		MSCMF_DisallowVersionSpecification = 1 << 0,
+		
+		/** Terminate WebSocket on the master and forward only complete
+		 * application messages to nodes. */
+		MSCMF_TerminateWebSocket = 1 << 1,
+		
+		/** Disable the TLS session cache and session tickets so every
+		 * client connection performs a full handshake. */
+		MSCMF_DisableSslSessionResumption = 1 << 2,
+		
+		/** Let the kernel (Linux kTLS) encrypt the data sent to WebSocket
+		 * pass-through clients. Falls back to OpenSSL when unavailable. */
+		MSCMF_EnableKernelTls = 1 << 3,
+		
+		/** Compress messages exchanged with clients that offer the
+		 * permessage-deflate WebSocket extension. Only effective together
+		 * with MSCMF_TerminateWebSocket. */
+		MSCMF_EnableWebSocketCompression = 1 << 4,
+		
+		/** Compress each WebSocket message independently, so idle clients
+		 * hold no compression state, at the cost of compression ratio. */
+		MSCMF_WebSocketCompressionNoContextTakeover = 1 << 5
 	};
 
 	struct MSCMasterParameters
@@ -92,6 +188,45 @@ extern "C" {
 		void *packagePathCallbackUserData;
 		
 		MSCMasterFlags flags;
+		
+		/** Maximum number of TLS sessions cached for resumption.
+		 * Zero selects the default (20480). */
+		std::uint32_t sslSessionCacheSize;
+		/** Lifetime of cached TLS sessions and session tickets in seconds.
+		 * Zero selects the default (300). */
+		std::uint32_t sslSessionTimeout;
+		/** Interval between rotations of the session ticket key in seconds.
+		 * Zero selects the default (3600). */
+		std::uint32_t sslTicketKeyRotationInterval;
+		
+		/** Maximum number of TLS handshakes performed at once. Zero selects
+		 * half of the library's I/O threads (at least one), leaving the
+		 * rest to established clients. */
+		std::uint32_t maxConcurrentHandshakes;
+		/** Maximum number of connections waiting for a handshake slot.
+		 * Connections beyond that are closed immediately. Zero selects the
+		 * default (1024). */
+		std::uint32_t maxQueuedHandshakes;
+		
+		/** Base-2 logarithm of the LZ77 window size used for WebSocket
+		 * compression (9 - 15). Zero selects the default (15). */
+		std::uint32_t webSocketCompressionWindowBits;
+		/** zlib memory level used for WebSocket compression (1 - 9).
+		 * Zero selects the default (8). */
+		std::uint32_t webSocketCompressionMemoryLevel;
+		/** zlib compression level used for WebSocket compression (1 - 9).
+		 * Zero selects the default (1). */
+		std::uint32_t webSocketCompressionLevel;
+		/** Largest size of a compressed message received from a client
+		 * after decompression, in bytes. Clients exceeding it are
+		 * disconnected. Zero selects the default (1 MiB). */
+		std::uint32_t webSocketMaxInflatedMessageSize;
+		
+		/** Number of sockets listening on the client endpoint. They are
+		 * bound with SO_REUSEPORT so the kernel spreads new connections
+		 * among them. Zero selects the number of CPU cores. Platforms
+		 * without SO_REUSEPORT always use one. */
+		std::uint32_t numClientAcceptors;
 	};
 		
 	struct MSCNodeStatus
@@ -181,6 +316,10 @@ extern "C" {
 		
 		MSCNodeFailureCallback failureCallback;
 		void *failureCallbackUserData;
+		
+		/** Number of persistent connections to the master that carry the
+		 * client streams. Zero selects the default (4). */
+		std::uint32_t numDataChannels;
 	};
 	
 	extern MSCResult MSCNodeCreate(MSCLibrary library,
@@ -203,11 +342,71 @@ extern "C" {
 	extern MSCResult MSCClientSocketReceive(MSCClientSocket socket,
 											MSCClientSocketReceiveCallback callback,
 											void *userdata);
+	
+	/** Calls `callback` for every received message until the socket is
+	 * disconnected. The final call reports the error. At most `credit`
+	 * messages are delivered before <MSCClientSocketGrantReceiveCredit>
+	 * is called; the client is not read from while no credit is left. */
+	extern MSCResult MSCClientSocketStartReceiving(MSCClientSocket socket,
+												   std::uint32_t credit,
+												   MSCClientSocketReceiveCallback callback,
+												   void *userdata);
+	extern MSCResult MSCClientSocketGrantReceiveCredit(MSCClientSocket socket,
+													   std::uint32_t credit);
+	
 	extern MSCResult MSCClientSocketSend(MSCClientSocket socket,
 										 const void *data, std::uint32_t dataLength,
 										 MSCClientSocketSendCallback callback,
 										 void *userdata);
 	
+	struct MSCClientSocketBuffer
+	{
+		const void *data;
+		std::uint32_t dataLength;
+	};
+	
+	/** Sends multiple messages with a single write. `callback` is called
+	 * once all of them have been sent. */
+	extern MSCResult MSCClientSocketSendv(MSCClientSocket socket,
+										  const MSCClientSocketBuffer *messages, std::uint32_t numMessages,
+										  MSCClientSocketSendCallback callback,
+										  void *userdata);
+	
+	/** Sends the same message to every socket in `sockets`. The message is
+	 * encoded only once. `callback` (which can be null) is called once after
+	 * all sends have completed, with the first error if any of them failed. */
+	extern MSCResult MSCClientSocketBroadcast(const MSCClientSocket *sockets, std::uint32_t numSockets,
+											  const void *data, std::uint32_t dataLength,
+											  MSCClientSocketSendCallback callback,
+											  void *userdata);
+	
+	/** Streaming of messages longer than 65536 bytes.
+	 * <MSCClientSocketBeginReceiveMessage> waits for a message, whose
+	 * payload is then read by calling <MSCClientSocketReadMessage> until it
+	 * delivers zero bytes. Only one operation can be in progress at once. */
+	extern MSCResult MSCClientSocketBeginReceiveMessage(MSCClientSocket socket,
+														MSCClientSocketSendCallback callback,
+														void *userdata);
+	extern MSCResult MSCClientSocketReadMessage(MSCClientSocket socket,
+												std::uint32_t maxLength,
+												MSCClientSocketReceiveCallback callback,
+												void *userdata);
+	
+	/** A streamed message is started by <MSCClientSocketBeginSendMessage>,
+	 * written by any number of <MSCClientSocketWriteMessage> and finished by
+	 * <MSCClientSocketEndSendMessage>. Each call must wait for the previous
+	 * one to complete. Messages sent in the meantime follow the streamed one. */
+	extern MSCResult MSCClientSocketBeginSendMessage(MSCClientSocket socket,
+													 MSCClientSocketSendCallback callback,
+													 void *userdata);
+	extern MSCResult MSCClientSocketWriteMessage(MSCClientSocket socket,
+												 const void *data, std::uint32_t dataLength,
+												 MSCClientSocketSendCallback callback,
+												 void *userdata);
+	extern MSCResult MSCClientSocketEndSendMessage(MSCClientSocket socket,
+												   MSCClientSocketSendCallback callback,
+												   void *userdata);
+	
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,133 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+namespace mcore
+{
+	/** Hash map split into `NumShards` independently locked maps so that
+	 * threads working on different keys rarely contend. Values are copied
+	 * out, and removed values are destroyed after the lock is released,
+	 * so their destructors may use the map again. */
+	template <class Key, class T, std::size_t NumShards = 64,
+	class Hash = std::hash<Key>>
+	class ShardedMap :
+	boost::noncopyable
+	{
+		struct Shard
+		{
+			mutable std::mutex mutex;
+			std::unordered_map<Key, T, Hash> map;
+			
+			// Keeps the mutexes of neighbouring shards off one cache line.
+			char padding[64];
+		};
+		
+		std::array<Shard, NumShards> shards;
+		
+		Shard& shardFor(const Key& key) { return shards[Hash()(key) % NumShards]; }
+		const Shard& shardFor(const Key& key) const { return shards[Hash()(key) % NumShards]; }
+		
+	public:
+		/** Inserts a value or replaces the existing one. */
+		void set(const Key& key, T value)
+		{
+			auto& shard = shardFor(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			std::swap(shard.map[key], value);
+		}
+		
+		boost::optional<T> find(const Key& key) const
+		{
+			auto& shard = shardFor(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.map.find(key);
+			if (it == shard.map.end())
+				return boost::none;
+			return it->second;
+		}
+		
+		/** Removes a value and returns it. */
+		boost::optional<T> take(const Key& key)
+		{
+			auto& shard = shardFor(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.map.find(key);
+			if (it == shard.map.end())
+				return boost::none;
+			boost::optional<T> ret(std::move(it->second));
+			shard.map.erase(it);
+			return ret;
+		}
+		
+		bool erase(const Key& key)
+		{
+			// Destroyed after the lock is released.
+			auto value = take(key);
+			return static_cast<bool>(value);
+		}
+		
+		/** Modifies the value in place, default-constructing it if absent.
+		 * The value is removed if `fn` returns false. `fn` is called with
+		 * the shard locked. */
+		template <class Function>
+		void update(const Key& key, Function fn)
+		{
+			boost::optional<T> removed;
+			{
+				auto& shard = shardFor(key);
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto it = shard.map.find(key);
+				if (it == shard.map.end())
+					it = shard.map.emplace(key, T()).first;
+				if (fn(it->second))
+					return;
+				removed = std::move(it->second);
+				shard.map.erase(it);
+			}
+		}
+		
+		/** Copies all values. Not atomic across shards. */
+		std::vector<T> values() const
+		{
+			std::vector<T> ret;
+			for (const auto& shard: shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				for (const auto& e: shard.map)
+					ret.push_back(e.second);
+			}
+			return ret;
+		}
+		
+		std::size_t size() const
+		{
+			std::size_t count = 0;
+			for (const auto& shard: shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				count += shard.map.size();
+			}
+			return count;
+		}
+	};
+}
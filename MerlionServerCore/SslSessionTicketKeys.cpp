@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "SslSessionTicketKeys.hpp"
+#include "Exceptions.hpp"
+#include <cstring>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace mcore
+{
+	namespace
+	{
+		// The MAC context type differs between OpenSSL versions.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		int initMac(EVP_MAC_CTX *ctx, unsigned char *key, std::size_t keyLength)
+		{
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, keyLength),
+				OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+				OSSL_PARAM_construct_end()
+			};
+			return EVP_MAC_CTX_set_params(ctx, params);
+		}
+#else
+		int initMac(HMAC_CTX *ctx, unsigned char *key, std::size_t keyLength)
+		{
+			return HMAC_Init_ex(ctx, key, static_cast<int>(keyLength), EVP_sha256(), nullptr);
+		}
+#endif
+	}
+	
+	SslSessionTicketKeys::SslSessionTicketKeys(std::chrono::seconds rotationInterval):
+	rotationInterval(rotationInterval),
+	current(generateKey()),
+	currentCreated(std::chrono::steady_clock::now())
+	{ }
+	
+	SslSessionTicketKeys::~SslSessionTicketKeys()
+	{
+		OPENSSL_cleanse(&current, sizeof(current));
+		OPENSSL_cleanse(&previous, sizeof(previous));
+	}
+	
+	SslSessionTicketKeys::Key SslSessionTicketKeys::generateKey()
+	{
+		Key key;
+		if (RAND_bytes(key.name.data(), static_cast<int>(key.name.size())) != 1 ||
+			RAND_bytes(key.aesKey.data(), static_cast<int>(key.aesKey.size())) != 1 ||
+			RAND_bytes(key.hmacKey.data(), static_cast<int>(key.hmacKey.size())) != 1) {
+			MSCThrow(InvalidOperationException("Failed to generate a session ticket key."));
+		}
+		return key;
+	}
+	
+	int SslSessionTicketKeys::contextDataIndex()
+	{
+		static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+	
+	void SslSessionTicketKeys::install(boost::asio::ssl::context &context)
+	{
+		auto *handle = context.native_handle();
+		if (contextDataIndex() < 0 ||
+			!SSL_CTX_set_ex_data(handle, contextDataIndex(), this)) {
+			MSCThrow(InvalidOperationException("Failed to attach session ticket keys."));
+		}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(handle, &handleTicket<EVP_MAC_CTX>);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(handle, &handleTicket<HMAC_CTX>);
+#endif
+	}
+	
+	void SslSessionTicketKeys::rotateIfNeeded()
+	{
+		auto now = std::chrono::steady_clock::now();
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		if (now - currentCreated < rotationInterval) {
+			return;
+		}
+		previous = current;
+		hasPrevious = true;
+		current = generateKey();
+		currentCreated = now;
+	}
+	
+	SslSessionTicketKeys::Key SslSessionTicketKeys::encryptionKey()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return current;
+	}
+	
+	int SslSessionTicketKeys::decryptionKey(const unsigned char *name, Key &outKey)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (std::memcmp(name, current.name.data(), current.name.size()) == 0) {
+			outKey = current;
+			return 1;
+		} else if (hasPrevious &&
+				   std::memcmp(name, previous.name.data(), previous.name.size()) == 0) {
+			outKey = previous;
+			return 2;
+		}
+		return 0;
+	}
+	
+	template <class MacContext>
+	int SslSessionTicketKeys::handleTicket(SSL *ssl, unsigned char *keyName, unsigned char *iv,
+										   EVP_CIPHER_CTX *cipherContext, MacContext *macContext,
+										   int encrypt)
+	{
+		auto *keys = static_cast<SslSessionTicketKeys *>
+		(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextDataIndex()));
+		if (keys == nullptr) {
+			return -1;
+		}
+		
+		Key key;
+		int result = 1;
+		if (encrypt) {
+			key = keys->encryptionKey();
+			if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+				return -1;
+			}
+			std::memcpy(keyName, key.name.data(), key.name.size());
+			if (!EVP_EncryptInit_ex(cipherContext, EVP_aes_256_cbc(), nullptr, key.aesKey.data(), iv)) {
+				return -1;
+			}
+		} else {
+			result = keys->decryptionKey(keyName, key);
+			if (result == 0) {
+				// Unknown or expired key; fall back to a full handshake.
+				return 0;
+			}
+#if defined(TLS1_3_VERSION)
+			// TLS 1.3 clients are expected to use each ticket only once, so
+			// a resumed session must be given a new one.
+			if (SSL_version(ssl) >= TLS1_3_VERSION) {
+				result = 2;
+			}
+#endif
+			if (!EVP_DecryptInit_ex(cipherContext, EVP_aes_256_cbc(), nullptr, key.aesKey.data(), iv)) {
+				return -1;
+			}
+		}
+		
+		if (!initMac(macContext, key.hmacKey.data(), key.hmacKey.size())) {
+			return -1;
+		}
+		OPENSSL_cleanse(&key, sizeof(key));
+		return result;
+	}
+}
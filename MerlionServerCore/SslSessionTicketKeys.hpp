@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ssl.hpp>
+
+namespace mcore
+{
+	/** Keys that encrypt TLS session tickets issued by a server.
+	 * A new key is generated every `rotationInterval`. Tickets encrypted
+	 * with the previous key are still accepted, but renewed. */
+	class SslSessionTicketKeys :
+	boost::noncopyable
+	{
+	public:
+		SslSessionTicketKeys(std::chrono::seconds rotationInterval);
+		~SslSessionTicketKeys();
+		
+		/** Makes `context` use these keys. They must outlive the context. */
+		void install(boost::asio::ssl::context&);
+		
+		/** Generates a new key if the current one is older than the rotation interval. */
+		void rotateIfNeeded();
+		
+	private:
+		struct Key
+		{
+			std::array<unsigned char, 16> name;
+			std::array<unsigned char, 32> aesKey;
+			std::array<unsigned char, 32> hmacKey;
+		};
+		
+		std::chrono::seconds const rotationInterval;
+		std::mutex mutex;
+		Key current;
+		Key previous;
+		bool hasPrevious = false;
+		std::chrono::steady_clock::time_point currentCreated;
+		
+		static Key generateKey();
+		static int contextDataIndex();
+		
+		/** Returns the key to encrypt a new ticket with. */
+		Key encryptionKey();
+		
+		/** Finds the key named `name`. Returns 0 if not found, 1 if it is the
+		 * current key, and 2 if the ticket should be renewed. */
+		int decryptionKey(const unsigned char *name, Key& outKey);
+		
+		template <class MacContext>
+		static int handleTicket(SSL *, unsigned char *keyName, unsigned char *iv,
+								EVP_CIPHER_CTX *, MacContext *, int encrypt);
+	};
+}
@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Prefix.pch"
+#include "TimingWheel.hpp"
+
+namespace mcore
+{
+	TimingWheel::TimingWheel(boost::asio::io_service& service,
+							 Duration tickInterval,
+							 std::size_t numSlots):
+	service(service),
+	tickTimer(service),
+	tickInterval(tickInterval),
+	slots(numSlots, nullptr)
+	{
+		tickTimer.expires_from_now(tickInterval);
+		scheduleTick();
+	}
+	
+	TimingWheel::~TimingWheel()
+	{
+		stop();
+	}
+	
+	void TimingWheel::stop()
+	{
+		std::vector<std::function<void()>> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+			tickTimer.cancel();
+			
+			for (auto& head: slots) {
+				while (head) {
+					Timer *timer = head;
+					unlink(*timer);
+					dropped.push_back(std::move(timer->handler));
+					timer->handler = nullptr;
+				}
+			}
+		}
+		// Handlers may own timers, which lock the mutex when destroyed.
+	}
+	
+	std::size_t TimingWheel::numArmed()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return armed;
+	}
+	
+	void TimingWheel::link(Timer& timer)
+	{
+		auto& head = slots[timer.dueTick % slots.size()];
+		timer.prev = nullptr;
+		timer.next = head;
+		if (head)
+			head->prev = &timer;
+		head = &timer;
+		++armed;
+	}
+	
+	void TimingWheel::unlink(Timer& timer)
+	{
+		if (timer.prev) {
+			timer.prev->next = timer.next;
+		} else {
+			slots[timer.dueTick % slots.size()] = timer.next;
+		}
+		if (timer.next)
+			timer.next->prev = timer.prev;
+		timer.prev = timer.next = nullptr;
+		--armed;
+	}
+	
+	void TimingWheel::Timer::expiresFromNow(Duration timeout, std::function<void()> handler)
+	{
+		if (!handler) {
+			cancel();
+			return;
+		}
+		
+		// Round up, and add one for the part of the current tick that has
+		// already passed, so the timer never fires early.
+		auto ticks = (timeout + wheel.tickInterval - Duration(1)) / wheel.tickInterval + 1;
+		
+		std::function<void()> old;
+		{
+			std::lock_guard<std::mutex> lock(wheel.mutex);
+			if (this->handler) {
+				wheel.unlink(*this);
+				old.swap(this->handler);
+			}
+			this->handler = std::move(handler);
+			dueTick = wheel.currentTick + static_cast<std::uint64_t>(ticks);
+			wheel.link(*this);
+		}
+		// `old` may hold the last reference to objects that own timers;
+		// destroy it outside the lock.
+	}
+	
+	void TimingWheel::Timer::cancel()
+	{
+		std::function<void()> old;
+		{
+			std::lock_guard<std::mutex> lock(wheel.mutex);
+			if (!handler)
+				return;
+			wheel.unlink(*this);
+			old.swap(handler);
+		}
+	}
+	
+	void TimingWheel::scheduleTick()
+	{
+		tickTimer.async_wait([this](const boost::system::error_code& error) {
+			if (error)
+				return;
+			tick();
+		});
+	}
+	
+	void TimingWheel::tick()
+	{
+		std::vector<std::function<void()>> expired;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!running)
+				return;
+			
+			++currentTick;
+			
+			// Timers due in later rounds of the wheel share the slot.
+			Timer *timer = slots[currentTick % slots.size()];
+			while (timer) {
+				Timer *next = timer->next;
+				if (timer->dueTick <= currentTick) {
+					unlink(*timer);
+					expired.push_back(std::move(timer->handler));
+					timer->handler = nullptr;
+				}
+				timer = next;
+			}
+			
+			// Advance from the previous deadline so ticks don't drift.
+			tickTimer.expires_at(tickTimer.expires_at() + tickInterval);
+			scheduleTick();
+		}
+		
+		for (auto& handler: expired)
+			service.post(std::move(handler));
+	}
+}
@@ -0,0 +1,92 @@
+/**
+ * Copyright (C) 2014 yvt <i@yvt.jp>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+
+namespace mcore
+{
+	/** Hashed timing wheel for coarse timeouts (e.g. handshake timeouts).
+	 * Arming and cancelling a timer take constant time regardless of the
+	 * number of timers, unlike asio's timer heap. Timers fire up to two
+	 * ticks late. */
+	class TimingWheel :
+	boost::noncopyable
+	{
+	public:
+		using Duration = std::chrono::steady_clock::duration;
+		
+		/** A timeout that can be armed on the wheel. The owner must keep it
+		 * alive while armed, or destroy it (which cancels it). */
+		class Timer :
+		boost::noncopyable
+		{
+			friend class TimingWheel;
+			
+			TimingWheel& wheel;
+			Timer *prev = nullptr;
+			Timer *next = nullptr;
+			std::uint64_t dueTick = 0;
+			std::function<void()> handler;
+			
+		public:
+			explicit Timer(TimingWheel& wheel): wheel(wheel) { }
+			~Timer() { cancel(); }
+			
+			/** Calls `handler` on the I/O service once `timeout` has elapsed.
+			 * Cancels the previous timeout, if any. */
+			void expiresFromNow(Duration timeout, std::function<void()> handler);
+			
+			/** Cancels the timeout. Its handler is destroyed without being
+			 * called. */
+			void cancel();
+		};
+		
+		TimingWheel(boost::asio::io_service& service,
+					Duration tickInterval = std::chrono::milliseconds(100),
+					std::size_t numSlots = 512);
+		~TimingWheel();
+		
+		/** Stops ticking and drops the handlers of armed timers without
+		 * calling them. */
+		void stop();
+		
+		std::size_t numArmed();
+		
+	private:
+		boost::asio::io_service& service;
+		boost::asio::steady_timer tickTimer;
+		Duration const tickInterval;
+		
+		std::mutex mutex;
+		std::vector<Timer *> slots; // heads of doubly-linked lists
+		std::uint64_t currentTick = 0;
+		std::size_t armed = 0;
+		bool running = true;
+		
+		void link(Timer&);
+		void unlink(Timer&);
+		void scheduleTick();
+		void tick();
+	};
+}
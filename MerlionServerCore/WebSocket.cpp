@@ -18,6 +18,8 @@
 #include <boost/archive/iterators/base64_from_binary.hpp>
 #include <boost/archive/iterators/transform_width.hpp>
 #include <boost/archive/iterators/ostream_iterator.hpp>
+#include <climits>
+#include <zlib.h>
 
 namespace asiows
 {
@@ -25,11 +27,195 @@ namespace asiows
 	{
 		namespace
 		{
-			web_socket_server_regex_t web_socket_server_regex_;
+			bool is_http_whitespace(char c)
+			{
+				return c == ' ' || c == '\t' || c == '\r' ||
+				c == '\n' || c == '\v' || c == '\f';
+			}
+			
+			boost::string_ref trim_http(const char *begin, const char *end)
+			{
+				while (begin < end && is_http_whitespace(*begin))
+					++begin;
+				while (end > begin && is_http_whitespace(end[-1]))
+					--end;
+				return boost::string_ref(begin, end - begin);
+			}
+			
+			bool is_digit(char c)
+			{
+				return c >= '0' && c <= '9';
+			}
+			
+			bool is_alnum(char c)
+			{
+				return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+			}
+			
+			// Reads "[0-9]{1,4}".
+			bool read_version_number(const char *&p, const char *end, boost::string_ref& out)
+			{
+				const char *start = p;
+				while (p < end && is_digit(*p) && p - start < 4)
+					++p;
+				out = boost::string_ref(start, p - start);
+				return p > start;
+			}
 		}
-		const web_socket_server_regex_t& web_socket_server_regex()
+		
+		http_request_parser::element http_request_parser::next(const char *&begin, const char *end)
 		{
-			return web_socket_server_regex_;
+			while (true) {
+				// Find CRLF.
+				const char *line_end = nullptr;
+				const char *p = begin + scanned_;
+				while (p < end) {
+					auto *lf = static_cast<const char *>(std::memchr(p, '\n', end - p));
+					if (!lf)
+						break;
+					if (lf > begin && lf[-1] == '\r') {
+						line_end = lf - 1;
+						break;
+					}
+					p = lf + 1;
+				}
+				
+				if (!line_end) {
+					// Keep one byte in case it's CR.
+					std::size_t scanned = end - begin;
+					scanned_ = scanned > 0 ? scanned - 1 : 0;
+					return element::need_more;
+				}
+				
+				const char *line_begin = begin;
+				begin = line_end + 2;
+				scanned_ = 0;
+				
+				if (!request_line_read_) {
+					request_line_read_ = true;
+					return parse_request_line(line_begin, line_end);
+				} else if (line_begin == line_end) {
+					return element::end;
+				} else {
+					return parse_header(line_begin, line_end);
+				}
+			}
+		}
+		
+		http_request_parser::element http_request_parser::parse_request_line(const char *begin, const char *end)
+		{
+			status = static_cast<int>(http_status_codes::bad_request);
+			
+			// Method
+			const char *p = static_cast<const char *>(std::memchr(begin, ' ', end - begin));
+			if (!p)
+				return element::error;
+			method = boost::string_ref(begin, p - begin);
+			{
+				static const char * const methods[] = {
+					"OPTIONS", "GET", "HEAD", "POST", "PUT", "DELETE", "TRACE", "CONNECT"
+				};
+				bool found = false;
+				for (const char *m: methods) {
+					if (boost::iequals(method, m)) {
+						found = true;
+						break;
+					}
+				}
+				if (!found)
+					return element::error;
+			}
+			const char *uri_begin = p + 1;
+			
+			// HTTP-Version
+			const char *uri_end = end;
+			while (uri_end > uri_begin && uri_end[-1] != ' ')
+				--uri_end;
+			if (uri_end == uri_begin)
+				return element::error;
+			p = uri_end;
+			--uri_end;
+			if (end - p < 5 || !boost::iequals(boost::string_ref(p, 5), "HTTP/"))
+				return element::error;
+			p += 5;
+			if (!read_version_number(p, end, version_major))
+				return element::error;
+			if (p == end || *p != '.')
+				return element::error;
+			++p;
+			if (!read_version_number(p, end, version_minor) || p != end)
+				return element::error;
+			
+			// Request-URI ("authority" format is not accepted)
+			request_uri = boost::string_ref(uri_begin, uri_end - uri_begin);
+			if (request_uri == "*") {
+				abs_path = boost::string_ref();
+			} else {
+				p = uri_begin;
+				if (p < uri_end && *p != '/') {
+					// absoluteURI: [a-z0-9]+:/*[^/]+ followed by abs_path
+					while (p < uri_end && is_alnum(*p))
+						++p;
+					if (p == uri_begin || p == uri_end || *p != ':')
+						return element::error;
+					++p;
+					while (p < uri_end && *p == '/')
+						++p;
+					const char *authority = p;
+					while (p < uri_end && *p != '/')
+						++p;
+					if (p == authority)
+						return element::error;
+				}
+				if (p == uri_end || *p != '/' ||
+					std::memchr(p, ' ', uri_end - p))
+					return element::error;
+				abs_path = boost::string_ref(p, uri_end - p);
+			}
+			
+			status = 0;
+			return element::request_line;
+		}
+		
+		http_request_parser::element http_request_parser::parse_header(const char *begin, const char *end)
+		{
+			// Make sure there's no line continuation.
+			// (If header contains a quoted-string, it might span
+			//  across the lines. Might be HTTP injection attack.)
+			bool quot = false;
+			for (const char *p = begin; p < end; ) {
+				if (quot) {
+					if (*p == '"') {
+						quot = false;
+						++p;
+					} else if (*p == '\\') {
+						p += 2;
+					} else {
+						++p;
+					}
+				} else {
+					if (*p == '"') {
+						quot = true;
+					}
+					++p;
+				}
+			}
+			
+			if (quot) {
+				// quoted-string spanning across the lines.
+				status = static_cast<int>(http_status_codes::not_implemented);
+				return element::error;
+			}
+			
+			auto *colon = static_cast<const char *>(std::memchr(begin, ':', end - begin));
+			if (colon) {
+				name = trim_http(begin, colon);
+				value = trim_http(colon + 1, end);
+			} else {
+				// No colon; the whole line serves as both the name and the value.
+				name = value = trim_http(begin, end);
+			}
+			return element::header;
 		}
 		
 		using namespace boost::archive;
@@ -67,6 +253,329 @@ namespace asiows
 			
 			return j;
 		}
+		
+		namespace
+		{
+			// Splits <s> at <delim> except in quoted-strings.
+			std::vector<std::string> split_header_value(const std::string& s, char delim)
+			{
+				std::vector<std::string> parts(1);
+				bool quoted = false, escaped = false;
+				for (char c: s) {
+					if (escaped) {
+						escaped = false;
+					} else if (quoted && c == '\\') {
+						escaped = true;
+					} else if (c == '"') {
+						quoted = !quoted;
+					} else if (!quoted && c == delim) {
+						parts.emplace_back();
+						continue;
+					}
+					parts.back() += c;
+				}
+				return parts;
+			}
+			
+			std::string unquote(std::string s)
+			{
+				boost::trim(s);
+				if (s.size() >= 2 && s.front() == '"' && s.back() == '"') {
+					std::string ret;
+					bool escaped = false;
+					for (std::size_t i = 1; i + 1 < s.size(); ++i) {
+						if (!escaped && s[i] == '\\') {
+							escaped = true;
+							continue;
+						}
+						escaped = false;
+						ret += s[i];
+					}
+					return ret;
+				}
+				return s;
+			}
+			
+			// Parses the value of *_max_window_bits. [RFC 7692 7.1.2]
+			bool parse_window_bits(const std::string& value, int& bits)
+			{
+				if (value.empty() || value.size() > 2 || value[0] == '0')
+					return false;
+				bits = 0;
+				for (char c: value) {
+					if (c < '0' || c > '9')
+						return false;
+					bits = bits * 10 + (c - '0');
+				}
+				return bits >= 8 && bits <= 15;
+			}
+		}
+		
+		boost::optional<web_socket_deflate_params>
+		negotiate_web_socket_deflate(const std::string& offers,
+									 const web_socket_deflate_options& options,
+									 std::string& response)
+		{
+			response.clear();
+			if (!options.enabled || offers.empty())
+				return boost::none;
+			
+			for (const auto& offer: split_header_value(offers, ',')) {
+				auto params = split_header_value(offer, ';');
+				if (!boost::iequals(boost::trim_copy(params[0]), "permessage-deflate"))
+					continue;
+				
+				bool valid = true;
+				bool serverNoContextTakeover = false, clientNoContextTakeover = false;
+				boost::optional<int> serverMaxWindowBits, clientMaxWindowBits;
+				bool clientMaxWindowBitsSupported = false;
+				
+				for (std::size_t i = 1; i < params.size() && valid; ++i) {
+					const auto& param = params[i];
+					auto index = param.find('=');
+					auto name = boost::trim_copy(param.substr(0, index));
+					boost::optional<std::string> value;
+					if (index != std::string::npos)
+						value = unquote(param.substr(index + 1));
+					
+					// Each parameter must not appear more than once. [RFC 7692 7]
+					if (name == "server_no_context_takeover") {
+						valid = !value && !serverNoContextTakeover;
+						serverNoContextTakeover = true;
+					} else if (name == "client_no_context_takeover") {
+						valid = !value && !clientNoContextTakeover;
+						clientNoContextTakeover = true;
+					} else if (name == "server_max_window_bits") {
+						int bits;
+						valid = value && !serverMaxWindowBits && parse_window_bits(*value, bits);
+						serverMaxWindowBits = bits;
+					} else if (name == "client_max_window_bits") {
+						int bits = 15;
+						valid = !clientMaxWindowBitsSupported &&
+						(!value || parse_window_bits(*value, bits));
+						clientMaxWindowBitsSupported = true;
+						clientMaxWindowBits = bits;
+					} else {
+						valid = false;
+					}
+				}
+				
+				// zlib cannot compress with a 256-byte window.
+				if (!valid || (serverMaxWindowBits && *serverMaxWindowBits < 9))
+					continue;
+				
+				web_socket_deflate_params result;
+				result.deflate_window_bits = std::min(options.server_max_window_bits,
+													  serverMaxWindowBits.value_or(15));
+				result.deflate_no_context_takeover = serverNoContextTakeover ||
+				options.server_no_context_takeover;
+				result.inflate_no_context_takeover = clientNoContextTakeover ||
+				options.client_no_context_takeover;
+				result.level = options.level;
+				result.mem_level = options.mem_level;
+				result.min_message_size = options.min_message_size;
+				result.max_inflated_message_size = options.max_inflated_message_size;
+				
+				std::ostringstream s;
+				s << "permessage-deflate";
+				if (result.deflate_no_context_takeover)
+					s << "; server_no_context_takeover";
+				if (result.inflate_no_context_takeover)
+					s << "; client_no_context_takeover";
+				if (serverMaxWindowBits || result.deflate_window_bits < 15)
+					s << "; server_max_window_bits=" << result.deflate_window_bits;
+				if (clientMaxWindowBitsSupported) {
+					int bits = std::min(options.client_max_window_bits, *clientMaxWindowBits);
+					s << "; client_max_window_bits=" << bits;
+					// Some zlib-based clients use 9 when asked for 8.
+					result.inflate_window_bits = std::max(bits, 9);
+				} else {
+					result.inflate_window_bits = 15;
+				}
+				
+				response = s.str();
+				return result;
+			}
+			
+			return boost::none;
+		}
+		
+		web_socket_deflater::web_socket_deflater(const web_socket_deflate_params& params):
+		params_(params)
+		{ }
+		
+		web_socket_deflater::~web_socket_deflater()
+		{
+			if (stream_)
+				deflateEnd(stream_.get());
+		}
+		
+		void web_socket_deflater::init()
+		{
+			std::unique_ptr<z_stream_s> stream(new z_stream_s());
+			if (deflateInit2(stream.get(), params_.level, Z_DEFLATED,
+							 -params_.deflate_window_bits, params_.mem_level,
+							 Z_DEFAULT_STRATEGY) != Z_OK) {
+				throw std::bad_alloc();
+			}
+			stream_ = std::move(stream);
+		}
+		
+		std::size_t web_socket_deflater::write(const void *in, std::size_t in_len,
+											   void *out, std::size_t out_len,
+											   std::size_t& produced)
+		{
+			produced = 0;
+			if (in_len == 0 || out_len == 0)
+				return 0;
+			if (!stream_)
+				init();
+			
+			auto& s = *stream_;
+			s.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(in));
+			s.avail_in = static_cast<uInt>(std::min<std::size_t>(in_len, UINT_MAX));
+			s.next_out = reinterpret_cast<Bytef *>(out);
+			s.avail_out = static_cast<uInt>(std::min<std::size_t>(out_len, UINT_MAX));
+			auto availIn = s.avail_in, availOut = s.avail_out;
+			
+			deflate(&s, Z_NO_FLUSH);
+			
+			produced = availOut - s.avail_out;
+			std::size_t consumed = availIn - s.avail_in;
+			if (consumed > 0)
+				message_empty_ = false;
+			return consumed;
+		}
+		
+		bool web_socket_deflater::flush(void *out, std::size_t out_len, std::size_t& produced)
+		{
+			produced = 0;
+			if (message_empty_) {
+				// Empty message is sent as a single 0x00. [RFC 7692 7.2.1]
+				static const char emptyMessage[] = { 0x00, 0x00, 0x00, '\xff', '\xff' };
+				if (out_len < sizeof(emptyMessage))
+					return false;
+				std::memcpy(out, emptyMessage, sizeof(emptyMessage));
+				produced = sizeof(emptyMessage);
+				return true;
+			}
+			if (out_len == 0)
+				return false;
+			
+			auto& s = *stream_;
+			s.next_in = nullptr;
+			s.avail_in = 0;
+			s.next_out = reinterpret_cast<Bytef *>(out);
+			s.avail_out = static_cast<uInt>(std::min<std::size_t>(out_len, UINT_MAX));
+			auto availOut = s.avail_out;
+			
+			int ret = deflate(&s, Z_SYNC_FLUSH);
+			
+			produced = availOut - s.avail_out;
+			
+			// When the output space ran out, zlib might have more to write.
+			return ret == Z_BUF_ERROR || s.avail_out > 0;
+		}
+		
+		void web_socket_deflater::end_message()
+		{
+			message_empty_ = true;
+			if (params_.deflate_no_context_takeover && stream_) {
+				deflateEnd(stream_.get());
+				stream_.reset();
+			}
+		}
+		
+		web_socket_inflater::web_socket_inflater(const web_socket_deflate_params& params):
+		params_(params)
+		{ }
+		
+		web_socket_inflater::~web_socket_inflater()
+		{
+			if (stream_)
+				inflateEnd(stream_.get());
+		}
+		
+		void web_socket_inflater::init()
+		{
+			std::unique_ptr<z_stream_s> stream(new z_stream_s());
+			if (inflateInit2(stream.get(), -params_.inflate_window_bits) != Z_OK) {
+				throw std::bad_alloc();
+			}
+			stream_ = std::move(stream);
+			input_.resize(4096);
+		}
+		
+		_asio::mutable_buffers_1 web_socket_inflater::input_buffer()
+		{
+			if (!stream_)
+				init();
+			assert(stream_->avail_in == 0);
+			return _asio::buffer(input_.data(), input_.size());
+		}
+		
+		void web_socket_inflater::commit_input(std::size_t count)
+		{
+			assert(stream_);
+			stream_->next_in = reinterpret_cast<Bytef *>(input_.data());
+			stream_->avail_in = static_cast<uInt>(count);
+		}
+		
+		void web_socket_inflater::finish_input()
+		{
+			static const char tail[] = { 0x00, 0x00, '\xff', '\xff' };
+			if (!stream_)
+				init();
+			stream_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(tail));
+			stream_->avail_in = sizeof(tail);
+			input_finished_ = true;
+		}
+		
+		std::size_t web_socket_inflater::read(void *out, std::size_t out_len,
+											  boost::system::error_code& ec)
+		{
+			if (!stream_ || out_len == 0)
+				return 0;
+			
+			auto& s = *stream_;
+			s.next_out = reinterpret_cast<Bytef *>(out);
+			s.avail_out = static_cast<uInt>(std::min<std::size_t>(out_len, UINT_MAX));
+			auto availOut = s.avail_out;
+			
+			while (true) {
+				int ret = inflate(&s, Z_SYNC_FLUSH);
+				if (ret == Z_STREAM_END) {
+					// The sender ended the DEFLATE stream with BFINAL.
+					// Following data starts a new one. [RFC 7692 7.2.3.4]
+					inflateReset(&s);
+					if (s.avail_in > 0 && s.avail_out > 0)
+						continue;
+				} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+					ec = make_error_code(boost::system::errc::protocol_error);
+					return 0;
+				}
+				break;
+			}
+			
+			std::size_t produced = availOut - s.avail_out;
+			message_size_ += produced;
+			if (params_.max_inflated_message_size != 0 &&
+				message_size_ > params_.max_inflated_message_size) {
+				ec = make_error_code(boost::system::errc::message_size);
+				return 0;
+			}
+			return produced;
+		}
+		
+		void web_socket_inflater::end_message()
+		{
+			input_finished_ = false;
+			message_size_ = 0;
+			if (params_.inflate_no_context_takeover && stream_) {
+				inflateEnd(stream_.get());
+				stream_.reset();
+			}
+		}
 	}
 	const char *http_status_text(int status)
 	{
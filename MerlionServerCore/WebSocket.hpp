@@ -20,7 +20,6 @@
 #include <boost/algorithm/string.hpp>
 #include <list>
 #include <unordered_map>
-#include <regex>
 #include <boost/uuid/sha1.hpp>
 #include <boost/detail/endian.hpp>
 #include <boost/predef/other/endian.h>
@@ -28,10 +27,15 @@
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/optional.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <istream>
 #include <ostream>
 #include <sstream>
+#include <memory>
+#include <vector>
+
+struct z_stream_s;
 
 namespace asiows
 {
@@ -388,6 +392,65 @@ namespace asiows
 		}
 	};
 	
+	// Largest possible size of an encoded frame header.
+	static constexpr std::size_t web_socket_frame_header_max_size = 14;
+	
+	// Computes the number of bytes <encode_web_socket_frame_header> writes.
+	static inline std::size_t web_socket_frame_header_size(const web_socket_frame_header& hdr)
+	{
+		std::size_t headerSize = 2;
+		if (hdr.masking_key) {
+			headerSize += 4;
+		}
+		if (hdr.payload_length > 65535) {
+			headerSize += 8;
+		} else if (hdr.payload_length >= 126) {
+			headerSize += 2;
+		}
+		return headerSize;
+	}
+	
+	// Encodes a frame header to <data>, which must have room for
+	// <web_socket_frame_header_size> bytes.
+	// Returns the number of bytes written.
+	static inline std::size_t encode_web_socket_frame_header(const web_socket_frame_header& hdr, char *data)
+	{
+		char *start = data;
+		
+		// FIXME: unaligned memory access possible
+		std::uint16_t prologue = 0;
+		if (hdr.fin) prologue |= 0x8000;
+		if (hdr.reserved1) prologue |= 0x4000;
+		if (hdr.reserved2) prologue |= 0x2000;
+		if (hdr.reserved3) prologue |= 0x1000;
+		prologue |= static_cast<std::uint16_t>(hdr.opcode) << 8;
+		if (hdr.masking_key) prologue |= 0x80;
+		if (hdr.payload_length > 65535) {
+			prologue |= 127;
+		} else if (hdr.payload_length >= 126) {
+			prologue |= 126;
+		} else {
+			prologue |= static_cast<std::uint16_t>(hdr.payload_length);
+		}
+		*reinterpret_cast<std::uint16_t *>(data) = detail::host_to_network(prologue);
+		data += 2;
+		
+		if (hdr.payload_length > 65535) {
+			*reinterpret_cast<std::uint64_t *>(data) = detail::host_to_network(hdr.payload_length);
+			data += 8;
+		} else if (hdr.payload_length >= 126) {
+			*reinterpret_cast<std::uint16_t *>(data) = detail::host_to_network(static_cast<std::uint16_t>(hdr.payload_length));
+			data += 2;
+		}
+		
+		if (hdr.masking_key) {
+			*reinterpret_cast<std::uint32_t *>(data) = *hdr.masking_key;
+			data += 4;
+		}
+		
+		return static_cast<std::size_t>(data - start);
+	}
+	
 	template <class NextLayer>
 	class web_socket_frame_reader
 	{
@@ -692,6 +755,128 @@ namespace asiows
 		};
 	}
 	
+	// Parameters of the permessage-deflate extension [RFC 7692] in effect
+	// on a <web_socket>, as seen from the socket's side.
+	struct web_socket_deflate_params
+	{
+		// LZ77 window size used to compress sent messages. (9 - 15)
+		int deflate_window_bits = 15;
+		// Compress each sent message independently.
+		bool deflate_no_context_takeover = false;
+		// LZ77 window size used to decompress received messages. (9 - 15)
+		int inflate_window_bits = 15;
+		// The peer compresses each message independently.
+		bool inflate_no_context_takeover = false;
+		
+		// zlib compression level. (1 - 9)
+		int level = 1;
+		// zlib memory level. (1 - 9)
+		int mem_level = 8;
+		
+		// Messages sent by <web_socket::async_send_message> smaller than this
+		// are sent uncompressed.
+		std::size_t min_message_size = 64;
+		// Received messages inflated to more than this fail the connection.
+		// Zero means no limit.
+		std::uint64_t max_inflated_message_size = 0;
+	};
+	
+	// Server-side policy of negotiating permessage-deflate.
+	// A compressing socket holds about 2^(window bits + 2) + 2^(memory level + 9)
+	// bytes and a decompressing socket 2^(window bits) bytes of zlib state,
+	// so the window sizes and the memory level bound the memory per socket.
+	struct web_socket_deflate_options
+	{
+		bool enabled = false;
+		
+		// Largest LZ77 window size the server compresses with. (9 - 15)
+		int server_max_window_bits = 15;
+		// Largest LZ77 window size requested to the client. (9 - 15)
+		// Clients which do not support the client_max_window_bits parameter
+		// still use up to 15.
+		int client_max_window_bits = 15;
+		
+		// Request both sides to compress each message independently.
+		// Compression state is then released after each message.
+		bool server_no_context_takeover = false;
+		bool client_no_context_takeover = false;
+		
+		int level = 1;
+		int mem_level = 8;
+		std::size_t min_message_size = 64;
+		std::uint64_t max_inflated_message_size = 0;
+	};
+	
+	namespace detail
+	{
+		// Picks the first acceptable permessage-deflate offer in the value of
+		// Sec-WebSocket-Extensions, and stores the response to <response>.
+		boost::optional<web_socket_deflate_params>
+		negotiate_web_socket_deflate(const std::string& offers,
+									 const web_socket_deflate_options& options,
+									 std::string& response);
+		
+		// Compresses sent messages. zlib state is allocated on the first use.
+		class web_socket_deflater
+		{
+			web_socket_deflate_params params_;
+			std::unique_ptr<z_stream_s> stream_;
+			bool message_empty_ = true;
+			
+			void init();
+		
+		public:
+			explicit web_socket_deflater(const web_socket_deflate_params&);
+			~web_socket_deflater();
+			
+			// Compresses as much of <in> as possible into <out>.
+			// Returns the number of consumed bytes and stores the number of
+			// produced bytes to <produced>.
+			std::size_t write(const void *in, std::size_t in_len,
+							  void *out, std::size_t out_len, std::size_t& produced);
+			
+			// Flushes the current message. Returns false when <out> is full
+			// and this has to be called again with a new buffer.
+			// The output always ends with 0x00 0x00 0xff 0xff, which must be
+			// removed by the caller. [RFC 7692 7.2.1]
+			bool flush(void *out, std::size_t out_len, std::size_t& produced);
+			
+			void end_message();
+		};
+		
+		// Decompresses received messages. zlib state is allocated on the
+		// first use.
+		class web_socket_inflater
+		{
+			web_socket_deflate_params params_;
+			std::unique_ptr<z_stream_s> stream_;
+			std::vector<char> input_;
+			bool input_finished_ = false;
+			std::uint64_t message_size_ = 0;
+			
+			void init();
+		
+		public:
+			explicit web_socket_inflater(const web_socket_deflate_params&);
+			~web_socket_inflater();
+			
+			// Buffer to read the compressed payload into. Only valid when
+			// <read> has consumed all of the previous input.
+			_asio::mutable_buffers_1 input_buffer();
+			void commit_input(std::size_t);
+			
+			// Appends 0x00 0x00 0xff 0xff removed by the sender. [RFC 7692 7.2.2]
+			void finish_input();
+			bool input_finished() const { return input_finished_; }
+			
+			// Decompresses as much as possible into <out>. Returns zero when
+			// more input is needed.
+			std::size_t read(void *out, std::size_t out_len, boost::system::error_code&);
+			
+			void end_message();
+		};
+	}
+	
 	// An asynchronous WebSocket implementation.
 	template <class NextLayer>
 	class web_socket
@@ -747,6 +932,9 @@ namespace asiows
 		template <class MutableBufferSequence, class Callback>
 		class receive_message_continuation_op;
 		
+		template <class MutableBufferSequence, class Callback>
+		class inflate_some_op;
+		
 		template <class Callback>
 		class handle_control_frame_op;
 		
@@ -762,6 +950,11 @@ namespace asiows
 		web_socket_message_header sent_message_header_;
 		bool sending_final_frame_ = false;
 		bool sending_first_frame_ = false;
+		bool sending_compressed_ = false;
+		
+		// Number of bytes at the end of <write_buffer_> held back for the
+		// next frame. (computed by async_send_frame)
+		std::size_t write_buffer_carry_ = 0;
 		std::function<boost::optional<std::uint32_t>()> masking_key_provider;
 		
 		// Largest possible frame header size.
@@ -795,6 +988,34 @@ namespace asiows
 			});
 		}
 		
+		// Marks the current message as written and starts the next queued writer.
+		void end_message_write()
+		{
+			write_state_ = write_state_t::not_writing;
+			if (!write_queue.empty()) {
+				auto fn = std::move(write_queue.front());
+				write_queue.pop_front();
+				fn();
+			}
+		}
+		
+		// Terrible failure. We might not even be able to send the Close frame.
+		void frame_write_failed()
+		{
+			switch (state_) {
+				case state_t::closing_active:
+				case state_t::closing_active_sent_close:
+				case state_t::closing_passive:
+				case state_t::closing_sending_close:
+				case state_t::connected:
+					state_ = state_t::closed;
+					close_done(boost::system::error_code());
+					break;
+				case state_t::closed:
+					break;
+			}
+		}
+		
 		template <class Callback>
 		class end_write_op;
 		
@@ -810,6 +1031,9 @@ namespace asiows
 		template <class ConstBufferSequence, class Callback>
 		class send_message_op;
 		
+		template <class ConstBufferSequence, class Callback>
+		class send_encoded_message_op;
+		
 		/* --- Handling Ping --- */
 		boost::optional<std::string> pending_pong;
 		
@@ -842,6 +1066,11 @@ namespace asiows
 		template <class Callback>
 		class ping_op;
 		
+		/* --- Compression --- */
+		boost::optional<web_socket_deflate_params> deflate_params_;
+		std::unique_ptr<detail::web_socket_deflater> deflater_;
+		std::unique_ptr<detail::web_socket_inflater> inflater_;
+		
 		/* --- Connection Closure --- */
 		web_socket_close_mode close_mode_ = web_socket_close_mode::not_closed;
 		std::uint16_t close_status_code_ = web_socket_close_status_codes::no_status_code;
@@ -893,6 +1122,17 @@ namespace asiows
 		void set_masking_key_provider(std::function<boost::optional<std::uint32_t>()> fn)
 		{ masking_key_provider = fn; }
 		
+		// Enables permessage-deflate with the negotiated parameters.
+		// Must be called before any message is sent or received.
+		void set_deflate_params(const web_socket_deflate_params& params)
+		{
+			deflate_params_ = params;
+			deflater_.reset(new detail::web_socket_deflater(params));
+			inflater_.reset(new detail::web_socket_inflater(params));
+		}
+		
+		bool deflate_enabled() const { return deflate_params_.is_initialized(); }
+		
 		next_layer_type& next_layer() { return next_; }
 		lowest_layer_type& lowest_layer() { return next_layer().lowest_layer(); }
 		
@@ -927,6 +1167,9 @@ namespace asiows
 		void async_read_some(MutableBufferSequence&&, Callback&&);
 		
 		// Starts sending a message to the peer.
+		// When permessage-deflate is enabled, the message is compressed if
+		// <web_socket_message_header::reserved1> is set. Otherwise, the bit
+		// is cleared.
 		template <class Callback>
 		void async_begin_write(const web_socket_message_header &, Callback&&);
 		
@@ -948,6 +1191,15 @@ namespace asiows
 		template <class ConstBufferSequence, class Callback>
 		void async_send_message(const web_socket_message_header &, ConstBufferSequence&&, Callback&&);
 		
+		// Sends messages which are already encoded as complete frames,
+		// including their headers (see <encode_web_socket_frame_header>).
+		// The frames are written to the next layer as they are, so the same
+		// encoded frames can be shared by many <web_socket>s.
+		// The actual buffer pointed by <ConstBufferSequence> must
+		// remain valid until the callback is called.
+		template <class ConstBufferSequence, class Callback>
+		void async_send_encoded_message(ConstBufferSequence&&, Callback&&);
+		
 		// Sends a Ping.
 		// Callback will be called when <web_socket> receives
 		// Pong, or an error occured.
@@ -1019,6 +1271,13 @@ namespace asiows
 			
 			
 			const web_socket_frame_header& hdr = parent.reader.header();
+			if (hdr.reserved1 && (!parent.inflater_ || is_control_frame(hdr.opcode))) {
+				// RSV1 is only meaningful on the first frame of a message
+				// when permessage-deflate is in use. [RFC 7692 6]
+				parent.reader.fail();
+				(*this)(make_error_code(boost::system::errc::protocol_error));
+				return;
+			}
 			if (!is_control_frame(hdr.opcode)) {
 				// Message found.
 				parent.last_message_header_ = hdr;
@@ -1176,6 +1435,11 @@ namespace asiows
 			
 			
 			const web_socket_frame_header& hdr = parent.reader.header();
+			if (hdr.reserved1) {
+				parent.reader.fail();
+				(*this)(make_error_code(boost::system::errc::protocol_error));
+				return;
+			}
 			if (!is_control_frame(hdr.opcode)) {
 				// Message found.
 				// Continue reading.
@@ -1206,6 +1470,15 @@ namespace asiows
 			return;
 		}
 		
+		if (last_message_header_.reserved1) {
+			inflate_some_op<
+			typename std::remove_reference<MutableBufferSequence>::type,
+			typename std::remove_reference<Callback>::type>
+			op(*this, std::forward<MutableBufferSequence>(buffers), std::forward<Callback>(callback));
+			op.perform();
+			return;
+		}
+		
 		if (reader.remaining_bytes() == 0) {
 			if (reader.header().fin) {
 				// This is the final part of the message.
@@ -1225,6 +1498,84 @@ namespace asiows
 		}
 	}
 	
+	template <class NextLayer>
+	template <class MutableBufferSequence, class Callback>
+	class web_socket<NextLayer>::inflate_some_op: public detail::intermediate_op<Callback>
+	{
+		web_socket& parent;
+		MutableBufferSequence seq;
+	public:
+		template <class MutableBufferSequenceArg>
+		inflate_some_op(web_socket &parent, MutableBufferSequenceArg&& seq, const Callback& cb):
+		detail::intermediate_op<Callback>(cb),
+		parent(parent),
+		seq(std::forward<MutableBufferSequenceArg>(seq)) { }
+		template <class MutableBufferSequenceArg>
+		inflate_some_op(web_socket &parent, MutableBufferSequenceArg&& seq, Callback&& cb):
+		detail::intermediate_op<Callback>(cb),
+		parent(parent),
+		seq(std::forward<MutableBufferSequenceArg>(seq)) { }
+		
+		void operator () (const boost::system::error_code& ec, std::size_t count)
+		{
+			if (ec) {
+				parent.read_state_ = read_state_t::not_reading;
+				this->callback(ec, 0);
+				return;
+			}
+			
+			parent.inflater_->commit_input(count);
+			perform();
+		}
+		
+		void perform()
+		{
+			auto& inflater = *parent.inflater_;
+			boost::system::error_code ec;
+			std::size_t count = 0;
+			
+			for (auto it = seq.begin(); it != seq.end(); ++it) {
+				const auto& buffer = *it;
+				auto size = _asio::buffer_size(buffer);
+				auto *data = _asio::buffer_cast<char *>(buffer);
+				auto inflated = inflater.read(data, size, ec);
+				count += inflated;
+				if (ec || inflated < size)
+					break;
+			}
+			
+			if (ec) {
+				parent.reader.fail();
+				parent.read_state_ = read_state_t::not_reading;
+				this->callback(ec, 0);
+				return;
+			}
+			
+			if (count > 0) {
+				this->callback(ec, count);
+				return;
+			}
+			
+			// Inflater needs more input.
+			if (parent.reader.remaining_bytes() > 0) {
+				parent.reader.async_read_some(inflater.input_buffer(), std::move(*this));
+			} else if (!parent.reader.header().fin) {
+				// Compressed data continues in the next frame.
+				receive_message_continuation_op<MutableBufferSequence, Callback>
+				op(parent, std::move(seq), std::move(this->callback));
+				op.perform();
+			} else if (!inflater.input_finished()) {
+				inflater.finish_input();
+				perform();
+			} else {
+				// This is the final part of the message.
+				inflater.end_message();
+				parent.read_state_ = read_state_t::not_reading;
+				this->callback(ec, 0);
+			}
+		}
+	};
+	
 	template <class NextLayer>
 	template <class Callback>
 	class web_socket<NextLayer>::handle_control_frame_op :
@@ -1360,6 +1711,9 @@ namespace asiows
 			write_state_ = write_state_t::writing_message;
 			sending_final_frame_ = false;
 			sending_first_frame_ = true;
+			sending_compressed_ = header.reserved1 && deflater_ &&
+			!is_control_frame(header.opcode);
+			sent_message_header_.reserved1 = sending_compressed_;
 			
 			cb(boost::system::error_code());
 		} else {
@@ -1430,6 +1784,40 @@ namespace asiows
 			return;
 		}
 		
+		if (sending_compressed_) {
+			// Compress into the internal buffer.
+			std::size_t consumed = 0;
+			for (auto it = buffers.begin(); it != buffers.end() &&
+				 write_buffer_pos_ < write_buffer_.size(); ++it) {
+				const auto& buffer = *it;
+				auto chunkSize = boost::asio::buffer_size(buffer);
+				const auto *data = boost::asio::buffer_cast<const void *>(buffer);
+				
+				std::size_t produced;
+				auto writtenSize = deflater_->write(data, chunkSize,
+													write_buffer_.data() + write_buffer_pos_,
+													write_buffer_.size() - write_buffer_pos_,
+													produced);
+				write_buffer_pos_ += produced;
+				consumed += writtenSize;
+				if (writtenSize < chunkSize)
+					break;
+			}
+			
+			if (consumed == 0) {
+				// Compressed data fills the buffer.
+				send_buffer_full_op<
+				typename std::remove_reference<ConstBufferSequence>::type,
+				typename std::remove_reference<Callback>::type>
+				op(*this, std::forward<ConstBufferSequence>(buffers), std::forward<Callback>(cb));
+				op.perform();
+				return;
+			}
+			
+			cb(boost::system::error_code(), consumed);
+			return;
+		}
+		
 		// Copy to the internal buffer.
 		auto it = buffers.begin();
 		const std::size_t initialPos = write_buffer_pos_;
@@ -1476,20 +1864,31 @@ namespace asiows
 		
 		void operator () (const boost::system::error_code& ec)
 		{
-			
-			// Check write queue
-			parent.write_state_ = write_state_t::not_writing;
-			if (!parent.write_queue.empty()) {
-				auto fn = std::move(parent.write_queue.front());
-				parent.write_queue.pop_front();
-				fn();
+			if (!ec && !parent.sending_final_frame_) {
+				// Compressed data didn't fit in one frame.
+				perform();
+				return;
 			}
-			
+			parent.end_message_write();
 			this->callback(ec);
 		}
 		
 		void perform()
 		{
+			if (parent.sending_compressed_) {
+				std::size_t produced;
+				bool done = parent.deflater_->flush(parent.write_buffer_.data() + parent.write_buffer_pos_,
+													parent.write_buffer_.size() - parent.write_buffer_pos_,
+													produced);
+				parent.write_buffer_pos_ += produced;
+				if (done) {
+					// Remove 0x00 0x00 0xff 0xff. [RFC 7692 7.2.1]
+					assert(parent.write_buffer_pos_ >= parent.write_buffer_start_pos + 4);
+					parent.write_buffer_pos_ -= 4;
+					parent.deflater_->end_message();
+				}
+				parent.sending_final_frame_ = done;
+			}
 			parent.async_send_frame(std::move(*this));
 		}
 	};
@@ -1528,21 +1927,9 @@ namespace asiows
 		
 		void operator () (const boost::system::error_code& ec, std::size_t count)
 		{
-			if (ec || count != parent.write_buffer_pos_ - parent.write_buffer_real_start_pos) {
-				// Terrible failure. We might not even be able to send the Close frame.
-				
-				switch (parent.state_) {
-					case state_t::closing_active:
-					case state_t::closing_active_sent_close:
-					case state_t::closing_passive:
-					case state_t::closing_sending_close:
-					case state_t::connected:
-						parent.state_ = state_t::closed;
-						parent.close_done(boost::system::error_code());
-						break;
-					case state_t::closed:
-						break;
-				}
+			if (ec || count != parent.write_buffer_pos_ - parent.write_buffer_carry_ -
+				parent.write_buffer_real_start_pos) {
+				parent.frame_write_failed();
 				
 				if (ec)
 					this->callback(ec);
@@ -1553,16 +1940,20 @@ namespace asiows
 			}
 			
 			// Succeeded.
-			parent.write_buffer_pos_ = parent.write_buffer_start_pos;
+			auto carry = parent.write_buffer_carry_;
+			std::memmove(parent.write_buffer_.data() + parent.write_buffer_start_pos,
+						 parent.write_buffer_.data() + parent.write_buffer_pos_ - carry, carry);
+			parent.write_buffer_pos_ = parent.write_buffer_start_pos + carry;
 			this->callback(ec);
 		}
 		
 		void perform()
 		{
-			assert(parent.write_buffer_pos_ >= parent.write_buffer_real_start_pos);
+			assert(parent.write_buffer_pos_ >= parent.write_buffer_real_start_pos + parent.write_buffer_carry_);
 			_asio::async_write(parent.next_layer(),
 							   _asio::buffer(parent.write_buffer_.data() + parent.write_buffer_real_start_pos,
-											 parent.write_buffer_pos_ - parent.write_buffer_real_start_pos),
+											 parent.write_buffer_pos_ - parent.write_buffer_carry_ -
+											 parent.write_buffer_real_start_pos),
 							   std::move(*this));
 		}
 	};
@@ -1586,69 +1977,39 @@ namespace asiows
 			masker = boost::none;
 		}
 		
+		// The end of a compressed message is removed when the message is
+		// done, so hold back as much as that from non-final frames.
+		std::size_t payloadSize = write_buffer_pos_ - write_buffer_start_pos;
+		write_buffer_carry_ = sending_compressed_ && !sending_final_frame_ ?
+		std::min<std::size_t>(payloadSize, 4) : 0;
+		payloadSize -= write_buffer_carry_;
+		
 		// Make a frame header.
 		web_socket_frame_header hdr = sent_message_header_.frame_header();
 		hdr.fin = sending_final_frame_;
-		hdr.payload_length = static_cast<std::uint64_t>(write_buffer_pos_ - write_buffer_start_pos);
+		hdr.payload_length = static_cast<std::uint64_t>(payloadSize);
 		hdr.masking_key = key;
 		if (!sending_first_frame_) {
 			hdr.opcode = web_socket_opcode::continuation;
+			hdr.reserved1 = false;
 		} else {
 			sending_first_frame_ = false;
 		}
 		
 		// Compute the header length.
-		std::size_t headerSize = 2;
-		if (hdr.masking_key) {
-			headerSize += 4;
-		}
-		if (hdr.payload_length > 65535) {
-			headerSize += 8;
-		} else if (hdr.payload_length >= 126) {
-			headerSize += 2;
-		}
+		std::size_t headerSize = web_socket_frame_header_size(hdr);
 		assert(headerSize < write_buffer_start_pos);
 		write_buffer_real_start_pos = write_buffer_start_pos - headerSize;
 		
 		// Make the header contents.
 		char *data = write_buffer_.data() + write_buffer_real_start_pos;
-		
-		// FIXME: unaligned memory access possible
-		std::uint16_t prologue = 0;
-		if (hdr.fin) prologue |= 0x8000;
-		if (hdr.reserved1) prologue |= 0x4000;
-		if (hdr.reserved2) prologue |= 0x2000;
-		if (hdr.reserved3) prologue |= 0x1000;
-		prologue |= static_cast<std::uint16_t>(hdr.opcode) << 8;
-		if (hdr.masking_key) prologue |= 0x80;
-		if (hdr.payload_length > 65535) {
-			prologue |= 127;
-		} else if (hdr.payload_length >= 126) {
-			prologue |= 126;
-		} else {
-			prologue |= static_cast<std::uint16_t>(hdr.payload_length);
-		}
-		*reinterpret_cast<std::uint16_t *>(data) = detail::host_to_network(prologue);
-		data += 2;
-		
-		if (hdr.payload_length > 65535) {
-			*reinterpret_cast<std::uint64_t *>(data) = detail::host_to_network(hdr.payload_length);
-			data += 8;
-		} else if (hdr.payload_length >= 126) {
-			*reinterpret_cast<std::uint16_t *>(data) = detail::host_to_network(static_cast<std::uint16_t>(hdr.payload_length));
-			data += 2;
-		}
-		
-		if (hdr.masking_key) {
-			*reinterpret_cast<std::uint32_t *>(data) = *hdr.masking_key;
-			data += 4;
-		}
+		data += encode_web_socket_frame_header(hdr, data);
 		
 		assert(data - write_buffer_.data() == write_buffer_start_pos);
 		
 		// Mask the payload.
 		if (masker) {
-			masker->apply(data, write_buffer_pos_ - write_buffer_start_pos);
+			masker->apply(data, payloadSize);
 		}
 		
 		send_frame_op<typename std::remove_reference<Callback>::type> op
@@ -1724,14 +2085,90 @@ namespace asiows
 	void web_socket<NextLayer>::async_send_message(const web_socket_message_header &header,
 												   ConstBufferSequence &&buffers, Callback &&cb)
 	{
+		web_socket_message_header hdr = header;
+		if (hdr.reserved1 && deflate_params_ &&
+			_asio::buffer_size(buffers) < deflate_params_->min_message_size) {
+			// Too small to benefit from compression.
+			hdr.reserved1 = false;
+		}
+		
 		send_message_op<
 		typename std::remove_reference<ConstBufferSequence>::type,
 		typename std::remove_reference<Callback>::type>
 		op(*this, std::forward<ConstBufferSequence>(buffers), std::forward<Callback>(cb));
-		op.perform(header);
+		op.perform(hdr);
 	}
 	
 	
+	template <class NextLayer>
+	template <class ConstBufferSequence, class Callback>
+	class web_socket<NextLayer>::send_encoded_message_op: public detail::intermediate_op<Callback>
+	{
+		enum class op_state_t {
+			begin,
+			write
+		};
+		web_socket& parent;
+		ConstBufferSequence seq;
+		op_state_t state = op_state_t::begin;
+		
+	public:
+		template <class ConstBufferSequenceArg>
+		send_encoded_message_op(web_socket &parent, ConstBufferSequenceArg&& seq, const Callback& cb):
+		detail::intermediate_op<Callback>(cb),
+		parent(parent),
+		seq(std::forward<ConstBufferSequenceArg>(seq)) { }
+		template <class ConstBufferSequenceArg>
+		send_encoded_message_op(web_socket &parent, ConstBufferSequenceArg&& seq, Callback&& cb):
+		detail::intermediate_op<Callback>(cb),
+		parent(parent),
+		seq(std::forward<ConstBufferSequenceArg>(seq)) { }
+		
+		void operator () (const boost::system::error_code& ec, std::size_t count = 0)
+		{
+			switch (state) {
+				case op_state_t::begin:
+					if (ec) {
+						this->callback(ec);
+						return;
+					}
+					state = op_state_t::write;
+					perform();
+					break;
+				case op_state_t::write:
+					if (ec) {
+						parent.frame_write_failed();
+					}
+					parent.end_message_write();
+					this->callback(ec);
+					break;
+			}
+		}
+		
+		void perform()
+		{
+			switch (state) {
+				case op_state_t::begin:
+					parent.async_begin_write(web_socket_message_header(), std::move(*this));
+					break;
+				case op_state_t::write:
+					_asio::async_write(parent.next_layer(), seq, std::move(*this));
+					break;
+			}
+		}
+	};
+	
+	template <class NextLayer>
+	template <class ConstBufferSequence, class Callback>
+	void web_socket<NextLayer>::async_send_encoded_message(ConstBufferSequence &&buffers, Callback &&cb)
+	{
+		send_encoded_message_op<
+		typename std::remove_reference<ConstBufferSequence>::type,
+		typename std::remove_reference<Callback>::type>
+		op(*this, std::forward<ConstBufferSequence>(buffers), std::forward<Callback>(cb));
+		op.perform();
+	}
+	
 	template <class NextLayer>
 	template <class Callback>
 	class web_socket<NextLayer>::pong_op: public detail::intermediate_op<Callback>
@@ -2259,6 +2696,61 @@ namespace asiows
 		http_1_1
 	};
 	
+	namespace detail
+	{
+		// Incremental parser of the HTTP request starting a WebSocket
+		// handshake. Works directly on the read buffer and doesn't allocate;
+		// the parsed strings point into the buffer.
+		class http_request_parser
+		{
+		public:
+			enum class element
+			{
+				// No complete line yet. Call again with the same <begin> once
+				// more data is appended.
+				need_more,
+				
+				// <method>, <request_uri>, <abs_path>, <version_major> and
+				// <version_minor> are available.
+				request_line,
+				
+				// <name> and <value> are available.
+				header,
+				
+				// The empty line ending the request.
+				end,
+				
+				// Malformed request. <status> is the status code to respond with.
+				error
+			};
+			
+			// Parses the next line in [begin, end), and advances <begin> past it.
+			element next(const char *&begin, const char *end);
+			
+			bool request_line_read() const { return request_line_read_; }
+			
+			boost::string_ref method;
+			boost::string_ref request_uri;
+			boost::string_ref abs_path; // Request-URI converted to abs_path
+			boost::string_ref version_major;
+			boost::string_ref version_minor;
+			
+			boost::string_ref name;
+			boost::string_ref value;
+			
+			int status = 0;
+			
+		private:
+			bool request_line_read_ = false;
+			
+			// Number of bytes at <begin> already known not to contain CRLF.
+			std::size_t scanned_ = 0;
+			
+			element parse_request_line(const char *begin, const char *end);
+			element parse_header(const char *begin, const char *end);
+		};
+	}
+	
 	// Simple HTTP server that only accepts WebSocket.
 	template <class NextLayer>
 	class web_socket_server
@@ -2303,8 +2795,7 @@ namespace asiows
 		web_socket_server(Args &&...args) :
 		next_(std::forward<Args>(args)...),
 		content_stream_(*this),
-		socket_(content_stream_),
-		streambuf_(1024) { }
+		socket_(content_stream_) { }
 		
 		socket_type& socket() { return socket_; }
 		
@@ -2314,6 +2805,11 @@ namespace asiows
 		const std::string& origin() const { return http_origin_; }
 		const std::string& encoded_protocols() const { return http_sec_websocket_protocol_; }
 		
+		// Sets the policy of negotiating permessage-deflate. Takes effect
+		// on the next <async_accept>.
+		void set_deflate_options(const web_socket_deflate_options& options)
+		{ deflate_options_ = options; }
+		
 		bool handshake_done() const { return handshake_state_ == handshake_state_t::done; }
 		
 		template <class Callback>
@@ -2330,11 +2826,17 @@ namespace asiows
 		content_stream content_stream_;
 		socket_type socket_;
 		handshake_state_t handshake_state_ = handshake_state_t::initial;
-		boost::asio::streambuf streambuf_;
-		std::vector<char> buffer_;
-		std::string const separator_ { "\r\n" };
 		
-		bool reading_request_line_ = true;
+		// Limit HTTP header size to prevent DoS.
+		static const std::size_t max_header_size = 65536 * 2;
+		
+		// Holds the request being parsed. Starts small and grows up to
+		// <max_header_size> for long lines. Data following the request is
+		// passed to <socket_>.
+		std::vector<char> buffer_ = std::vector<char>(1024);
+		std::size_t buffer_begin_ = 0;
+		std::size_t buffer_end_ = 0;
+		detail::http_request_parser parser_;
 		
 		enum http_version http_version_;
 		http_absolue_path http_absolute_path_;
@@ -2342,10 +2844,14 @@ namespace asiows
 		std::string http_origin_;
 		bool http_upgrade_valid_ = false;
 		bool http_connection_valid_ = false;
-		std::string http_sec_websocket_key_;
+		std::array<char, 24> http_sec_websocket_key_;
+		bool http_sec_websocket_key_valid_ = false;
 		std::string http_sec_websocket_protocol_;
-		std::string http_sec_websocket_version_;
+		bool http_sec_websocket_version_valid_ = false;
+		std::string http_sec_websocket_extensions_;
 		std::size_t http_header_total = 0;
+		
+		web_socket_deflate_options deflate_options_;
 	
 		template <class Callback>
 		class start_handshake_op;
@@ -2367,6 +2873,15 @@ namespace asiows
 			return;
 		}
 		
+		if (server.buffer_begin_ < server.buffer_end_) {
+			// Data the client sent right after the request.
+			auto count = _asio::buffer_copy(buffers, _asio::buffer(server.buffer_.data() + server.buffer_begin_,
+																	server.buffer_end_ - server.buffer_begin_));
+			server.buffer_begin_ += count;
+			cb(boost::system::error_code(), count);
+			return;
+		}
+		
 		server.next_layer().async_read_some(buffers, std::forward<Callback>(cb));
 	}
 	
@@ -2383,24 +2898,6 @@ namespace asiows
 		server.next_layer().async_write_some(buffers, std::forward<Callback>(cb));
 	}
 	
-	namespace detail
-	{
-		struct web_socket_server_regex_t
-		{
-			std::string const method_ { "(OPTIONS|GET|HEAD|POST|PUT|DELETE|TRACE|CONNECT)" };
-			std::string const request_uri_ { "(\\*|(?:[a-z0-9]+\\:\\/*[^/]+)?\\/[^ ]*)" }; // "authority" format is not included
-			std::string const http_version_ { "HTTP/([0-9]{1,4})\\.([0-9]{1,4})" };
-			std::regex const requestLineRegex
-			{ method_ + " " + request_uri_ + " " + http_version_,
-				std::regex_constants::optimize | std::regex_constants::icase };
-			std::regex const absoluteUriRegex
-			{ "[a-z0-9]+\\:\\/*[^/]+(\\/[^ ]*)",
-				std::regex_constants::optimize | std::regex_constants::icase };
-		};
-		
-		extern const web_socket_server_regex_t& web_socket_server_regex();
-	}
-	
 	template <class NextLayer>
 	template <class Callback>
 	class web_socket_server<NextLayer>::start_handshake_op :
@@ -2425,205 +2922,184 @@ namespace asiows
 			}
 			
 			if (error) {
-				// TODO: raise "Request URI Too Long" when URI is too long?
-				if (false) {
-					fail(make_error_code(boost::system::errc::protocol_error),
-						 http_status_codes::request_uri_too_long);
-				} else {
-					fail(error, http_status_codes::bad_request);
-				}
-				return;
-			} else if (count < 2) {
 				fail(error, http_status_codes::bad_request);
 				return;
 			}
 			
-			auto& buf = parent.buffer_;
-			buf.resize(count);
-			std::istream stream(&parent.streambuf_);
-			stream.read(buf.data(), count);
-			std::string s(buf.data(), buf.size() - 2);
-			
+			parent.buffer_end_ += count;
 			parent.http_header_total += count;
-			if (parent.http_header_total > 65536 * 2) {
-				// Limit HTTP header size to prevent DoS.
+			if (parent.http_header_total > max_header_size) {
 				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::request_entity_too_large);
 				return;
 			}
 			
-			if (parent.reading_request_line_) {
-				// HTTP Requset Line
-				if (s.size() == 0) {
-					// Empty request line.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
-				}
-				
-				std::smatch matches;
-				if (!std::regex_match(s, matches, detail::web_socket_server_regex().requestLineRegex)) {
-					// Unrecognizable request line.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
-				}
-				
-				assert(matches.size() == 5);
-				
-				// Check HTTP-Version.
-				if (matches[3].str() == "1") {
-					if (matches[4].str() == "0") {
-						parent.http_version_ = http_version::http_1_0;
-					} else if (matches[4].str() == "1") {
-						parent.http_version_ = http_version::http_1_1;
-					} else {
-						goto unsupportedHttpVersion;
-					}
-				} else {
-					// Unsupported HTTP version.
-				unsupportedHttpVersion:
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::http_version_not_supported);
-					return;
-				}
-				
-				// Check Method.
-				const auto& httpMethod = matches[1].str();
-				if (!boost::iequals(httpMethod, "GET")) {
-					// Unsupported method.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::method_not_allowed);
-					return;
-				}
-				
-				// Check Request-URI.
-				auto requestUri = matches[2].str();
-				
-				if (requestUri == "*" || requestUri.size() == 0) {
-					// Invalid Request-URI.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::not_implemented);
-					return;
-				}
-				
-				if (requestUri[0] != '/') {
-					// absoluteURI. Convert to abs_path.
-					if (!std::regex_match(requestUri, matches, detail::web_socket_server_regex().absoluteUriRegex)) {
-						// Failed (this is unlikely to happen)
-						fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::internal_server_error);
+			auto& parser = parent.parser_;
+			const char *data = parent.buffer_.data();
+			const char *begin = data + parent.buffer_begin_;
+			const char *end = data + parent.buffer_end_;
+			
+			while (true) {
+				switch (parser.next(begin, end)) {
+					case detail::http_request_parser::element::need_more:
+						break;
+					case detail::http_request_parser::element::error:
+						fail(make_error_code(boost::system::errc::protocol_error), parser.status);
+						return;
+					case detail::http_request_parser::element::request_line:
+						if (!handle_request_line())
+							return;
+						continue;
+					case detail::http_request_parser::element::header:
+						handle_header();
+						continue;
+					case detail::http_request_parser::element::end:
+						parent.buffer_begin_ = begin - data;
+						handle_end();
 						return;
-					}
-					
-					requestUri = matches[1].str();
-				}
-				
-				parent.http_absolute_path_ = http_absolue_path(requestUri);
-				
-				parent.reading_request_line_ = false;
-			} else if (s.empty()) {
-				// End of the HTTP Request.
-				// Validate the header.
-				
-				if (parent.http_version_ == http_version::http_1_0) {
-					// HTTP 1.0 is prohibited by [RFC 4.2.1].
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
-				}
-				
-				if (parent.http_version_ == http_version::http_1_1 &&
-					parent.http_host_.empty()) {
-					// HTTP 1.1 mandates Host header.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
-				}
-				
-				if (!parent.http_upgrade_valid_ ||
-					!parent.http_connection_valid_) {
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
-				}
-				
-				if (parent.http_sec_websocket_key_.size() != 24) {
-					// Sec-WebSocket-Key must be 24 bytes long.
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
-					return;
 				}
-				
-				if (parent.http_sec_websocket_version_ != "13") {
-					fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
+				break;
+			}
+			
+			// Move the incomplete line to the beginning of the buffer.
+			std::size_t remaining = end - begin;
+			std::memmove(parent.buffer_.data(), begin, remaining);
+			parent.buffer_begin_ = 0;
+			parent.buffer_end_ = remaining;
+			
+			perform();
+		}
+		
+		void perform()
+		{
+			auto& buffer = parent.buffer_;
+			if (parent.buffer_end_ == buffer.size()) {
+				if (buffer.size() >= max_header_size) {
+					// Line too long.
+					fail(make_error_code(boost::system::errc::protocol_error),
+						 parent.parser_.request_line_read() ?
+						 http_status_codes::bad_request :
+						 http_status_codes::request_uri_too_long);
 					return;
 				}
-				
-				// Validated.
-				parent.handshake_state_ = handshake_state_t::read_header;
-				this->callback(boost::system::error_code());
-				
-				return;
-				
-			} else {
-				// HTTP Header
-				
-				// Make sure there's no line continuation.
-				// (If header contains a quoted-string, it might span
-				//  across the lines. Might be HTTP injection attack.)
-				{
-					bool quot = false;
-					for (std::size_t i = 0; i < s.size(); ) {
-						if (quot) {
-							if (s[i] == '"') {
-								quot = false;
-								++i;
-							} else if (s[i] == '\\') {
-								i += 2;
-							} else {
-								++i;
-							}
-						} else {
-							if (s[i] == '"') {
-								quot = true;
-							}
-							++i;
-						}
-					}
-					
-					if (quot) {
-						// quoted-string spanning across the lines.
-						fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::not_implemented);
-						return;
-					}
-				}
+				auto size = buffer.size() * 2;
+				if (size > max_header_size)
+					size = max_header_size;
+				buffer.resize(size);
+			}
+			parent.next_layer().async_read_some
+			(_asio::buffer(parent.buffer_.data() + parent.buffer_end_,
+						   parent.buffer_.size() - parent.buffer_end_),
+			 std::move(*this));
+		}
+		
+	private:
+		bool handle_request_line()
+		{
+			const auto& parser = parent.parser_;
 			
-				auto index = s.find(':');
-				auto name = s.substr(0, index);
-				auto value = s.substr(index + 1);
-				boost::trim(name);
-				boost::trim(value);
-				
-				if (boost::iequals(name, "Host")) {
-					parent.http_host_ = value;
-				} else if (boost::iequals(name, "Upgrade")) {
-					parent.http_upgrade_valid_ = boost::iequals(value, "websocket");
-				} else if (boost::iequals(name, "Connection")) {
-					parent.http_connection_valid_ = boost::iequals(value, "Upgrade");
-				} else if (boost::iequals(name, "Origin")) {
-					parent.http_origin_ = value;
-				} else if (boost::iequals(name, "Sec-WebSocket-Version")) {
-					parent.http_sec_websocket_version_ = value;
-				} else if (boost::iequals(name, "Sec-WebSocket-Key")) {
-					parent.http_sec_websocket_key_ = value;
-				} else if (boost::iequals(name, "Sec-WebSocket-Protocol")) {
-					parent.http_sec_websocket_protocol_ = value;
+			// Check HTTP-Version.
+			if (parser.version_major == "1") {
+				if (parser.version_minor == "0") {
+					parent.http_version_ = http_version::http_1_0;
+				} else if (parser.version_minor == "1") {
+					parent.http_version_ = http_version::http_1_1;
 				} else {
-					// Ignore for now...
+					goto unsupportedHttpVersion;
 				}
+			} else {
+				// Unsupported HTTP version.
+			unsupportedHttpVersion:
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::http_version_not_supported);
+				return false;
 			}
 			
-			perform();
+			// Check Method.
+			if (!boost::iequals(parser.method, "GET")) {
+				// Unsupported method.
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::method_not_allowed);
+				return false;
+			}
 			
+			// Check Request-URI.
+			if (parser.abs_path.empty()) {
+				// "*" is not a valid Request-URI here.
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::not_implemented);
+				return false;
+			}
+			
+			parent.http_absolute_path_ = http_absolue_path(parser.abs_path.to_string());
+			return true;
+		}
+		
+		void handle_header()
+		{
+			const auto& name = parent.parser_.name;
+			const auto& value = parent.parser_.value;
+			
+			if (boost::iequals(name, "Host")) {
+				parent.http_host_.assign(value.data(), value.size());
+			} else if (boost::iequals(name, "Upgrade")) {
+				parent.http_upgrade_valid_ = boost::iequals(value, "websocket");
+			} else if (boost::iequals(name, "Connection")) {
+				parent.http_connection_valid_ = boost::iequals(value, "Upgrade");
+			} else if (boost::iequals(name, "Origin")) {
+				parent.http_origin_.assign(value.data(), value.size());
+			} else if (boost::iequals(name, "Sec-WebSocket-Version")) {
+				parent.http_sec_websocket_version_valid_ = value == "13";
+			} else if (boost::iequals(name, "Sec-WebSocket-Key")) {
+				// Sec-WebSocket-Key must be 24 bytes long.
+				auto& key = parent.http_sec_websocket_key_;
+				parent.http_sec_websocket_key_valid_ = value.size() == key.size();
+				if (parent.http_sec_websocket_key_valid_)
+					std::memcpy(key.data(), value.data(), key.size());
+			} else if (boost::iequals(name, "Sec-WebSocket-Protocol")) {
+				parent.http_sec_websocket_protocol_.assign(value.data(), value.size());
+			} else if (boost::iequals(name, "Sec-WebSocket-Extensions")) {
+				// May appear more than once. [RFC 6455 11.3.2]
+				auto& extensions = parent.http_sec_websocket_extensions_;
+				if (!extensions.empty())
+					extensions += ", ";
+				extensions.append(value.data(), value.size());
+			} else {
+				// Ignore for now...
+			}
 		}
 		
-		void perform()
+		void handle_end()
 		{
-			_asio::async_read_until(parent.next_layer(), parent.streambuf_,
-									parent.separator_, std::move(*this));
+			// End of the HTTP Request.
+			// Validate the header.
+			
+			if (parent.http_version_ == http_version::http_1_0) {
+				// HTTP 1.0 is prohibited by [RFC 4.2.1].
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
+				return;
+			}
+			
+			if (parent.http_version_ == http_version::http_1_1 &&
+				parent.http_host_.empty()) {
+				// HTTP 1.1 mandates Host header.
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
+				return;
+			}
+			
+			if (!parent.http_upgrade_valid_ ||
+				!parent.http_connection_valid_) {
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
+				return;
+			}
+			
+			if (!parent.http_sec_websocket_key_valid_ ||
+				!parent.http_sec_websocket_version_valid_) {
+				fail(make_error_code(boost::system::errc::protocol_error), http_status_codes::bad_request);
+				return;
+			}
+			
+			// Validated.
+			parent.handshake_state_ = handshake_state_t::read_header;
+			this->callback(boost::system::error_code());
 		}
 		
-	private:
 		void fail(const boost::system::error_code &error,
 				  int status)
 		{
@@ -2705,11 +3181,21 @@ namespace asiows
 			
 			detail::base64_encode(digestBase64, digestBytes, 20);
 			
+			std::string extensions;
+			auto deflate = detail::negotiate_web_socket_deflate
+			(parent.http_sec_websocket_extensions_, parent.deflate_options_, extensions);
+			if (deflate) {
+				parent.socket_.set_deflate_params(*deflate);
+			}
+			
 			std::ostringstream s;
 			s << "HTTP/1.1 101 Switching Protocols\r\n";
 			s << "Upgrade: websocket\r\n";
 			s << "Connection: Upgrade\r\n";
 			s << "Sec-WebSocket-Protocol: " << protocol << "\r\n";
+			if (!extensions.empty()) {
+				s << "Sec-WebSocket-Extensions: " << extensions << "\r\n";
+			}
 			s << "Sec-WebSocket-Accept: " << digestBase64 << "\r\n";
 			s << "\r\n";
 			buffer = std::make_shared<std::string>(s.str());